@@ -36,6 +36,10 @@
  * Each message read from a virtual maildir has an X-Label header inserted
  * on-the-fly, containing the concatenation of the notmuch tags of this
  * message (comma separated), up to #MAX_XLABEL_LENGTH characters long.
+ *
+ * With the 'xattr_tags' option, the header is left out, so messages read
+ * exactly like the real files. Either way, the tags are also available as
+ * the #XATTR_TAGS extended attribute of each message.
  */
 
 /*============================================================================*/
@@ -44,10 +48,12 @@
 
 #include <sys/types.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -58,7 +64,18 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/param.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <ctype.h>
+#include <zlib.h>
+#ifdef NOTMUCHFS_ZSTD
+#include <zstd.h>
+#endif
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
@@ -96,6 +113,13 @@ struct notmuchfs_config {
    */
   char *delete_tag;
 
+  /**
+   * A real maildir (inside mail_dir) in which to store messages delivered
+   * into virtual maildirs. May be NULL, in which case delivery is not
+   * supported.
+   */
+  char *deliver_dir;
+
   /**
    * Mutt is not compliant with the maildir spec, see:
    * - http://dev.mutt.org/trac/ticket/2476
@@ -103,6 +127,130 @@ struct notmuchfs_config {
    * Notmuchfs can workaround this issue if this field is set.
    */
   bool  mutt_2476_workaround_allowed;
+
+  /**
+   * How long (in seconds) a cached query listing may be used without
+   * checking for database changes, if the database can't be watched.
+   */
+  unsigned cache_ttl;
+
+  /**
+   * The absolute path of the mount point, through which notmuchfs touches
+   * its own directories to generate change notifications.
+   */
+  char *mountpoint;
+
+  /**
+   * The maximum time (in milliseconds) that the database writer thread waits
+   * for more updates to arrive before committing a batch.
+   */
+  unsigned writer_delay_ms;
+
+  /**
+   * The maximum number of queued database updates that the writer thread
+   * applies in a single transaction.
+   */
+  unsigned writer_batch_size;
+
+  /**
+   * The maximum number of worker threads for each class of database
+   * operation.
+   */
+  unsigned threads;
+
+  /**
+   * The maximum number of idle worker threads kept for each class of
+   * database operation.
+   */
+  unsigned max_idle_threads;
+
+  /**
+   * The CPUs to run worker threads on, as a list such as "0-3,6", or NULL
+   * for any.
+   */
+  char *cpu_affinity;
+
+  /** 'cpu_affinity' parsed. */
+  cpu_set_t cpus;
+
+  /**
+   * The directories that message files are stored in, as a list such as
+   * "local:/nfs/mail" (relative to mail_dir), fastest first, or NULL. Of
+   * duplicate copies of a message, one in the fastest is used.
+   */
+  char *file_tiers;
+
+  /** 'file_tiers' parsed, as absolute paths. */
+  char   **tiers;
+  unsigned n_tiers;
+
+  /**
+   * Whether to use, of duplicate copies of a message (in the same tier), one
+   * already in the page cache.
+   */
+  bool prefer_cached;
+
+  /**
+   * The number of database jobs per second above which a client process is
+   * considered to be doing bulk access, and given lower priority. 0 to
+   * disable.
+   */
+  unsigned bulk_threshold;
+
+  /**
+   * The maximum number of message file names remembered not to exist, 0 to
+   * disable.
+   */
+  unsigned negative_cache;
+
+  /**
+   * Whether the FUSE 'negative_timeout' option was given. If not, a short
+   * one is used by default.
+   */
+  bool negative_timeout_given;
+
+  /**
+   * Whether to list messages in order of their real inode number, rather
+   * than newest first, so that reading them all seeks less.
+   */
+  bool sort_by_inode;
+
+  /**
+   * Whether to leave the X-Label header out of messages, so they read
+   * exactly like the real files, and tags are only available as extended
+   * attributes.
+   */
+  bool xattr_tags;
+
+  /**
+   * Whether each message has a '.parts/' directory of its MIME parts, see
+   * @ref mime_parts.
+   */
+  bool mime_parts;
+
+  /**
+   * Whether to read gzip (and zstd) compressed message files decompressed,
+   * see @ref compressed.
+   */
+  bool compressed;
+
+  /**
+   * The maximum size, in MiB, of the decompressed content of compressed
+   * messages kept in memory.
+   */
+  unsigned compressed_cache;
+
+  /**
+   * Whether to keep the tags of every message in memory, to answer queries
+   * made only of tags without searching the database, see @ref tag_index.
+   */
+  bool tag_index;
+
+  /**
+   * Whether to list a query directory while its query is still running,
+   * see cache_stream().
+   */
+  bool stream_listings;
 };
 
 static struct notmuchfs_config global_config;
@@ -128,6 +276,31 @@ static struct notmuchfs_config global_config;
  */
 #define XLABEL "X-Label: "
 
+/**
+ * The length of the X-Label header that messages are read with, by which
+ * their size is inflated.
+ */
+#define XLABEL_LENGTH (global_config.xattr_tags ? 0 : MAX_XLABEL_LENGTH)
+
+/**
+ * The extended attribute of each message that holds its tags.
+ */
+#define XATTR_TAGS "user.notmuch.tags"
+
+/**
+ * Make the inode number of a virtual file or directory, from that of the
+ * real file or directory it copies the attributes of. The 'kind' (1 to 255)
+ * goes in the top byte, which real inode numbers don't reach, so e.g. cur/
+ * doesn't have the inode number of its parent, upsetting find(1).
+ */
+#define VIRTUAL_INO(INO, KIND) ((ino_t)(INO) ^ ((ino_t)(KIND) << 56))
+
+/**
+ * The FUSE 'negative_timeout' (in seconds) used unless one is given, for how
+ * long the kernel may remember that a name doesn't exist.
+ */
+#define DEFAULT_NEGATIVE_TIMEOUT "1"
+
 /*============================================================================*/
 
 /** Lock a pthread mutex with error checking. */
@@ -159,225 +332,7110 @@ static struct notmuchfs_config global_config;
 /*============================================================================*/
 
 /**
- * The context required to deal with the notmuch database.
+ * An entry in a #strmap_t.
  */
-typedef struct
+typedef struct strmap_entry
 {
- /** Mutex to protect the database object from concurrent access. */
- pthread_mutex_t     mutex;
-
- /** The notmuch database handle. May be NULL if the database is not opened. */
- notmuch_database_t *db;
+ struct strmap_entry *next;
+ size_t               hash;
+ char                *key;
+ void                *value;
+} strmap_entry_t;
 
- /** Newline-delimited string list of tags to exclude from results. */
- char               *excluded_tags;
-} notmuch_context_t;
+/**
+ * A simple hash map from strings to pointers, using separate chaining. Keys
+ * are copied into the map, values are owned by the caller. Not thread-safe.
+ */
+typedef struct
+{
+ strmap_entry_t **buckets;
+ size_t           n_buckets;
+ size_t           count;
+} strmap_t;
 
 /*============================================================================*/
 
 /**
- * Replace every instance of character 'old' with 'new' in 'str_in'.
- *
- * @param[in,out] str_in The string to replace within.
- * @param[in]     old    The character to replace.
- * @param[in]     new    The character to replace with.
+ * The type of a database update queued for the writer thread.
  */
-static void string_replace (char *str_in, char old, char new)
+typedef enum
 {
- char *str = str_in;
-
- while (*str != '\0') {
-   if (*str == old)
-     *str = new;
-   str++;
- }
-}
+ /** Apply global_config.delete_tag to the message with this file name. */
+ WRITER_OP_DELETE_TAG,
+ /** Add a newly delivered message file to the database. */
+ WRITER_OP_INDEX
+} writer_op_type_t;
 
-/*============================================================================*/
+/**
+ * A database update queued for the writer thread.
+ */
+typedef struct writer_op
+{
+ struct writer_op *next;
+ writer_op_type_t  type;
+ /** The real (backing maildir) file name of the message. */
+ char             *filename;
+ /**
+  * For #WRITER_OP_INDEX, newline-delimited list of tags to add to the
+  * message. May be NULL.
+  */
+ char             *tags;
+} writer_op_t;
 
 /**
- * Open the notmuch database inside this context. Continue trying forever
- * if the open fails (e.g. the database was locked).
- *
- * @param[in,out] p_ctx      The notmuch context.
- * @param[in]     need_write Whether to open the database in read-only or
- *                           read-write mode.
- * @pre Database must not already be open.
+ * The database writer thread, which applies queued updates in batches, in as
+ * few transactions as possible.
  */
-static void database_open (notmuch_context_t *p_ctx, bool need_write)
+typedef struct
 {
- LOG_TRACE("notmuch database_open\n");
- PTHREAD_LOCK(&p_ctx->mutex);
- assert(p_ctx->db == NULL);
+ pthread_t        thread;
 
- while (TRUE) {
-   notmuch_status_t status =
-     notmuch_database_open(global_config.mail_dir,
-                           need_write ?
-                             NOTMUCH_DATABASE_MODE_READ_WRITE:
-                             NOTMUCH_DATABASE_MODE_READ_ONLY,
-                           &p_ctx->db);
+ /** Mutex to protect everything below. */
+ pthread_mutex_t  mutex;
 
-   if (status == NOTMUCH_STATUS_SUCCESS) {
-     break;
-   }
-   else if (status == NOTMUCH_STATUS_XAPIAN_EXCEPTION) {
-     /* Try again. */
-     sleep(1);
-   }
-   else {
-     fprintf(stderr, "ERROR: Database open error.\n");
-     exit(1);
-   }
- }
+ /** Signalled when an update is queued, or the thread should stop. */
+ pthread_cond_t   cond;
 
- if (notmuch_database_needs_upgrade(p_ctx->db)) {
-   fprintf(stderr, "ERROR: Database needs upgrade.\n");
-   exit(1);
- }
-}
+ /** The queue of updates not yet started, oldest first. */
+ writer_op_t     *head;
+ writer_op_t     *tail;
+ size_t           queued;
+
+ /**
+  * Real file names with a #WRITER_OP_DELETE_TAG update that is not yet
+  * committed, mapping to the op. These are hidden from directory listings.
+  */
+ strmap_t         pending_deletes;
+
+ /** Whether the thread should exit once the queue is empty. */
+ bool             stop;
+} writer_t;
 
 /*============================================================================*/
 
 /**
- * Close the notmuch database inside this context.
- *
- * @param[in,out] p_ctx The notmuch context.
- * @pre Database must be open.
+ * A message in a materialized query listing.
  */
-static void database_close (notmuch_context_t *p_ctx)
+typedef struct
 {
- LOG_TRACE("notmuch database_close\n");
- assert(p_ctx->db != NULL);
- notmuch_database_close(p_ctx->db);
- notmuch_database_destroy(p_ctx->db);
- p_ctx->db = NULL;
- PTHREAD_UNLOCK(&p_ctx->mutex);
-}
+ /** The virtual message name (see @ref message_names). */
+ char        *name;
+ /** The message ID. */
+ char        *id;
+ /** The attributes of the real message file, as given to readdir(). */
+ struct stat  st;
+ /** Whether the message was deleted through notmuchfs. */
+ bool         deleted;
+ /**
+  * The length of the header block of the real message file, for the
+  * headers-only view, or 0 if not known yet.
+  */
+ off_t        header_length;
+} listing_entry_t;
 
-/*============================================================================*/
+/**
+ * A listing entry packed for readdir(), in listing_t::dirents.
+ */
+typedef struct
+{
+ /** The index of the entry in listing_t::entries. */
+ size_t index;
+ /** The length of the record, including the name and padding. */
+ size_t length;
+ /** The inode number and mode of the real message file. */
+ ino_t  ino;
+ mode_t mode;
+ /** The virtual message name. */
+ char   name[];
+} listing_dirent_t;
 
-/* FUSE operations. */
+/**
+ * The length of a listing_dirent_t record, keeping the next one aligned.
+ */
+#define LISTING_DIRENT_LENGTH(NAME_LENGTH) \
+  ((offsetof(listing_dirent_t, name) + (NAME_LENGTH) + sizeof(size_t)) & \
+   ~(sizeof(size_t) - 1))
 
-/** The maximum length of the tag exclusion string. Arbitrarily chosen. */
-#define EXCLUDED_TAGS_MAX_LENGTH 128
+/**
+ * How a cached listing is kept up to date. Set for each query directory with
+ * extended attributes on its backing store directory, see policy_read().
+ */
+typedef struct
+{
+ /**
+  * How long (in seconds) the listing may be used for without being
+  * refreshed, even if the database changed. -1 for the default: as long as
+  * the database doesn't change, or global_config.cache_ttl if it can't be
+  * watched.
+  */
+ int  ttl;
+ /** Whether to refresh by rebuilding from scratch, not applying changes. */
+ bool full_refresh;
+ /**
+  * Whether to serve an out of date listing immediately, while it's
+  * refreshed in the background.
+  */
+ bool serve_stale;
+} listing_policy_t;
 
-static void *notmuchfs_init (struct fuse_conn_info *conn)
+/**
+ * The materialized result of a notmuch query: the name and attributes of
+ * every message. Shared between the cache and open directory handles, and
+ * freed when the last reference is dropped.
+ *
+ * Once built, only the entries' 'name', 'deleted' and 'header_length', and
+ * 'index', 'dirents', 'revision', 'built', 'last_used', 'policy' and 'refs'
+ * change, all protected by the cache mutex. While a listing is being
+ * streamed, its 'entries' grow too, also under the cache mutex.
+ */
+typedef struct
 {
- (void)conn;
+ /** The notmuch query (after symlink dereferencing). */
+ char            *query;
 
- int res = chdir(global_config.backing_dir);
- if (res == -1)
-   return NULL;
+ listing_entry_t *entries;
+ size_t           n_entries;
 
- notmuch_context_t *p_ctx = malloc(sizeof(notmuch_context_t));
- memset(p_ctx, 0, sizeof(notmuch_context_t));
- res = pthread_mutex_init(&p_ctx->mutex, NULL);
- if (res != 0) {
-   free(p_ctx);
-   return NULL;
- }
+ /** The number of messages the query returned, including missing files. */
+ size_t           n_messages;
 
- /* Fetch the list of excluded tags from notmuch config.
-  * If only there was an API for this...
+ /** Index of virtual message names to entries. */
+ strmap_t         index;
+
+ /**
+  * The entries not deleted, packed back to back for readdir(), or NULL if
+  * not packed since the listing was built, or an entry last changed. See
+  * listing_dirents_locked().
   */
- p_ctx->excluded_tags = malloc(EXCLUDED_TAGS_MAX_LENGTH);
- p_ctx->excluded_tags[0] = '\0';
- FILE *fp = popen("notmuch config get search.exclude_tags", "r");
- if (fp != NULL) {
-   size_t bytes_read = fread(p_ctx->excluded_tags, 1, EXCLUDED_TAGS_MAX_LENGTH,
-                             fp);
-   if (bytes_read > 0) {
-     p_ctx->excluded_tags[bytes_read - 1] = '\0';
-   }
-   (void)pclose(fp);
- }
+ char            *dirents;
+ size_t           dirents_length;
+ /** Incremented each time 'dirents' is packed, see opendir_t. */
+ unsigned long    dirents_generation;
 
- return p_ctx;
-}
+ /** The database revision that this listing is known to be correct for. */
+ unsigned long    revision;
 
-/*============================================================================*/
+ /** When this listing was built, or last found to be up to date. */
+ time_t           built;
 
-static void notmuchfs_destroy (void *p_ctx_in)
-{
- notmuch_context_t *p_ctx = (notmuch_context_t *)p_ctx_in;
+ /** When this listing was last opened. */
+ time_t           last_used;
 
- free(p_ctx->excluded_tags);
- int res = pthread_mutex_destroy(&p_ctx->mutex);
- /* Any failure here is a problem that we caused. */
- assert(res == 0);
+ /**
+  * When the set of messages in this query last changed, or 0 if it hasn't
+  * since notmuchfs started. This is the mtime of the cur/ and new/
+  * directories.
+  */
+ time_t           changed;
 
- free(p_ctx);
-}
+ /**
+  * The virtual query directories this listing was opened through (more than
+  * one, with symlinks), to notify of changes. The values are copies of the
+  * keys.
+  */
+ strmap_t         dirs;
 
-/*============================================================================*/
+ /** How this listing is kept up to date. */
+ listing_policy_t policy;
 
-static int notmuchfs_getattr (const char *path, struct stat *stbuf)
+ /**
+  * Whether entries are still being added by stream_job(). Until then, the
+  * listing isn't in the cache, and its 'index' and 'revision' aren't set.
+  */
+ bool             streaming;
+ /** Whether streaming the listing failed, so it's incomplete. */
+ bool             failed;
+
+ unsigned         refs;
+} listing_t;
+
+/**
+ * The cache of query listings.
+ */
+typedef struct
 {
- int res = 0;
+ /** Mutex to protect everything below, and the listings. */
+ pthread_mutex_t  mutex;
 
- memset(stbuf, 0, sizeof(struct stat));
+ /** Map of notmuch query to the current listing_t for it. */
+ strmap_t         listings;
 
- if (strcmp(path, "/") == 0) {
-   /* Querying the base directory, pass to backing store. */
-   if (stat(".", stbuf) != 0)
-     res = -errno;
-   return res;
- }
+ /**
+  * Map of notmuch query to the listing_t being streamed for it, see
+  * cache_stream().
+  */
+ strmap_t         streams;
 
- char *last_slash  = strrchr(path + 1, '/');
- if (last_slash == NULL) {
-   /* Querying '/<query>', pass to backing store. */
-   LOG_TRACE("getattr stat1: %s\n", path + 1);
-   if (lstat(path + 1, stbuf) != 0)
-     res = -errno;
- }
- else if (strcmp(last_slash + 1, "new") == 0 ||
-          strcmp(last_slash + 1, "tmp") == 0 ||
-          strcmp(last_slash + 1, "cur") == 0) {
-   /* Querying a maildir directory, so copy the parent directory. */
-   char trans_name[PATH_MAX];
-   strncpy(trans_name, path + 1, last_slash - path);
-   trans_name[last_slash - path] = '\0';
-   LOG_TRACE("getattr stat2: %s\n", trans_name);
-   if (stat(trans_name, stbuf) != 0)
-     res = -errno;
- }
- else {
-   /* '/<query>/cur/translated#msg#name' */
-   char *first_slash = strchr(path + 1, '/');
-   bool  mutt_2476_workaround = FALSE;
+ /** Signalled when a listing being streamed grows, or is complete. */
+ pthread_cond_t   streamed;
 
-   if (global_config.mutt_2476_workaround_allowed) {
-     /* The workaround here is to intercept all getattr()s of a path like:
-      *   /real/path/new/fake#maildir#cur#foofile
-      * and treat it as if 'new' was 'cur' thus:
-      *   /real/path/cur/fake#maildir#cur#foofile
-      */
+ /**
+  * Map of virtual message path to memory_hash() of the X-Label header it was
+  * last opened with (a malloc()ed size_t), see cache_xlabel_unchanged().
+  */
+ strmap_t         xlabels;
 
-     if ((last_slash - path) >= 3 &&
-         memcmp(last_slash - 3, "new", 3) == 0) {
-       LOG_TRACE("Activating mutt_bug_2476 workaround for getattr(%s)\n", path);
+ /** The most recent database revision seen. */
+ unsigned long    revision;
+
+ /** The UUID of the database that 'revision' belongs to. */
+ char            *uuid;
+
+ /** The number of getattr()s of messages answered from listings. */
+ unsigned long    stat_hits;
+
+ /**
+  * The number of listing refreshes that tested the changed messages in
+  * memory, rather than searching the database, see cache_refresh().
+  */
+ unsigned long    shared_refreshes;
+
+ /**
+  * The number of listings of nested query directories built by filtering
+  * their parent's listing in memory, see cache_refine().
+  */
+ unsigned long    refined;
+
+ /**
+  * Whether 'revision' is kept up to date by the watcher thread. If not,
+  * listings can only be trusted for global_config.cache_ttl.
+  */
+ bool             watching;
+} cache_t;
+
+/**
+ * The database watcher thread, which notices commits to the database (by
+ * anyone), and refreshes the affected cached listings.
+ */
+typedef struct
+{
+ pthread_t thread;
+
+ /** inotify instance watching the Xapian directory, or -1. */
+ int       inotify_fd;
+
+ /**
+  * Written to, to make the thread exit (a NUL), or refresh the cache now
+  * (anything else).
+  */
+ int       stop_pipe[2];
+} watcher_t;
+
+/** The number of client processes whose activity the pool_t tracks. */
+#define POOL_PIDS 64
+
+/**
+ * The classes of database operation. Each has its own queue and workers in
+ * the pool_t, so e.g. opening a message never waits behind a slow listing.
+ */
+typedef enum
+{
+ /** Looking up single messages, e.g. for open(). */
+ POOL_CLASS_READ,
+ /** Running whole queries, e.g. for opendir(). */
+ POOL_CLASS_LIST,
+ /** Updating the database, e.g. for rename(). */
+ POOL_CLASS_UPDATE,
+ /** The number of classes. */
+ POOL_N_CLASSES
+} pool_class_t;
+
+/**
+ * The priorities of jobs within a class. Interactive jobs are always run
+ * before bulk jobs, and bulk jobs can't occupy every worker of a class.
+ */
+typedef enum
+{
+ /** Latency sensitive, e.g. a user opening a message. */
+ POOL_PRIORITY_INTERACTIVE,
+ /** Throughput bound, e.g. a backup reading every message. */
+ POOL_PRIORITY_BULK,
+ /** The number of priorities. */
+ POOL_N_PRIORITIES
+} pool_priority_t;
+
+struct notmuch_context;
+
+/** A function run by a pool worker, returning 0 or a negative errno. */
+typedef int (*pool_fn_t) (struct notmuch_context *p_ctx, void *arg);
+
+/**
+ * A job queued for the pool, owned by the (waiting) thread that queued it,
+ * or by the pool if nobody waits for it, see pool_submit().
+ */
+typedef struct pool_job
+{
+ struct pool_job *next;
+ pool_fn_t        fn;
+ void            *arg;
+ pool_priority_t  priority;
+ int              result;
+ /** Whether a worker has taken the job from the queue. */
+ bool             started;
+ /**
+  * Whether the FUSE request the job is for was interrupted, so the job
+  * should give up, see pool_cancelled().
+  */
+ bool             cancelled;
+ bool             done;
+ /** Whether nobody waits for the job, so the worker frees it when done. */
+ bool             detached;
+} pool_job_t;
+
+/**
+ * The queue and workers of one class of operation.
+ */
+typedef struct
+{
+ /** The queued jobs of each priority. */
+ pool_job_t      *head[POOL_N_PRIORITIES];
+ pool_job_t      *tail[POOL_N_PRIORITIES];
+
+ /** Signalled when a job is queued, or the pool is stopping. */
+ pthread_cond_t   cond;
+
+ /** The number of jobs queued of each priority. */
+ unsigned         queued[POOL_N_PRIORITIES];
+
+ /** The most jobs there have ever been queued. */
+ unsigned         max_queued;
+
+ /** The number of jobs being run, and how many of them are bulk jobs. */
+ unsigned         running;
+ unsigned         running_bulk;
+
+ /** The number of worker threads, and how many of them are idle. */
+ unsigned         threads;
+ unsigned         idle;
+
+ /** The number of jobs completed. */
+ unsigned long    completed;
+} pool_queue_t;
+
+/**
+ * The pool of threads that do the database work of FUSE operations.
+ *
+ * Workers are started on demand, up to pool_max_threads() per class, and
+ * exit when more than global_config.max_idle_threads of the class are idle.
+ */
+typedef struct
+{
+ /** Mutex to protect everything below, and the queued jobs. */
+ pthread_mutex_t  mutex;
+
+ /** Signalled when a job is done, or a worker exits. */
+ pthread_cond_t   done_cond;
+
+ pool_queue_t     queues[POOL_N_CLASSES];
+
+ /**
+  * The recent activity of client processes, to pick out those doing bulk
+  * access. Indexed by PID modulo #POOL_PIDS, collisions just reset.
+  */
+ struct
+ {
+  pid_t          pid;
+  /** The second that 'jobs' is being counted for. */
+  time_t         second;
+  /** The number of jobs queued by the process in 'second'. */
+  unsigned       jobs;
+  /** Whether the process is doing bulk access. */
+  bool           bulk;
+ }                pids[POOL_PIDS];
+
+ /**
+  * The number of times a worker's database handle, and a query created on
+  * it, were reused, see pool_db_t. Updated atomically.
+  */
+ unsigned long    db_reuses;
+ unsigned long    query_reuses;
+
+ /**
+  * Incremented each time a read-write database handle is closed, i.e. our
+  * own changes are committed, so workers don't reuse handles that can't see
+  * them yet. Updated atomically.
+  */
+ unsigned long    writes;
+
+ /** Whether the pool is running. If not, jobs are run by the caller. */
+ bool             running;
+} pool_t;
+
+/**
+ * The read-only database handle a pool worker keeps open between jobs, for
+ * as long as the database doesn't change, and the queries created on it by
+ * query_create(), so that they're only parsed and set up once.
+ */
+typedef struct
+{
+ /** The handle, or NULL. */
+ notmuch_database_t *p_db;
+ /** The database revision the handle sees. */
+ unsigned long       revision;
+ /** pool_t::writes when the handle was opened. */
+ unsigned long       writes;
+ /** Whether the handle is in use, between database_open() and _close(). */
+ bool                in_use;
+ /** Map of query string to notmuch_query_t. */
+ strmap_t            queries;
+} pool_db_t;
+
+/*============================================================================*/
+
+/**
+ * A message file name that is known not to exist.
+ */
+typedef struct
+{
+ /** The real file name. */
+ char          *name;
+ /** The cache revision when it was found not to exist. */
+ unsigned long  revision;
+ /** When it was found not to exist. */
+ time_t         time;
+ /** Whether the entry still holds, i.e. notmuchfs hasn't created the name. */
+ bool           valid;
+} negcache_entry_t;
+
+/**
+ * The cache of message file names that don't exist, so that getattr() of
+ * names probed repeatedly (e.g. by mutt) doesn't go to the real file system.
+ *
+ * It holds at most global_config.negative_cache entries, the oldest being
+ * replaced first. Entries are only trusted for as long as cached listings.
+ */
+typedef struct
+{
+ /** Mutex to protect everything below. */
+ pthread_mutex_t    mutex;
+
+ /** Map of real file name to negcache_entry_t. */
+ strmap_t           names;
+
+ /** The entries, in a ring of global_config.negative_cache slots. */
+ negcache_entry_t **ring;
+
+ /** The slot of 'ring' to fill next. */
+ unsigned           next;
+
+ /** The number of getattr()s answered from the cache. */
+ unsigned long      hits;
+} negcache_t;
+
+/*============================================================================*/
+
+/** The number of MIME structure indexes kept, see mime_cache_t. */
+#define MIME_CACHE_SIZE 64
+
+struct mime_index;
+
+/**
+ * The MIME structure indexes of recently examined messages, for their
+ * '.parts/' directories. Indexes are replaced oldest first.
+ */
+typedef struct
+{
+ /** Mutex to protect everything below, and the index reference counts. */
+ pthread_mutex_t    mutex;
+
+ /** Map of real file name to struct mime_index. */
+ strmap_t           indexes;
+
+ /** The indexes, in a ring of #MIME_CACHE_SIZE slots. */
+ struct mime_index *ring[MIME_CACHE_SIZE];
+
+ /** The slot of 'ring' to fill next. */
+ unsigned           next;
+} mime_cache_t;
+
+/*============================================================================*/
+
+/**
+ * The decompressed content of a compressed message file, see
+ * plain_get().
+ */
+typedef struct plain
+{
+ /** The next oldest in the plain_cache_t. */
+ struct plain *next;
+ /** The real file name of the message. */
+ char         *fname;
+ char         *data;
+ size_t        length;
+ /** Protected by the plain_cache_t mutex. */
+ unsigned      refs;
+} plain_t;
+
+/**
+ * The decompressed size of a compressed message file that had to be
+ * counted, see message_stat().
+ */
+typedef struct
+{
+ /** The attributes of the compressed file it was counted from. */
+ ino_t  ino;
+ off_t  compressed_size;
+ time_t mtime;
+ off_t  size;
+} plain_size_t;
+
+/**
+ * The decompressed content of recently read compressed message files. The
+ * oldest are dropped when they take more than global_config.compressed_cache
+ * MiB.
+ */
+typedef struct
+{
+ /** Mutex to protect everything below, and the reference counts. */
+ pthread_mutex_t  mutex;
+
+ /** Map of real file name to plain_t. */
+ strmap_t         messages;
+
+ /** Map of real file name to plain_size_t. */
+ strmap_t         sizes;
+
+ /** The messages, oldest first. */
+ plain_t         *head;
+ plain_t         *tail;
+
+ /** The total length of the messages. */
+ size_t           bytes;
+} plain_cache_t;
+
+/*============================================================================*/
+
+/**
+ * The messages with a tag, see tagindex_t.
+ */
+typedef struct
+{
+ /** A bit for each slot of tagindex_t::messages. */
+ uint64_t *bits;
+} tagindex_tag_t;
+
+/**
+ * A message known to the tag index, see tagindex_t.
+ */
+typedef struct
+{
+ /** The message ID, or NULL if the slot is free. */
+ char            *id;
+ /** The real file name of the message. */
+ char            *fname;
+ /** The date of the message, to sort results newest first, as notmuch does. */
+ time_t           date;
+ /** The tags whose bitmaps have the message's bit set. */
+ tagindex_tag_t **tags;
+ size_t           n_tags;
+} tagindex_message_t;
+
+/**
+ * An in-memory index of the tags of every message in the database, so that
+ * queries made only of tags (e.g. 'tag:unread and not tag:spam') can be
+ * answered with bitmap operations rather than a database search. See
+ * @ref tag_index.
+ */
+typedef struct
+{
+ /** Mutex to protect everything below. */
+ pthread_mutex_t     mutex;
+
+ /** Whether the index is complete, as of 'revision' of database 'uuid'. */
+ bool                built;
+ unsigned long       revision;
+ char               *uuid;
+
+ /** The messages, each in a slot, which is its bit in the bitmaps. */
+ tagindex_message_t *messages;
+ /** The number of slots used (including freed ones) in 'messages'. */
+ size_t              n_messages;
+ /** The length of each bitmap, in words, 'messages' has room for 64 times as
+  * many slots.
+  */
+ size_t              words;
+
+ /** Map of message ID to its slot number plus one. */
+ strmap_t            ids;
+
+ /** Map of tag to tagindex_tag_t. */
+ strmap_t            tags;
+
+ /** The slots in use. */
+ uint64_t           *live;
+ size_t              n_live;
+
+ /** The number of queries answered from the index. */
+ unsigned long       hits;
+} tagindex_t;
+
+/**
+ * The files chosen for messages with several (duplicate copies), see
+ * message_best_filename().
+ */
+typedef struct
+{
+ /** Mutex to protect everything below. */
+ pthread_mutex_t mutex;
+
+ /** Map of message ID to the real file name chosen for it. */
+ strmap_t        fnames;
+} file_choice_t;
+
+/*============================================================================*/
+
+/**
+ * The context required to deal with the notmuch database.
+ */
+typedef struct notmuch_context
+{
+ /**
+  * Mutex to serialize read-write database handles, see database_open().
+  */
+ pthread_mutex_t     write_mutex;
+
+ /** Newline-delimited string list of tags to exclude from results. */
+ char               *excluded_tags;
+
+ /** The database writer thread. */
+ writer_t            writer;
+
+ /** The cache of query listings. */
+ cache_t             cache;
+
+ /** The database watcher thread. */
+ watcher_t           watcher;
+
+ /** The pool of threads doing database work for FUSE operations. */
+ pool_t              pool;
+
+ /** The cache of message file names that don't exist. */
+ negcache_t          negcache;
+
+ /** The MIME structure indexes of recently examined messages. */
+ mime_cache_t        mime_cache;
+
+ /** The decompressed content of recently read compressed messages. */
+ plain_cache_t       plain_cache;
+
+ /** The tags of every message, if global_config.tag_index is set. */
+ tagindex_t          tagindex;
+
+ /** The files chosen for messages with duplicate copies. */
+ file_choice_t       choices;
+} notmuch_context_t;
+
+/*============================================================================*/
+
+/**
+ * Replace every instance of character 'old' with 'new' in 'str_in'.
+ *
+ * @param[in,out] str_in The string to replace within.
+ * @param[in]     old    The character to replace.
+ * @param[in]     new    The character to replace with.
+ */
+static void string_replace (char *str_in, char old, char new)
+{
+ char *str = str_in;
+
+ while (*str != '\0') {
+   if (*str == old)
+     *str = new;
+   str++;
+ }
+}
+
+/*============================================================================*/
+
+/** The initial number of buckets in a #strmap_t. */
+#define STRMAP_INITIAL_BUCKETS 64
+
+/**
+ * Hash a string (FNV-1a).
+ *
+ * @param[in] str The string to hash.
+ * @return The hash value.
+ */
+static size_t string_hash (const char *str)
+{
+ size_t hash = 2166136261u;
+
+ while (*str != '\0') {
+   hash ^= (unsigned char)*str++;
+   hash *= 16777619u;
+ }
+ return hash;
+}
+
+/**
+ * Hash a block of memory (FNV-1a).
+ *
+ * @param[in] data   The memory to hash.
+ * @param[in] length The length of 'data'.
+ * @return The hash value.
+ */
+static size_t memory_hash (const char *data, size_t length)
+{
+ size_t hash = 2166136261u;
+
+ for (size_t i = 0; i < length; i++) {
+   hash ^= (unsigned char)data[i];
+   hash *= 16777619u;
+ }
+ return hash;
+}
+
+/**
+ * Initialize an empty string map.
+ *
+ * @param[out] p_map The map to initialize.
+ */
+static void strmap_init (strmap_t *p_map)
+{
+ p_map->n_buckets = STRMAP_INITIAL_BUCKETS;
+ p_map->buckets   = calloc(p_map->n_buckets, sizeof(strmap_entry_t *));
+ p_map->count     = 0;
+}
+
+/**
+ * Free all resources of a string map.
+ *
+ * @param[in,out] p_map      The map to destroy.
+ * @param[in]     free_value Called on every value still in the map, may be
+ *                           NULL.
+ */
+static void strmap_destroy (strmap_t *p_map, void (*free_value)(void *))
+{
+ for (size_t i = 0; i < p_map->n_buckets; i++) {
+   strmap_entry_t *p_entry = p_map->buckets[i];
+   while (p_entry != NULL) {
+     strmap_entry_t *p_next = p_entry->next;
+     if (free_value != NULL)
+       free_value(p_entry->value);
+     free(p_entry->key);
+     free(p_entry);
+     p_entry = p_next;
+   }
+ }
+ free(p_map->buckets);
+ p_map->buckets   = NULL;
+ p_map->n_buckets = 0;
+ p_map->count     = 0;
+}
+
+/**
+ * Find the link pointing at the entry for a key.
+ *
+ * @param[in] p_map The map to search.
+ * @param[in] key   The key to find.
+ * @param[in] hash  string_hash() of 'key'.
+ * @return The link to the entry, or the (NULL) link at the end of the bucket
+ *         chain if the key is not present.
+ */
+static strmap_entry_t **strmap_find (const strmap_t *p_map,
+                                     const char     *key,
+                                     size_t          hash)
+{
+ strmap_entry_t **pp_entry = &p_map->buckets[hash % p_map->n_buckets];
+
+ while (*pp_entry != NULL &&
+        ((*pp_entry)->hash != hash || strcmp((*pp_entry)->key, key) != 0))
+   pp_entry = &(*pp_entry)->next;
+ return pp_entry;
+}
+
+/**
+ * Look up a key in a string map.
+ *
+ * @param[in] p_map The map to search.
+ * @param[in] key   The key to find.
+ * @return The value, or NULL if the key is not present.
+ */
+static void *strmap_get (const strmap_t *p_map, const char *key)
+{
+ strmap_entry_t *p_entry = *strmap_find(p_map, key, string_hash(key));
+
+ return p_entry != NULL ? p_entry->value : NULL;
+}
+
+/**
+ * Insert or replace a key in a string map.
+ *
+ * @param[in,out] p_map The map to insert into.
+ * @param[in]     key   The key, which is copied.
+ * @param[in]     value The value.
+ * @return The previous value for this key, or NULL if there was none.
+ */
+static void *strmap_put (strmap_t *p_map, const char *key, void *value)
+{
+ size_t           hash     = string_hash(key);
+ strmap_entry_t **pp_entry = strmap_find(p_map, key, hash);
+
+ if (*pp_entry != NULL) {
+   void *old_value = (*pp_entry)->value;
+   (*pp_entry)->value = value;
+   return old_value;
+ }
+
+ if (p_map->count >= p_map->n_buckets * 2) {
+   /* Grow the table, rehashing every entry into the new buckets. */
+   size_t           n_buckets = p_map->n_buckets * 4;
+   strmap_entry_t **buckets   = calloc(n_buckets, sizeof(strmap_entry_t *));
+   for (size_t i = 0; i < p_map->n_buckets; i++) {
+     strmap_entry_t *p_entry = p_map->buckets[i];
+     while (p_entry != NULL) {
+       strmap_entry_t *p_next = p_entry->next;
+       p_entry->next = buckets[p_entry->hash % n_buckets];
+       buckets[p_entry->hash % n_buckets] = p_entry;
+       p_entry = p_next;
+     }
+   }
+   free(p_map->buckets);
+   p_map->buckets   = buckets;
+   p_map->n_buckets = n_buckets;
+   pp_entry = &p_map->buckets[hash % n_buckets];
+ }
+
+ strmap_entry_t *p_entry = malloc(sizeof(strmap_entry_t));
+ p_entry->hash  = hash;
+ p_entry->key   = strdup(key);
+ p_entry->value = value;
+ p_entry->next  = *pp_entry;
+ *pp_entry = p_entry;
+ p_map->count++;
+ return NULL;
+}
+
+/**
+ * Remove a key from a string map.
+ *
+ * @param[in,out] p_map The map to remove from.
+ * @param[in]     key   The key to remove.
+ * @return The removed value, or NULL if the key was not present.
+ */
+static void *strmap_remove (strmap_t *p_map, const char *key)
+{
+ strmap_entry_t **pp_entry = strmap_find(p_map, key, string_hash(key));
+ strmap_entry_t  *p_entry  = *pp_entry;
+
+ if (p_entry == NULL)
+   return NULL;
+
+ void *value = p_entry->value;
+ *pp_entry = p_entry->next;
+ free(p_entry->key);
+ free(p_entry);
+ p_map->count--;
+ return value;
+}
+
+/**
+ * Collect all the values of a string map.
+ *
+ * @param[in] p_map The map.
+ * @return A newly allocated array of p_map->count values.
+ */
+static void **strmap_values (const strmap_t *p_map)
+{
+ void **values = malloc(MAX(p_map->count, 1) * sizeof(void *));
+ size_t count  = 0;
+
+ for (size_t i = 0; i < p_map->n_buckets; i++) {
+   for (strmap_entry_t *p_entry = p_map->buckets[i]; p_entry != NULL;
+        p_entry = p_entry->next)
+     values[count++] = p_entry->value;
+ }
+ assert(count == p_map->count);
+ return values;
+}
+
+/*============================================================================*/
+
+/**
+ * A growable string buffer.
+ */
+typedef struct
+{
+ char   *data;
+ size_t  length;
+ size_t  max;
+} strbuf_t;
+
+/**
+ * Append bytes to a string buffer.
+ *
+ * @param[in,out] p_buf  The buffer, zero-initialized before first use.
+ * @param[in]     data   The bytes to append.
+ * @param[in]     length The number of bytes.
+ */
+static void strbuf_append (strbuf_t *p_buf, const char *data, size_t length)
+{
+ if (p_buf->length + length + 1 > p_buf->max) {
+   p_buf->max  = MAX(p_buf->max * 2, p_buf->length + length + 1);
+   p_buf->max  = MAX(p_buf->max, 4096);
+   p_buf->data = realloc(p_buf->data, p_buf->max);
+ }
+ memcpy(p_buf->data + p_buf->length, data, length);
+ p_buf->length += length;
+ p_buf->data[p_buf->length] = '\0';
+}
+
+/**
+ * Append formatted text to a string buffer.
+ *
+ * @param[in,out] p_buf  The buffer, zero-initialized before first use.
+ * @param[in]     format The printf() format.
+ */
+static void strbuf_printf (strbuf_t *p_buf, const char *format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+static void strbuf_printf (strbuf_t *p_buf, const char *format, ...)
+{
+ char   *str = NULL;
+ va_list args;
+
+ va_start(args, format);
+ int length = vasprintf(&str, format, args);
+ va_end(args);
+
+ if (length >= 0) {
+   strbuf_append(p_buf, str, length);
+   free(str);
+ }
+}
+
+/*============================================================================*/
+
+/** The database handle kept by the calling pool worker thread, or NULL. */
+static __thread pool_db_t *pool_db;
+
+/**
+ * Forget a pool worker's database handle, and the queries created on it.
+ *
+ * @param[in,out] p_pool_db The worker's handle.
+ */
+static void pool_db_clear (pool_db_t *p_pool_db)
+{
+ assert(!p_pool_db->in_use);
+ if (p_pool_db->p_db == NULL)
+   return;
+
+ /* The queries belong to the handle, so go with it. */
+ strmap_destroy(&p_pool_db->queries, NULL);
+ strmap_init(&p_pool_db->queries);
+ notmuch_database_close(p_pool_db->p_db);
+ notmuch_database_destroy(p_pool_db->p_db);
+ p_pool_db->p_db = NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * Open a handle on the notmuch database, for use by the calling thread only.
+ * Continue trying forever if the open fails (e.g. the database was locked).
+ *
+ * Any number of read-only handles can be open at once, Xapian gives each a
+ * consistent snapshot. Read-write handles are serialized.
+ *
+ * A pool worker keeps its read-only handle open for its next job, if the
+ * watcher thread hasn't seen the database change since. The excluded tags
+ * are only read at mount time, so the queries created on it stay valid as
+ * long as it does.
+ *
+ * @param[in,out] p_ctx      The notmuch context.
+ * @param[in]     need_write Whether to open the database in read-only or
+ *                           read-write mode.
+ * @return The database handle, to close with database_close().
+ */
+static notmuch_database_t *database_open (notmuch_context_t *p_ctx,
+                                          bool               need_write)
+{
+ notmuch_database_t *p_db = NULL;
+
+ LOG_TRACE("notmuch database_open\n");
+ if (need_write)
+   PTHREAD_LOCK(&p_ctx->write_mutex);
+
+ pool_db_t *p_pool_db = (!need_write && pool_db != NULL && !pool_db->in_use) ?
+                          pool_db : NULL;
+ unsigned long writes =
+   __atomic_load_n(&p_ctx->pool.writes, __ATOMIC_ACQUIRE);
+ if (p_pool_db != NULL && p_pool_db->p_db != NULL) {
+   /* The watcher only notices our own changes some time after they're
+    * committed, so those are checked for separately.
+    */
+   PTHREAD_LOCK(&p_ctx->cache.mutex);
+   bool current = p_ctx->cache.watching &&
+                  p_ctx->cache.revision == p_pool_db->revision &&
+                  writes == p_pool_db->writes;
+   PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+
+   if (current) {
+     __atomic_add_fetch(&p_ctx->pool.db_reuses, 1, __ATOMIC_RELAXED);
+     p_pool_db->in_use = TRUE;
+     return p_pool_db->p_db;
+   }
+   pool_db_clear(p_pool_db);
+ }
+
+ while (TRUE) {
+   notmuch_status_t status =
+     notmuch_database_open(global_config.mail_dir,
+                           need_write ?
+                             NOTMUCH_DATABASE_MODE_READ_WRITE:
+                             NOTMUCH_DATABASE_MODE_READ_ONLY,
+                           &p_db);
+
+   if (status == NOTMUCH_STATUS_SUCCESS) {
+     break;
+   }
+   else if (status == NOTMUCH_STATUS_XAPIAN_EXCEPTION) {
+     /* Try again. */
+     sleep(1);
+   }
+   else {
+     fprintf(stderr, "ERROR: Database open error.\n");
+     exit(1);
+   }
+ }
+
+ if (notmuch_database_needs_upgrade(p_db)) {
+   fprintf(stderr, "ERROR: Database needs upgrade.\n");
+   exit(1);
+ }
+
+ if (p_pool_db != NULL) {
+   p_pool_db->p_db     = p_db;
+   p_pool_db->revision = notmuch_database_get_revision(p_db, NULL);
+   p_pool_db->writes   = writes;
+   p_pool_db->in_use   = TRUE;
+ }
+ return p_db;
+}
+
+/*============================================================================*/
+
+/**
+ * Close a notmuch database handle opened by database_open().
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     p_db  The database handle.
+ */
+static void database_close (notmuch_context_t *p_ctx, notmuch_database_t *p_db)
+{
+ LOG_TRACE("notmuch database_close\n");
+ assert(p_db != NULL);
+ if (pool_db != NULL && p_db == pool_db->p_db) {
+   /* Kept for the worker's next job. */
+   pool_db->in_use = FALSE;
+   return;
+ }
+ bool need_write =
+   (notmuch_database_get_mode(p_db) == NOTMUCH_DATABASE_MODE_READ_WRITE);
+ notmuch_database_close(p_db);
+ notmuch_database_destroy(p_db);
+ if (need_write) {
+   __atomic_add_fetch(&p_ctx->pool.writes, 1, __ATOMIC_RELEASE);
+   PTHREAD_UNLOCK(&p_ctx->write_mutex);
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * Apply one batch of queued updates to the database, in a single
+ * transaction.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     p_ops The list of updates to apply.
+ */
+static void writer_apply_batch (notmuch_context_t *p_ctx, writer_op_t *p_ops)
+{
+ notmuch_database_t *p_db = database_open(p_ctx, TRUE);
+
+ bool atomic =
+   (notmuch_database_begin_atomic(p_db) == NOTMUCH_STATUS_SUCCESS);
+ if (!atomic) {
+   fprintf(stderr, "WARNING: Could not begin writer transaction.\n");
+ }
+
+ for (writer_op_t *p_op = p_ops; p_op != NULL; p_op = p_op->next) {
+   switch (p_op->type) {
+     case WRITER_OP_DELETE_TAG:
+       {
+        LOG_TRACE("writer notmuch_database_find_message_by_filename(%s)\n",
+                  p_op->filename);
+        notmuch_message_t *p_message = NULL;
+        if (notmuch_database_find_message_by_filename(p_db,
+                                                      p_op->filename,
+                                                      &p_message) !=
+            NOTMUCH_STATUS_SUCCESS ||
+            p_message == NULL) {
+          fprintf(stderr, "ERROR: Can't find deleted message \"%s\".\n",
+                  p_op->filename);
+          break;
+        }
+
+        LOG_TRACE("writer notmuch_message_add_tag(%s, %s)\n", p_op->filename,
+                  global_config.delete_tag);
+        if (notmuch_message_add_tag(p_message, global_config.delete_tag) !=
+            NOTMUCH_STATUS_SUCCESS) {
+          /* Ignore all errors, there's nothing we can do about them anyway.
+           * This will mean a deleted message is 'resurrected', which the user
+           * can clearly see and retry.
+           */
+        }
+        notmuch_message_destroy(p_message);
+        break;
+       }
+
+     case WRITER_OP_INDEX:
+       {
+        LOG_TRACE("writer notmuch_database_index_file(%s)\n", p_op->filename);
+        notmuch_message_t *p_message = NULL;
+        notmuch_status_t   status    =
+          notmuch_database_index_file(p_db, p_op->filename, NULL,
+                                      &p_message);
+        if ((status != NOTMUCH_STATUS_SUCCESS &&
+             status != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) ||
+            p_message == NULL) {
+          fprintf(stderr, "ERROR: Can't index delivered message \"%s\".\n",
+                  p_op->filename);
+          break;
+        }
+
+        /* Take the tags the maildir flags imply first, so the query's own
+         * tags (e.g. 'tag:flagged' without the 'F' flag) win, and the
+         * message appears where it was delivered.
+         */
+        notmuch_message_freeze(p_message);
+        notmuch_message_maildir_flags_to_tags(p_message);
+        if (p_op->tags != NULL) {
+          char *save_ptr = NULL;
+          char *tag      = strtok_r(p_op->tags, "\n", &save_ptr);
+          while (tag != NULL) {
+            LOG_TRACE("writer notmuch_message_add_tag(%s, %s)\n",
+                      p_op->filename, tag);
+            if (notmuch_message_add_tag(p_message, tag) !=
+                NOTMUCH_STATUS_SUCCESS) {
+              fprintf(stderr, "WARNING: Can't add tag \"%s\" to \"%s\".\n",
+                      tag, p_op->filename);
+            }
+            tag = strtok_r(NULL, "\n", &save_ptr);
+          }
+        }
+        notmuch_message_thaw(p_message);
+        notmuch_message_destroy(p_message);
+        break;
+       }
+   }
+ }
+
+ if (atomic &&
+     notmuch_database_end_atomic(p_db) != NOTMUCH_STATUS_SUCCESS) {
+   fprintf(stderr, "ERROR: Could not commit writer transaction.\n");
+ }
+
+ database_close(p_ctx, p_db);
+}
+
+/*============================================================================*/
+
+/** The longest time (in milliseconds) the writer yields to other updates. */
+#define WRITER_YIELD_MAX_MS 1000
+
+/**
+ * Wait for any interactive database updates queued or running in the worker
+ * pool (e.g. mutt renaming a message to mark it read) to finish, for up to
+ * #WRITER_YIELD_MAX_MS, so they don't wait for a whole batch.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void writer_yield (notmuch_context_t *p_ctx)
+{
+ pool_t          *p_pool  = &p_ctx->pool;
+ pool_queue_t    *p_queue = &p_pool->queues[POOL_CLASS_UPDATE];
+ struct timespec  deadline;
+
+ clock_gettime(CLOCK_REALTIME, &deadline);
+ deadline.tv_sec += WRITER_YIELD_MAX_MS / 1000;
+
+ PTHREAD_LOCK(&p_pool->mutex);
+ while (p_queue->queued[POOL_PRIORITY_INTERACTIVE] +
+        (p_queue->running - p_queue->running_bulk) > 0) {
+   if (pthread_cond_timedwait(&p_pool->done_cond, &p_pool->mutex,
+                              &deadline) == ETIMEDOUT)
+     break;
+ }
+ PTHREAD_UNLOCK(&p_pool->mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * The writer thread main loop. Waits for queued updates, then collects more
+ * for up to global_config.writer_delay_ms (or until a full batch of
+ * global_config.writer_batch_size is queued), and applies them all at once.
+ *
+ * @param[in] p_ctx_in The notmuch context.
+ * @return NULL.
+ */
+static void *writer_main (void *p_ctx_in)
+{
+ notmuch_context_t *p_ctx    = (notmuch_context_t *)p_ctx_in;
+ writer_t          *p_writer = &p_ctx->writer;
+
+ PTHREAD_LOCK(&p_writer->mutex);
+ while (TRUE) {
+   while (p_writer->head == NULL && !p_writer->stop)
+     pthread_cond_wait(&p_writer->cond, &p_writer->mutex);
+
+   if (p_writer->head == NULL)
+     break;
+
+   /* Give the rest of a burst (e.g. mutt deleting many messages one unlink()
+    * at a time) a chance to join this batch.
+    */
+   struct timespec deadline;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec  += global_config.writer_delay_ms / 1000;
+   deadline.tv_nsec += (global_config.writer_delay_ms % 1000) * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L) {
+     deadline.tv_sec++;
+     deadline.tv_nsec -= 1000000000L;
+   }
+   while (!p_writer->stop &&
+          p_writer->queued < global_config.writer_batch_size) {
+     if (pthread_cond_timedwait(&p_writer->cond, &p_writer->mutex,
+                                &deadline) == ETIMEDOUT)
+       break;
+   }
+
+   /* Detach one batch from the front of the queue. */
+   writer_op_t *p_batch = p_writer->head;
+   writer_op_t *p_last  = p_batch;
+   size_t       count   = 1;
+   while (p_last->next != NULL && count < global_config.writer_batch_size) {
+     p_last = p_last->next;
+     count++;
+   }
+   p_writer->head = p_last->next;
+   if (p_writer->head == NULL)
+     p_writer->tail = NULL;
+   p_writer->queued -= count;
+   p_last->next = NULL;
+   PTHREAD_UNLOCK(&p_writer->mutex);
+
+   writer_yield(p_ctx);
+   LOG_TRACE("writer applying %zu updates\n", count);
+   writer_apply_batch(p_ctx, p_batch);
+
+   PTHREAD_LOCK(&p_writer->mutex);
+   while (p_batch != NULL) {
+     writer_op_t *p_next = p_batch->next;
+     if (p_batch->type == WRITER_OP_DELETE_TAG &&
+         strmap_get(&p_writer->pending_deletes, p_batch->filename) == p_batch)
+       strmap_remove(&p_writer->pending_deletes, p_batch->filename);
+     free(p_batch->filename);
+     free(p_batch->tags);
+     free(p_batch);
+     p_batch = p_next;
+   }
+ }
+ PTHREAD_UNLOCK(&p_writer->mutex);
+
+ return NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * Start the writer thread.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @return 0 on success, or an error number.
+ */
+static int writer_start (notmuch_context_t *p_ctx)
+{
+ writer_t *p_writer = &p_ctx->writer;
+
+ int res = pthread_mutex_init(&p_writer->mutex, NULL);
+ if (res != 0)
+   return res;
+ res = pthread_cond_init(&p_writer->cond, NULL);
+ if (res != 0) {
+   pthread_mutex_destroy(&p_writer->mutex);
+   return res;
+ }
+ strmap_init(&p_writer->pending_deletes);
+
+ res = pthread_create(&p_writer->thread, NULL, writer_main, p_ctx);
+ if (res != 0) {
+   strmap_destroy(&p_writer->pending_deletes, NULL);
+   pthread_cond_destroy(&p_writer->cond);
+   pthread_mutex_destroy(&p_writer->mutex);
+ }
+ return res;
+}
+
+/*============================================================================*/
+
+/**
+ * Stop the writer thread, after it has applied every queued update.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void writer_stop (notmuch_context_t *p_ctx)
+{
+ writer_t *p_writer = &p_ctx->writer;
+
+ PTHREAD_LOCK(&p_writer->mutex);
+ p_writer->stop = TRUE;
+ pthread_cond_signal(&p_writer->cond);
+ PTHREAD_UNLOCK(&p_writer->mutex);
+
+ int res = pthread_join(p_writer->thread, NULL);
+ assert(res == 0);
+
+ assert(p_writer->head == NULL);
+ strmap_destroy(&p_writer->pending_deletes, NULL);
+ res = pthread_cond_destroy(&p_writer->cond);
+ assert(res == 0);
+ res = pthread_mutex_destroy(&p_writer->mutex);
+ assert(res == 0);
+}
+
+/*============================================================================*/
+
+/**
+ * Queue an update for the writer thread.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     type     The type of update.
+ * @param[in]     filename The real file name of the message to update.
+ * @param[in]     tags     For #WRITER_OP_INDEX, a newly allocated
+ *                         newline-delimited list of tags to add, which the
+ *                         writer takes ownership of. Otherwise NULL.
+ */
+static void writer_queue (notmuch_context_t *p_ctx,
+                          writer_op_type_t   type,
+                          const char        *filename,
+                          char              *tags)
+{
+ writer_t    *p_writer = &p_ctx->writer;
+ writer_op_t *p_op     = malloc(sizeof(writer_op_t));
+
+ p_op->next     = NULL;
+ p_op->type     = type;
+ p_op->filename = strdup(filename);
+ p_op->tags     = tags;
+
+ PTHREAD_LOCK(&p_writer->mutex);
+ if (type == WRITER_OP_DELETE_TAG)
+   strmap_put(&p_writer->pending_deletes, filename, p_op);
+ if (p_writer->tail != NULL)
+   p_writer->tail->next = p_op;
+ else
+   p_writer->head = p_op;
+ p_writer->tail = p_op;
+ p_writer->queued++;
+ pthread_cond_signal(&p_writer->cond);
+ PTHREAD_UNLOCK(&p_writer->mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * Whether a message has been deleted, but the writer thread has not yet
+ * committed its #global_config.delete_tag.
+ *
+ * @param[in] p_ctx    The notmuch context.
+ * @param[in] filename The real file name of the message.
+ * @return TRUE if the deletion is pending.
+ */
+static bool writer_is_pending_delete (notmuch_context_t *p_ctx,
+                                      const char        *filename)
+{
+ writer_t *p_writer = &p_ctx->writer;
+
+ PTHREAD_LOCK(&p_writer->mutex);
+ bool pending = (p_writer->pending_deletes.count > 0 &&
+                 strmap_get(&p_writer->pending_deletes, filename) != NULL);
+ PTHREAD_UNLOCK(&p_writer->mutex);
+ return pending;
+}
+
+/*============================================================================*/
+
+/** The names of the pool classes, for the stats file. */
+static const char *pool_class_names[POOL_N_CLASSES] =
+{
+ [POOL_CLASS_READ]   = "read",
+ [POOL_CLASS_LIST]   = "list",
+ [POOL_CLASS_UPDATE] = "update"
+};
+
+/**
+ * The arguments of a pool worker thread.
+ */
+typedef struct
+{
+ notmuch_context_t *p_ctx;
+ pool_class_t       class;
+} pool_worker_arg_t;
+
+/** The job being run by the calling pool worker thread, or NULL. */
+static __thread pool_job_t *pool_current_job;
+
+/**
+ * Check whether the job being run by the calling thread should give up,
+ * because the FUSE request it's for was interrupted. Long loops in jobs call
+ * this periodically.
+ *
+ * @return TRUE if the job should return -EINTR as soon as possible. Always
+ *         FALSE outside pool workers.
+ */
+static bool pool_cancelled (void)
+{
+ return pool_current_job != NULL &&
+        __atomic_load_n(&pool_current_job->cancelled, __ATOMIC_RELAXED);
+}
+
+/** How many iterations of a loop between calls to pool_cancelled(). */
+#define POOL_CANCEL_CHECK_INTERVAL 256
+
+/**
+ * The most workers to run for each class: global_config.threads, but at
+ * least two, so that one is always left for interactive jobs.
+ *
+ * @return The number of workers.
+ */
+static unsigned pool_max_threads (void)
+{
+ return MAX(global_config.threads, 2);
+}
+
+/**
+ * Take the next job to run from the queue of a class. Must be called with
+ * the pool mutex held.
+ *
+ * Interactive jobs go first. Bulk jobs are left queued if running them would
+ * leave no worker free for interactive jobs.
+ *
+ * @param[in,out] p_queue The queue of the class.
+ * @return The job, or NULL if there's none to run now.
+ */
+static pool_job_t *pool_next_job_locked (pool_queue_t *p_queue)
+{
+ unsigned max_bulk = pool_max_threads() - 1;
+
+ for (int priority = 0; priority < POOL_N_PRIORITIES; priority++) {
+   pool_job_t *p_job = p_queue->head[priority];
+   if (p_job == NULL)
+     continue;
+   if (priority == POOL_PRIORITY_BULK && p_queue->running_bulk >= max_bulk)
+     return NULL;
+
+   p_queue->head[priority] = p_job->next;
+   if (p_queue->head[priority] == NULL)
+     p_queue->tail[priority] = NULL;
+   p_queue->queued[priority]--;
+   return p_job;
+ }
+ return NULL;
+}
+
+/**
+ * Decide the priority of a job queued by the calling FUSE thread, from how
+ * busy the client process is. Must be called with the pool mutex held.
+ *
+ * A process queueing more than global_config.bulk_threshold jobs in a second
+ * is doing bulk access, until it has a second below the threshold.
+ *
+ * @param[in,out] p_pool The pool.
+ * @return The priority.
+ */
+static pool_priority_t pool_classify_locked (pool_t *p_pool)
+{
+ if (global_config.bulk_threshold == 0)
+   return POOL_PRIORITY_INTERACTIVE;
+
+ pid_t  pid    = fuse_get_context()->pid;
+ time_t now    = time(NULL);
+ size_t index  = (size_t)pid % POOL_PIDS;
+
+ if (p_pool->pids[index].pid != pid) {
+   p_pool->pids[index].pid    = pid;
+   p_pool->pids[index].second = now;
+   p_pool->pids[index].jobs   = 0;
+   p_pool->pids[index].bulk   = FALSE;
+ }
+ else if (p_pool->pids[index].second != now) {
+   /* Stay bulk only through consecutive busy seconds. */
+   p_pool->pids[index].bulk =
+     (p_pool->pids[index].second == now - 1 &&
+      p_pool->pids[index].jobs > global_config.bulk_threshold);
+   p_pool->pids[index].second = now;
+   p_pool->pids[index].jobs   = 0;
+ }
+
+ p_pool->pids[index].jobs++;
+ if (p_pool->pids[index].jobs > global_config.bulk_threshold)
+   p_pool->pids[index].bulk = TRUE;
+
+ return p_pool->pids[index].bulk ? POOL_PRIORITY_BULK
+                                 : POOL_PRIORITY_INTERACTIVE;
+}
+
+/**
+ * The pool worker thread main loop, running the jobs of one class.
+ *
+ * @param[in] arg The pool_worker_arg_t, freed by the thread.
+ * @return NULL.
+ */
+static void *pool_worker_main (void *arg)
+{
+ pool_worker_arg_t *p_arg   = (pool_worker_arg_t *)arg;
+ notmuch_context_t *p_ctx   = p_arg->p_ctx;
+ pool_t            *p_pool  = &p_ctx->pool;
+ pool_queue_t      *p_queue = &p_pool->queues[p_arg->class];
+
+ free(p_arg);
+
+ pool_db_t worker_db;
+ memset(&worker_db, 0, sizeof(pool_db_t));
+ strmap_init(&worker_db.queries);
+ pool_db = &worker_db;
+
+ if (global_config.cpu_affinity != NULL) {
+   int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                    &global_config.cpus);
+   if (res != 0) {
+     fprintf(stderr, "WARNING: Can't set worker CPU affinity: %s.\n",
+             strerror(res));
+   }
+ }
+
+ PTHREAD_LOCK(&p_pool->mutex);
+ while (TRUE) {
+   pool_job_t *p_job;
+   while ((p_job = pool_next_job_locked(p_queue)) == NULL) {
+     if (!p_pool->running || p_queue->idle >= global_config.max_idle_threads)
+       break;
+     p_queue->idle++;
+     pthread_cond_wait(&p_queue->cond, &p_pool->mutex);
+     p_queue->idle--;
+   }
+   if (p_job == NULL)
+     break;
+
+   bool bulk = (p_job->priority == POOL_PRIORITY_BULK);
+   p_job->started = TRUE;
+   p_queue->running++;
+   if (bulk)
+     p_queue->running_bulk++;
+   PTHREAD_UNLOCK(&p_pool->mutex);
+
+   pool_current_job = p_job;
+   int result = p_job->fn(p_ctx, p_job->arg);
+   pool_current_job = NULL;
+
+   PTHREAD_LOCK(&p_pool->mutex);
+   p_job->result = result;
+   p_job->done   = TRUE;
+   if (p_job->detached)
+     free(p_job);
+   p_queue->completed++;
+   p_queue->running--;
+   if (bulk) {
+     /* Another bulk job may be allowed to run now. */
+     p_queue->running_bulk--;
+     pthread_cond_signal(&p_queue->cond);
+   }
+   pthread_cond_broadcast(&p_pool->done_cond);
+ }
+ p_queue->threads--;
+ pthread_cond_broadcast(&p_pool->done_cond);
+ PTHREAD_UNLOCK(&p_pool->mutex);
+
+ pool_db = NULL;
+ pool_db_clear(&worker_db);
+ strmap_destroy(&worker_db.queries, NULL);
+ return NULL;
+}
+
+/**
+ * Start a worker for a class. Must be called with the pool mutex held.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     class The class of the worker.
+ * @return 0 on success, or an errno.
+ */
+static int pool_start_worker_locked (notmuch_context_t *p_ctx,
+                                     pool_class_t       class)
+{
+ pool_worker_arg_t *p_arg = malloc(sizeof(pool_worker_arg_t));
+ p_arg->p_ctx = p_ctx;
+ p_arg->class = class;
+
+ pthread_t      thread;
+ pthread_attr_t attr;
+ pthread_attr_init(&attr);
+ pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+ int res = pthread_create(&thread, &attr, pool_worker_main, p_arg);
+ pthread_attr_destroy(&attr);
+ if (res != 0) {
+   free(p_arg);
+   return res;
+ }
+ p_ctx->pool.queues[class].threads++;
+ return 0;
+}
+
+/**
+ * Start the worker pool. Workers are started as jobs arrive.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @return 0 on success, or an errno.
+ */
+static int pool_start (notmuch_context_t *p_ctx)
+{
+ pool_t *p_pool = &p_ctx->pool;
+
+ int res = pthread_mutex_init(&p_pool->mutex, NULL);
+ if (res != 0)
+   return res;
+ pthread_cond_init(&p_pool->done_cond, NULL);
+ for (int i = 0; i < POOL_N_CLASSES; i++)
+   pthread_cond_init(&p_pool->queues[i].cond, NULL);
+ p_pool->running = TRUE;
+ return 0;
+}
+
+/**
+ * Stop the worker pool, waiting for all the workers to exit.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void pool_stop (notmuch_context_t *p_ctx)
+{
+ pool_t *p_pool = &p_ctx->pool;
+
+ PTHREAD_LOCK(&p_pool->mutex);
+ p_pool->running = FALSE;
+ for (int i = 0; i < POOL_N_CLASSES; i++)
+   pthread_cond_broadcast(&p_pool->queues[i].cond);
+ for (int i = 0; i < POOL_N_CLASSES; i++) {
+   while (p_pool->queues[i].threads > 0)
+     pthread_cond_wait(&p_pool->done_cond, &p_pool->mutex);
+ }
+ PTHREAD_UNLOCK(&p_pool->mutex);
+
+ for (int i = 0; i < POOL_N_CLASSES; i++)
+   pthread_cond_destroy(&p_pool->queues[i].cond);
+ pthread_cond_destroy(&p_pool->done_cond);
+ pthread_mutex_destroy(&p_pool->mutex);
+}
+
+/**
+ * Remove a job that no worker has started yet from the queue of its class.
+ * Must be called with the pool mutex held.
+ *
+ * @param[in,out] p_queue The queue of the class.
+ * @param[in]     p_job   The job.
+ */
+static void pool_unqueue_locked (pool_queue_t *p_queue, pool_job_t *p_job)
+{
+ pool_job_t **pp_job = &p_queue->head[p_job->priority];
+ pool_job_t  *p_prev = NULL;
+
+ while (*pp_job != p_job) {
+   p_prev = *pp_job;
+   pp_job = &p_prev->next;
+ }
+ *pp_job = p_job->next;
+ if (p_queue->tail[p_job->priority] == p_job)
+   p_queue->tail[p_job->priority] = p_prev;
+ p_queue->queued[p_job->priority]--;
+}
+
+/** How often (in milliseconds) pool_run() checks for FUSE interrupts. */
+#define POOL_INTERRUPT_POLL_MS 100
+
+/**
+ * Queue a job for the workers of a class, starting another worker if they're
+ * all busy. Must be called with the pool mutex held.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     class The class of the job.
+ * @param[in,out] p_job The job, with its priority set.
+ * @return FALSE if there's no worker to run the job, so it isn't queued.
+ */
+static bool pool_queue_locked (notmuch_context_t *p_ctx,
+                               pool_class_t       class,
+                               pool_job_t        *p_job)
+{
+ pool_t       *p_pool  = &p_ctx->pool;
+ pool_queue_t *p_queue = &p_pool->queues[class];
+
+ unsigned queued = p_queue->queued[POOL_PRIORITY_INTERACTIVE] +
+                   p_queue->queued[POOL_PRIORITY_BULK];
+ if (p_pool->running && p_queue->idle <= queued &&
+     p_queue->threads < pool_max_threads()) {
+   int res = pool_start_worker_locked(p_ctx, class);
+   if (res != 0 && p_queue->threads == 0) {
+     fprintf(stderr, "WARNING: Can't start worker thread: %s.\n",
+             strerror(res));
+   }
+ }
+ if (!p_pool->running || p_queue->threads == 0)
+   return FALSE;
+
+ if (p_queue->tail[p_job->priority] != NULL)
+   p_queue->tail[p_job->priority]->next = p_job;
+ else
+   p_queue->head[p_job->priority] = p_job;
+ p_queue->tail[p_job->priority] = p_job;
+ p_queue->queued[p_job->priority]++;
+ p_queue->max_queued = MAX(p_queue->max_queued, queued + 1);
+ pthread_cond_signal(&p_queue->cond);
+ return TRUE;
+}
+
+/**
+ * Run a job in the worker pool, and wait for it to finish. Must be called
+ * from a FUSE operation, whose client process decides the job priority.
+ *
+ * If the FUSE request is interrupted (e.g. the client gets a SIGINT), a job
+ * still queued is dropped, and a running job is asked to give up, see
+ * pool_cancelled(). Either way, -EINTR is returned.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     class The class of the job.
+ * @param[in]     bulk  Whether the job is bulk access, whoever asked for it.
+ * @param[in]     fn    The job function.
+ * @param[in]     arg   The argument to 'fn'.
+ * @return The result of 'fn'.
+ */
+static int pool_run (notmuch_context_t *p_ctx,
+                     pool_class_t       class,
+                     bool               bulk,
+                     pool_fn_t          fn,
+                     void              *arg)
+{
+ pool_t       *p_pool  = &p_ctx->pool;
+ pool_queue_t *p_queue = &p_pool->queues[class];
+ pool_job_t    job     = { NULL, fn, arg, POOL_PRIORITY_INTERACTIVE, 0,
+                           FALSE, FALSE, FALSE, FALSE };
+
+ PTHREAD_LOCK(&p_pool->mutex);
+ job.priority = pool_classify_locked(p_pool);
+ if (bulk)
+   job.priority = POOL_PRIORITY_BULK;
+
+ if (!pool_queue_locked(p_ctx, class, &job)) {
+   /* No one to run it. */
+   PTHREAD_UNLOCK(&p_pool->mutex);
+   return fn(p_ctx, arg);
+ }
+
+ while (!job.done) {
+   if (!job.cancelled && fuse_interrupted()) {
+     if (!job.started) {
+       pool_unqueue_locked(p_queue, &job);
+       PTHREAD_UNLOCK(&p_pool->mutex);
+       LOG_TRACE("pool job interrupted while queued\n");
+       return -EINTR;
+     }
+     LOG_TRACE("pool job interrupted while running\n");
+     __atomic_store_n(&job.cancelled, TRUE, __ATOMIC_RELAXED);
+   }
+
+   struct timespec deadline;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_nsec += POOL_INTERRUPT_POLL_MS * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L) {
+     deadline.tv_sec++;
+     deadline.tv_nsec -= 1000000000L;
+   }
+   pthread_cond_timedwait(&p_pool->done_cond, &p_pool->mutex, &deadline);
+ }
+ PTHREAD_UNLOCK(&p_pool->mutex);
+
+ return job.result;
+}
+
+/**
+ * Queue a job in the worker pool, without waiting for it to finish, e.g. to
+ * carry on after the FUSE operation that started it returns. Must be called
+ * from a FUSE operation, whose client process decides the job priority. If
+ * there's no worker to run it, it's run by the caller.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     class The class of the job.
+ * @param[in]     fn    The job function.
+ * @param[in]     arg   The argument to 'fn'.
+ */
+static void pool_submit (notmuch_context_t *p_ctx,
+                         pool_class_t       class,
+                         pool_fn_t          fn,
+                         void              *arg)
+{
+ pool_t     *p_pool = &p_ctx->pool;
+ pool_job_t *p_job  = malloc(sizeof(pool_job_t));
+
+ memset(p_job, 0, sizeof(pool_job_t));
+ p_job->fn       = fn;
+ p_job->arg      = arg;
+ p_job->detached = TRUE;
+
+ PTHREAD_LOCK(&p_pool->mutex);
+ p_job->priority = pool_classify_locked(p_pool);
+ bool queued = pool_queue_locked(p_ctx, class, p_job);
+ PTHREAD_UNLOCK(&p_pool->mutex);
+
+ if (!queued) {
+   free(p_job);
+   (void)fn(p_ctx, arg);
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * Dereference the symlink of a query directory in the backing store
+ * (repeatedly), if it is one.
+ *
+ * @param[in,out] query_in The directory name on input, the query on output.
+ *                         Must be PATH_MAX long.
+ * @return 0 on success, or a negative errno.
+ */
+static int resolve_query_link (char *query_in)
+{
+ struct stat stbuf;
+
+ while (TRUE) {
+   LOG_TRACE("resolve_query stat(%s)\n", query_in);
+   if (lstat(query_in, &stbuf) != 0 || !S_ISLNK(stbuf.st_mode))
+     return 0;
+
+   char    link_name[PATH_MAX + 1];
+   LOG_TRACE("resolve_query dereference symlink %s for query\n", query_in);
+   ssize_t res = readlink(query_in, link_name, PATH_MAX);
+   if (res < 0)
+     return -errno;
+   if (res >= PATH_MAX)
+     return -ENAMETOOLONG;
+   link_name[res] = '\0';
+   memcpy(query_in, link_name, res + 1);
+ }
+}
+
+/**
+ * Find the query of the innermost of nested query directories on its own,
+ * i.e. its name, or the target of its symlink.
+ *
+ * @param[in]  dir   The query directory, relative to the backing store.
+ * @param[out] query The query. Must be PATH_MAX long.
+ * @return 0 on success, or a negative errno.
+ */
+static int resolve_query_component (const char *dir, char *query)
+{
+ strncpy(query, dir, PATH_MAX - 1);
+ query[PATH_MAX - 1] = '\0';
+ int res = resolve_query_link(query);
+ if (res == 0 && strcmp(query, dir) == 0) {
+   /* Not a symlink, so the query is the directory's own name. */
+   const char *last_slash = strrchr(dir, '/');
+   if (last_slash != NULL)
+     memmove(query, last_slash + 1, strlen(last_slash + 1) + 1);
+ }
+ return res;
+}
+
+/**
+ * Turn the name of a query directory in the backing store into the notmuch
+ * query it represents. If it's a symlink, dereference it (repeatedly).
+ *
+ * A query directory nested in others, '<parent>/<child>', represents the
+ * messages matching both: '(<parent>) and (<child>)', and so on for deeper
+ * nesting.
+ *
+ * @param[in,out] query_in The directory name on input, the query on output.
+ *                         Must be PATH_MAX long.
+ * @return 0 on success, or a negative errno.
+ */
+static int resolve_query (char *query_in)
+{
+ if (strchr(query_in, '/') == NULL)
+   return resolve_query_link(query_in);
+
+ char   query[PATH_MAX];
+ size_t length = 0;
+ char  *end    = query_in;
+ do {
+   end = strchr(end + 1, '/');
+
+   char   prefix[PATH_MAX];
+   char   component[PATH_MAX];
+   size_t prefix_length = (end != NULL) ? (size_t)(end - query_in)
+                                        : strlen(query_in);
+   memcpy(prefix, query_in, prefix_length);
+   prefix[prefix_length] = '\0';
+   int res = resolve_query_component(prefix, component);
+   if (res != 0)
+     return res;
+
+   int n = snprintf(query + length, PATH_MAX - length, "%s(%s)",
+                    (length > 0) ? " and " : "", component);
+   if (n < 0 || (size_t)n >= PATH_MAX - length)
+     return -ENAMETOOLONG;
+   length += n;
+ } while (end != NULL);
+
+ memcpy(query_in, query, length + 1);
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Split a virtual path of the form '/<query>/<subdir>/<name>', where
+ * 'subdir' is one of the maildir directories 'cur', 'new' or 'tmp'.
+ *
+ * @param[in]  path   The virtual path.
+ * @param[out] query  The '<query>' part of the path. Must be PATH_MAX long.
+ * @param[out] subdir The '<subdir>' part of the path. Must be 4 bytes long.
+ * @param[out] p_name The '<name>' part of the path, pointing into 'path'.
+ * @return TRUE if the path has this form.
+ */
+static bool split_message_path (const char  *path,
+                                char        *query,
+                                char        *subdir,
+                                const char **p_name)
+{
+ assert(path[0] == '/');
+
+ const char *last_slash = strrchr(path, '/');
+ if (last_slash == path || last_slash[1] == '\0')
+   return FALSE;
+
+ const char *sub_slash = last_slash - 1;
+ while (sub_slash > path && *sub_slash != '/')
+   sub_slash--;
+ if (sub_slash == path || last_slash - sub_slash != 4)
+   return FALSE;
+ if (memcmp(sub_slash + 1, "cur", 3) != 0 &&
+     memcmp(sub_slash + 1, "new", 3) != 0 &&
+     memcmp(sub_slash + 1, "tmp", 3) != 0)
+   return FALSE;
+
+ size_t query_length = sub_slash - path - 1;
+ if (query_length >= PATH_MAX)
+   return FALSE;
+ memcpy(query, path + 1, query_length);
+ query[query_length] = '\0';
+ memcpy(subdir, sub_slash + 1, 3);
+ subdir[3] = '\0';
+ *p_name = last_slash + 1;
+ return TRUE;
+}
+
+/*============================================================================*/
+
+/**
+ * The name of the headers-only view of each query directory, next to cur/,
+ * new/ and tmp/. It holds the same messages as cur/, cut short after their
+ * header block.
+ */
+#define HEADER_VIEW_DIR "hdr"
+
+/**
+ * Whether a path in the backing store names a query directory, possibly
+ * nested in others. Nested query directories can't be named like the
+ * maildir directories or virtual query files they sit next to.
+ *
+ * @param[in] dir    The path, relative to the backing store.
+ * @param[in] length The length of the path.
+ * @return TRUE if it's a query directory.
+ */
+static bool is_query_dir (const char *dir, size_t length)
+{
+ const char *end   = dir + length;
+ const char *slash = memchr(dir, '/', length);
+
+ if (length == 0)
+   return FALSE;
+ while (slash != NULL) {
+   const char *component = slash + 1;
+   slash = memchr(component, '/', end - component);
+   size_t component_length = ((slash != NULL) ? slash : end) - component;
+   if (component_length == 0 || component[0] == '.')
+     return FALSE;
+   if (component_length == 3 &&
+       (memcmp(component, "cur", 3) == 0 ||
+        memcmp(component, "new", 3) == 0 ||
+        memcmp(component, "tmp", 3) == 0 ||
+        memcmp(component, HEADER_VIEW_DIR, 3) == 0))
+     return FALSE;
+ }
+ return TRUE;
+}
+
+/**
+ * Whether a virtual path is a query directory (or alias), whose extended
+ * attributes are those of its backing store directory.
+ *
+ * @param[in] path The virtual path.
+ * @return TRUE if 'path' is '/<query>', or '/<query>/<query>' etc.
+ */
+static bool is_query_dir_path (const char *path)
+{
+ assert(path[0] == '/');
+ return is_query_dir(path + 1, strlen(path + 1));
+}
+
+/**
+ * Find the message name in a virtual path of the form
+ * '/<query>/hdr/<name>', i.e. of a message in a headers-only view.
+ *
+ * @param[in] path The virtual path.
+ * @return The '<name>' part of the path, pointing into 'path', or NULL if
+ *         the path doesn't have this form.
+ */
+static const char *header_view_name (const char *path)
+{
+ assert(path[0] == '/');
+
+ const char *last_slash = strrchr(path, '/');
+ const char *hdr_slash  = last_slash - strlen("/" HEADER_VIEW_DIR);
+ if (last_slash[1] == '\0' || hdr_slash <= path ||
+     memcmp(hdr_slash, "/" HEADER_VIEW_DIR, strlen("/" HEADER_VIEW_DIR)) != 0)
+   return NULL;
+
+ /* The query directory may be nested, but not in a maildir directory. */
+ if (!is_query_dir(path + 1, hdr_slash - path - 1))
+   return NULL;
+ return last_slash + 1;
+}
+
+/*============================================================================*/
+
+/**
+ * @section compressed Compressed Messages
+ *
+ * With the 'compressed' option, message files compressed with gzip (or zstd,
+ * if built with NOTMUCHFS_ZSTD) are read decompressed, and their size is
+ * reported as the decompressed size. A compressed message is decompressed
+ * whole when it's opened, and kept in the plain_cache_t, so random reads of
+ * it are cheap.
+ *
+ * The size is read from the gzip trailer, or the zstd frame headers, with a
+ * few small reads. Where it isn't recorded, or a message has been
+ * decompressed anyway, the size found is remembered, so each file is
+ * decompressed at most once to find it.
+ */
+
+/** The most decompressed sizes remembered, see plain_size_remember(). */
+#define PLAIN_SIZE_CACHE_MAX 65536
+
+/**
+ * The compression formats of message files.
+ */
+typedef enum
+{
+ COMPRESSION_NONE,
+ COMPRESSION_GZIP,
+ COMPRESSION_ZSTD
+} compression_t;
+
+/**
+ * Find how a message file is compressed, from its magic number.
+ *
+ * @param[in] fd The open message file.
+ * @return The compression format, always #COMPRESSION_NONE unless
+ *         global_config.compressed is set.
+ */
+static compression_t compression_detect (int fd)
+{
+ unsigned char magic[4];
+
+ if (!global_config.compressed ||
+     pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+   return COMPRESSION_NONE;
+ if (magic[0] == 0x1f && magic[1] == 0x8b)
+   return COMPRESSION_GZIP;
+#ifdef NOTMUCHFS_ZSTD
+ if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+     magic[3] == 0xfd)
+   return COMPRESSION_ZSTD;
+#endif
+ return COMPRESSION_NONE;
+}
+
+/**
+ * Read the whole of a (compressed) message file.
+ *
+ * @param[in]  fd       The open message file.
+ * @param[out] p_data   The content, to be freed by the caller.
+ * @param[out] p_length The length of 'p_data'.
+ * @return 0 on success, or a negative errno.
+ */
+static int read_file (int fd, char **p_data, size_t *p_length)
+{
+ struct stat st;
+ if (fstat(fd, &st) != 0)
+   return -errno;
+
+ char  *in        = malloc(MAX(st.st_size, 1));
+ size_t in_length = 0;
+ while (in_length < (size_t)st.st_size) {
+   ssize_t bytes_read = pread(fd, in + in_length, st.st_size - in_length,
+                              in_length);
+   if (bytes_read <= 0) {
+     free(in);
+     return (bytes_read == -1) ? -errno : -EIO;
+   }
+   in_length += bytes_read;
+ }
+ *p_data   = in;
+ *p_length = in_length;
+ return 0;
+}
+
+/**
+ * Decompress the whole content of a message file.
+ *
+ * @param[in]  in          The compressed content.
+ * @param[in]  in_length   The length of 'in'.
+ * @param[in]  compression How it's compressed.
+ * @param[out] p_data      The decompressed content, to be freed by the
+ *                         caller.
+ * @param[out] p_length    The length of 'p_data'.
+ * @return 0 on success, or a negative errno.
+ */
+static int decompress_data (const char     *in,
+                            size_t          in_length,
+                            compression_t   compression,
+                            char          **p_data,
+                            size_t         *p_length)
+{
+ /* Mail compresses about 4:1, it grows as needed anyway. */
+ size_t max    = MAX(in_length * 4, 4096);
+ char  *out    = malloc(max);
+ size_t length = 0;
+ int    res    = 0;
+
+ if (compression == COMPRESSION_GZIP) {
+   z_stream stream;
+   memset(&stream, 0, sizeof(stream));
+   /* 16 means gzip wrapping. */
+   if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+     res = -ENOMEM;
+   }
+   else {
+     stream.next_in  = (Bytef *)in;
+     stream.avail_in = in_length;
+     while (res == 0) {
+       if (length == max) {
+         max *= 2;
+         out  = realloc(out, max);
+       }
+       stream.next_out  = (Bytef *)out + length;
+       stream.avail_out = max - length;
+       int status = inflate(&stream, Z_NO_FLUSH);
+       length = max - stream.avail_out;
+       if (status == Z_STREAM_END) {
+         /* There may be more members concatenated. */
+         if (stream.avail_in == 0)
+           break;
+         inflateReset(&stream);
+       }
+       else if (status != Z_OK && !(status == Z_BUF_ERROR && length == max)) {
+         res = -EIO;
+       }
+     }
+     inflateEnd(&stream);
+   }
+ }
+#ifdef NOTMUCHFS_ZSTD
+ else if (compression == COMPRESSION_ZSTD) {
+   ZSTD_DStream  *p_stream = ZSTD_createDStream();
+   ZSTD_inBuffer  input    = { in, in_length, 0 };
+   ZSTD_initDStream(p_stream);
+   for (;;) {
+     if (length == max) {
+       max *= 2;
+       out  = realloc(out, max);
+     }
+     ZSTD_outBuffer output = { out, max, length };
+     size_t         status = ZSTD_decompressStream(p_stream, &output, &input);
+     length = output.pos;
+     if (ZSTD_isError(status)) {
+       res = -EIO;
+       break;
+     }
+     /* Done once all the input is used, with room left over for more,
+      * which must be the end of a frame, or the file is truncated.
+      */
+     if (input.pos == input.size && length < max) {
+       if (status != 0)
+         res = -EIO;
+       break;
+     }
+   }
+   ZSTD_freeDStream(p_stream);
+ }
+#endif
+ else {
+   res = -EINVAL;
+ }
+
+ if (res != 0) {
+   fprintf(stderr, "ERROR: Can't decompress message file: %s.\n",
+           strerror(-res));
+   free(out);
+   return res;
+ }
+ *p_data   = out;
+ *p_length = length;
+ return 0;
+}
+
+/**
+ * Decompress a whole message file.
+ *
+ * @param[in]  fd          The open message file.
+ * @param[in]  compression How it's compressed.
+ * @param[out] p_data      The decompressed content, to be freed by the
+ *                         caller.
+ * @param[out] p_length    The length of 'p_data'.
+ * @return 0 on success, or a negative errno.
+ */
+static int decompress_file (int            fd,
+                            compression_t  compression,
+                            char         **p_data,
+                            size_t        *p_length)
+{
+ char  *in        = NULL;
+ size_t in_length = 0;
+ int    res       = read_file(fd, &in, &in_length);
+ if (res != 0)
+   return res;
+
+ res = decompress_data(in, in_length, compression, p_data, p_length);
+ free(in);
+ return res;
+}
+
+/**
+ * Read a little endian number from a message file.
+ *
+ * @param[in]  fd     The open message file.
+ * @param[in]  offset Where to read it.
+ * @param[in]  length Its length in bytes, at most 4.
+ * @param[out] p_n    The number.
+ * @return TRUE if it was read.
+ */
+static bool read_le (int fd, off_t offset, size_t length, uint32_t *p_n)
+{
+ unsigned char bytes[4];
+
+ if (pread(fd, bytes, length, offset) != (ssize_t)length)
+   return FALSE;
+ *p_n = 0;
+ for (size_t i = length; i > 0; i--)
+   *p_n = (*p_n << 8) | bytes[i - 1];
+ return TRUE;
+}
+
+#ifdef NOTMUCHFS_ZSTD
+/**
+ * Add up the sizes recorded in the frame headers of a zstd message file,
+ * finding where each frame ends from its block headers.
+ *
+ * @param[in]  fd        The open message file.
+ * @param[in]  file_size The size of the file.
+ * @param[out] p_size    The decompressed size.
+ * @return TRUE if every frame records its size.
+ */
+static bool zstd_frames_size (int fd, off_t file_size, off_t *p_size)
+{
+ /* The frame header lengths of each dictionary ID and content size flag. */
+ static const size_t dict_id_length[] = { 0, 1, 2, 4 };
+ static const size_t size_length[]    = { 0, 2, 4, 8 };
+
+ unsigned long long total = 0;
+ off_t              pos   = 0;
+ while (pos < file_size) {
+   unsigned char header[18];
+   ssize_t       header_length = pread(fd, header, sizeof(header), pos);
+   if (header_length < 8)
+     return FALSE;
+
+   if (header[0] >= 0x50 && header[0] <= 0x5f && header[1] == 0x2a &&
+       header[2] == 0x4d && header[3] == 0x18) {
+     /* A skippable frame, with its length after the magic number. */
+     uint32_t length;
+     if (!read_le(fd, pos + 4, 4, &length))
+       return FALSE;
+     pos += 8 + (off_t)length;
+     continue;
+   }
+
+   unsigned long long size = ZSTD_getFrameContentSize(header, header_length);
+   if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR)
+     return FALSE;
+   total += size;
+
+   /* The magic number, descriptor, window size (unless it's a single
+    * segment, whose size is then always recorded), dictionary ID and size.
+    */
+   unsigned char descriptor     = header[4];
+   bool          single_segment = (descriptor & 0x20) != 0;
+   size_t        size_bytes     = size_length[descriptor >> 6];
+   if (size_bytes == 0 && single_segment)
+     size_bytes = 1;
+   pos += 5 + (single_segment ? 0 : 1) + dict_id_length[descriptor & 3] +
+          size_bytes;
+
+   /* Each block header gives its type and length, and if it's the last. */
+   uint32_t block;
+   do {
+     if (!read_le(fd, pos, 3, &block) || ((block >> 1) & 3) == 3)
+       return FALSE;
+     /* An RLE block is one byte repeated. */
+     pos += 3 + ((((block >> 1) & 3) == 1) ? 1 : (block >> 3));
+   } while ((block & 1) == 0);
+
+   /* The content checksum. */
+   if (descriptor & 0x04)
+     pos += 4;
+ }
+ if (pos != file_size)
+   return FALSE;
+
+ *p_size = (off_t)total;
+ return TRUE;
+}
+#endif
+
+/**
+ * Find the decompressed size of a compressed message file, without
+ * decompressing it if the format records it.
+ *
+ * A gzip file records the size (modulo 2^32) of its last member, which is
+ * all of it as gzip writes it; a file of several members reports just the
+ * last until it has been decompressed and its size remembered.
+ *
+ * @param[in]  fd          The open message file.
+ * @param[in]  file_size   The size of the file.
+ * @param[in]  compression How it's compressed.
+ * @param[out] p_size      The decompressed size.
+ * @param[out] p_counted   Whether it had to be decompressed to find it.
+ * @return 0 on success, or a negative errno.
+ */
+static int decompressed_size (int            fd,
+                              off_t          file_size,
+                              compression_t  compression,
+                              off_t         *p_size,
+                              bool          *p_counted)
+{
+ *p_counted = FALSE;
+ if (compression == COMPRESSION_GZIP) {
+   uint32_t size;
+   if (file_size >= 18 && read_le(fd, file_size - 4, 4, &size)) {
+     *p_size = size;
+     return 0;
+   }
+ }
+#ifdef NOTMUCHFS_ZSTD
+ else if (compression == COMPRESSION_ZSTD) {
+   if (zstd_frames_size(fd, file_size, p_size))
+     return 0;
+ }
+#endif
+
+ /* Not recorded, so count it. */
+ char  *data;
+ size_t length;
+ int    res = decompress_file(fd, compression, &data, &length);
+ if (res != 0)
+   return res;
+ free(data);
+ *p_size    = length;
+ *p_counted = TRUE;
+ return 0;
+}
+
+/**
+ * Remember the decompressed size of a compressed message file.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     fname The real file name of the message.
+ * @param[in]     p_st  The attributes of the (compressed) file.
+ * @param[in]     size  The decompressed size.
+ */
+static void plain_size_remember (notmuch_context_t *p_ctx,
+                                 const char        *fname,
+                                 const struct stat *p_st,
+                                 off_t              size)
+{
+ plain_cache_t *p_cache = &p_ctx->plain_cache;
+ plain_size_t  *p_size  = malloc(sizeof(plain_size_t));
+
+ p_size->ino             = p_st->st_ino;
+ p_size->compressed_size = p_st->st_size;
+ p_size->mtime           = p_st->st_mtime;
+ p_size->size            = size;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->sizes.count >= PLAIN_SIZE_CACHE_MAX &&
+     strmap_get(&p_cache->sizes, fname) == NULL) {
+   strmap_destroy(&p_cache->sizes, free);
+   strmap_init(&p_cache->sizes);
+ }
+ free(strmap_put(&p_cache->sizes, fname, p_size));
+ PTHREAD_UNLOCK(&p_cache->mutex);
+}
+
+/**
+ * stat() a message file, giving the decompressed size of a compressed one.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     fname The real file name of the message.
+ * @param[out]    p_st  The attributes.
+ * @return 0 on success, or -1 with errno set, like stat().
+ */
+static int message_stat (notmuch_context_t *p_ctx,
+                         const char        *fname,
+                         struct stat       *p_st)
+{
+ if (stat(fname, p_st) != 0)
+   return -1;
+ if (!global_config.compressed)
+   return 0;
+
+ plain_cache_t *p_cache = &p_ctx->plain_cache;
+ bool           found   = FALSE;
+ PTHREAD_LOCK(&p_cache->mutex);
+ plain_size_t *p_size = strmap_get(&p_cache->sizes, fname);
+ if (p_size != NULL && p_size->ino == p_st->st_ino &&
+     p_size->compressed_size == p_st->st_size &&
+     p_size->mtime == p_st->st_mtime) {
+   p_st->st_size = p_size->size;
+   found         = TRUE;
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+ if (found)
+   return 0;
+
+ int fd = open(fname, O_RDONLY);
+ if (fd == -1)
+   return -1;
+ compression_t compression = compression_detect(fd);
+ int           res         = 0;
+ if (compression != COMPRESSION_NONE) {
+   off_t size;
+   bool  counted;
+   res = decompressed_size(fd, p_st->st_size, compression, &size, &counted);
+   if (res == 0 && counted)
+     plain_size_remember(p_ctx, fname, p_st, size);
+   if (res == 0)
+     p_st->st_size = size;
+ }
+ close(fd);
+ if (res != 0) {
+   errno = -res;
+   return -1;
+ }
+ return 0;
+}
+
+/**
+ * Drop a reference to decompressed content, freeing it if it was the last
+ * one.
+ *
+ * @param[in,out] p_ctx   The notmuch context.
+ * @param[in]     p_plain The decompressed content, or NULL.
+ */
+static void plain_unref (notmuch_context_t *p_ctx, plain_t *p_plain)
+{
+ if (p_plain == NULL)
+   return;
+
+ PTHREAD_LOCK(&p_ctx->plain_cache.mutex);
+ assert(p_plain->refs > 0);
+ bool last = (--p_plain->refs == 0);
+ PTHREAD_UNLOCK(&p_ctx->plain_cache.mutex);
+
+ if (last) {
+   free(p_plain->fname);
+   free(p_plain->data);
+   free(p_plain);
+ }
+}
+
+/**
+ * Find the decompressed content of a message file, if it's compressed.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     fname    The real file name of the message.
+ * @param[in]     fd       The open message file.
+ * @param[out]    pp_plain The decompressed content, with a reference held by
+ *                         the caller, or NULL if the file isn't compressed.
+ * @return 0 on success, or a negative errno.
+ */
+static int plain_get (notmuch_context_t  *p_ctx,
+                      const char         *fname,
+                      int                 fd,
+                      plain_t           **pp_plain)
+{
+ plain_cache_t *p_cache = &p_ctx->plain_cache;
+
+ *pp_plain = NULL;
+ compression_t compression = compression_detect(fd);
+ if (compression == COMPRESSION_NONE)
+   return 0;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ *pp_plain = strmap_get(&p_cache->messages, fname);
+ if (*pp_plain != NULL)
+   (*pp_plain)->refs++;
+ PTHREAD_UNLOCK(&p_cache->mutex);
+ if (*pp_plain != NULL)
+   return 0;
+
+ /* Decompress it without holding the lock. */
+ plain_t *p_plain = malloc(sizeof(plain_t));
+ memset(p_plain, 0, sizeof(plain_t));
+ int res = decompress_file(fd, compression, &p_plain->data,
+                           &p_plain->length);
+ if (res != 0) {
+   free(p_plain);
+   return res;
+ }
+ /* The size reported is now known for sure. */
+ struct stat st;
+ if (fstat(fd, &st) == 0)
+   plain_size_remember(p_ctx, fname, &st, p_plain->length);
+ p_plain->fname = strdup(fname);
+ /* One for the caller, one for the cache. */
+ p_plain->refs  = 2;
+
+ plain_t *p_evicted = NULL;
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (strmap_get(&p_cache->messages, fname) == NULL) {
+   strmap_put(&p_cache->messages, fname, p_plain);
+   if (p_cache->tail != NULL)
+     p_cache->tail->next = p_plain;
+   else
+     p_cache->head = p_plain;
+   p_cache->tail   = p_plain;
+   p_cache->bytes += p_plain->length;
+
+   /* Drop the oldest, down to the limit (except the one just added). */
+   while (p_cache->bytes > (size_t)global_config.compressed_cache << 20 &&
+          p_cache->head != p_plain) {
+     plain_t *p_old = p_cache->head;
+     p_cache->head   = p_old->next;
+     p_cache->bytes -= p_old->length;
+     strmap_remove(&p_cache->messages, p_old->fname);
+     p_old->next = p_evicted;
+     p_evicted   = p_old;
+   }
+ }
+ else {
+   /* Someone else got there first, just use this one. */
+   p_plain->refs--;
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ while (p_evicted != NULL) {
+   plain_t *p_next = p_evicted->next;
+   plain_unref(p_ctx, p_evicted);
+   p_evicted = p_next;
+ }
+
+ *pp_plain = p_plain;
+ return 0;
+}
+
+/**
+ * Free all the decompressed content, and sizes, in the cache.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void plain_cache_clear (notmuch_context_t *p_ctx)
+{
+ plain_cache_t *p_cache = &p_ctx->plain_cache;
+ plain_t       *p_plain = p_cache->head;
+
+ p_cache->head = p_cache->tail = NULL;
+ p_cache->bytes = 0;
+ strmap_destroy(&p_cache->messages, NULL);
+ strmap_destroy(&p_cache->sizes, free);
+ while (p_plain != NULL) {
+   plain_t *p_next = p_plain->next;
+   plain_unref(p_ctx, p_plain);
+   p_plain = p_next;
+ }
+}
+
+/**
+ * Read from a message file, or its decompressed content.
+ *
+ * @param[in]  fd      The open message file.
+ * @param[in]  p_plain The decompressed content of the file, or NULL if it
+ *                     isn't compressed.
+ * @param[out] buf     The buffer to fill.
+ * @param[in]  size    The number of bytes to read.
+ * @param[in]  offset  The offset to read from.
+ * @return The number of bytes read, or -1 with errno set, like pread().
+ */
+static ssize_t message_pread (int            fd,
+                              const plain_t *p_plain,
+                              char          *buf,
+                              size_t         size,
+                              off_t          offset)
+{
+ if (p_plain == NULL)
+   return pread(fd, buf, size, offset);
+
+ if ((size_t)offset >= p_plain->length)
+   return 0;
+ size = MIN(size, p_plain->length - offset);
+ memcpy(buf, p_plain->data + offset, size);
+ return size;
+}
+
+/*============================================================================*/
+
+/**
+ * Find the length of the header block of a message file: up to and
+ * including the blank line that ends it, or the whole file if there is
+ * none.
+ *
+ * @param[in]  fd       The open message file.
+ * @param[in]  p_plain  The decompressed content of the file, or NULL if it
+ *                      isn't compressed.
+ * @param[out] p_length The length.
+ * @return 0 on success, or a negative errno.
+ */
+static int message_header_length (int            fd,
+                                  const plain_t *p_plain,
+                                  off_t         *p_length)
+{
+ char  buf[4096];
+ off_t offset = 0;
+ /* The number of newlines just seen, ignoring carriage returns. */
+ int   newlines = 0;
+
+ for (;;) {
+   ssize_t bytes_read = message_pread(fd, p_plain, buf, sizeof(buf), offset);
+   if (bytes_read == -1)
+     return -errno;
+   if (bytes_read == 0)
+     break;
+
+   for (ssize_t i = 0; i < bytes_read; i++) {
+     if (buf[i] == '\n') {
+       if (++newlines == 2) {
+         *p_length = offset + i + 1;
+         return 0;
+       }
+     }
+     else if (buf[i] != '\r') {
+       newlines = 0;
+     }
+   }
+   offset += bytes_read;
+ }
+ *p_length = offset;
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Build the real path of a message file in the delivery maildir.
+ *
+ * @param[out] buf    The buffer to fill. Must be PATH_MAX long.
+ * @param[in]  subdir The maildir directory, 'cur', 'new' or 'tmp'.
+ * @param[in]  name   The message file name.
+ * @return 0 on success, or a negative errno.
+ */
+static int deliver_path (char *buf, const char *subdir, const char *name)
+{
+ if (global_config.deliver_dir == NULL)
+   return -ENOTSUP;
+
+ /* A name containing # is a virtual name for an existing message, not
+  * something being delivered.
+  */
+ if (strchr(name, '#') != NULL)
+   return -EINVAL;
+
+ int length = snprintf(buf, PATH_MAX, "%s/%s/%s", global_config.deliver_dir,
+                       subdir, name);
+ if (length < 0 || length >= PATH_MAX)
+   return -ENAMETOOLONG;
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Collect the tags that a message must have to match a notmuch query, such
+ * that a message delivered into a virtual maildir will show up there.
+ *
+ * Only positive 'tag:' (or 'is:') terms of a purely conjunctive query are
+ * considered. If the query contains 'or' or 'xor', no tags can be inferred.
+ *
+ * @param[in] query The notmuch query.
+ * @return A newly allocated newline-delimited list of tags, or NULL if there
+ *         are none.
+ */
+static char *query_required_tags (const char *query)
+{
+ char  *tags    = NULL;
+ size_t length  = 0;
+ bool   negated = FALSE;
+
+ const char *token = query;
+ while (*token != '\0') {
+   while (*token == ' ' || *token == '\t' || *token == '(' || *token == ')')
+     token++;
+   const char *end = token;
+   while (*end != '\0' && *end != ' ' && *end != '\t' && *end != '(' &&
+          *end != ')')
+     end++;
+   size_t token_length = end - token;
+   if (token_length == 0)
+     break;
+
+   if ((token_length == 2 && strncasecmp(token, "or", 2) == 0) ||
+       (token_length == 3 && strncasecmp(token, "xor", 3) == 0)) {
+     free(tags);
+     return NULL;
+   }
+   else if (token_length == 3 && strncasecmp(token, "not", 3) == 0) {
+     negated = TRUE;
+   }
+   else if (token_length == 3 && strncasecmp(token, "and", 3) == 0) {
+     /* Implied anyway. */
+   }
+   else {
+     const char *tag = NULL;
+     if (token[0] == '-' || token[0] == '+') {
+       negated = negated || (token[0] == '-');
+       token++;
+       token_length--;
+     }
+     if (token_length > 4 && strncmp(token, "tag:", 4) == 0)
+       tag = token + 4;
+     else if (token_length > 3 && strncmp(token, "is:", 3) == 0)
+       tag = token + 3;
+
+     if (tag != NULL && !negated) {
+       size_t tag_length = end - tag;
+       if (tag[0] == '"' && tag_length >= 2 && tag[tag_length - 1] == '"') {
+         tag++;
+         tag_length -= 2;
+       }
+       tags = realloc(tags, length + tag_length + 2);
+       memcpy(tags + length, tag, tag_length);
+       length += tag_length;
+       tags[length++] = '\n';
+       tags[length] = '\0';
+     }
+     negated = FALSE;
+   }
+   token = end;
+ }
+
+ return tags;
+}
+
+/*============================================================================*/
+
+/** The most queries a pool worker keeps for reuse, see pool_db_t. */
+#define POOL_DB_MAX_QUERIES 64
+
+/**
+ * Create a notmuch query, which excludes messages with the tags excluded by
+ * the notmuch configuration. On a pool worker's own database handle, the
+ * same query is reused if it was created before (see database_open()).
+ *
+ * @param[in] p_ctx        The notmuch context.
+ * @param[in] p_db         The open database.
+ * @param[in] query_string The notmuch query.
+ * @return The query, to release with query_release(), or NULL on error.
+ */
+static notmuch_query_t *query_create (notmuch_context_t  *p_ctx,
+                                      notmuch_database_t *p_db,
+                                      const char         *query_string)
+{
+ bool reuse = (pool_db != NULL && p_db == pool_db->p_db);
+ if (reuse) {
+   notmuch_query_t *p_query = strmap_get(&pool_db->queries, query_string);
+   if (p_query != NULL) {
+     __atomic_add_fetch(&p_ctx->pool.query_reuses, 1, __ATOMIC_RELAXED);
+     return p_query;
+   }
+ }
+
+ notmuch_query_t *p_query = notmuch_query_create(p_db, query_string);
+ if (p_query == NULL)
+   return NULL;
+
+ /* Exclude messages that match the 'excluded' tags. */
+ char *excluded_tags = strdup(p_ctx->excluded_tags);
+ char *save_ptr      = NULL;
+ char *exclude_tag   = strtok_r(excluded_tags, "\n", &save_ptr);
+ while (exclude_tag != NULL) {
+   notmuch_query_add_tag_exclude(p_query, exclude_tag);
+   exclude_tag = strtok_r(NULL, "\n", &save_ptr);
+ }
+ free(excluded_tags);
+ notmuch_query_set_omit_excluded(p_query, NOTMUCH_EXCLUDE_ALL);
+
+ if (reuse && pool_db->queries.count < POOL_DB_MAX_QUERIES)
+   strmap_put(&pool_db->queries, query_string, p_query);
+ return p_query;
+}
+
+/**
+ * Release a query created by query_create(), destroying it unless it's kept
+ * for reuse.
+ *
+ * @param[in] p_query The query.
+ */
+static void query_release (notmuch_query_t *p_query)
+{
+ if (pool_db != NULL &&
+     strmap_get(&pool_db->queries,
+                notmuch_query_get_query_string(p_query)) == p_query)
+   return;
+ notmuch_query_destroy(p_query);
+}
+
+/*============================================================================*/
+
+/**
+ * Convert a real message file name to its virtual message name.
+ *
+ * @param[out] buf   The buffer to fill. Must be PATH_MAX long.
+ * @param[in]  fname The real file name.
+ */
+static void virtual_name (char *buf, const char *fname)
+{
+ strncpy(buf, fname, PATH_MAX - 1);
+ buf[PATH_MAX - 1] = '\0';
+ string_replace(buf, '/', '#');
+}
+
+/*============================================================================*/
+
+/**
+ * Free a listing.
+ *
+ * @param[in] p_listing The listing, with no references left.
+ */
+static void listing_free (listing_t *p_listing)
+{
+ assert(p_listing->refs == 0);
+
+ for (size_t i = 0; i < p_listing->n_entries; i++) {
+   free(p_listing->entries[i].name);
+   free(p_listing->entries[i].id);
+ }
+ free(p_listing->entries);
+ free(p_listing->dirents);
+ strmap_destroy(&p_listing->index, NULL);
+ strmap_destroy(&p_listing->dirs, free);
+ free(p_listing->query);
+ free(p_listing);
+}
+
+/*============================================================================*/
+
+/**
+ * Drop a reference to a listing, freeing it if it was the last one.
+ *
+ * @param[in] p_cache   The cache, which must be locked.
+ * @param[in] p_listing The listing.
+ */
+static void listing_unref_locked (cache_t *p_cache, listing_t *p_listing)
+{
+ (void)p_cache;
+ assert(p_listing->refs > 0);
+ if (--p_listing->refs == 0)
+   listing_free(p_listing);
+}
+
+/*============================================================================*/
+
+/**
+ * Drop a reference to a listing, freeing it if it was the last one.
+ *
+ * @param[in] p_ctx     The notmuch context.
+ * @param[in] p_listing The listing.
+ */
+static void listing_unref (notmuch_context_t *p_ctx, listing_t *p_listing)
+{
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ listing_unref_locked(&p_ctx->cache, p_listing);
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * Allocate an empty listing.
+ *
+ * @param[in] query       The notmuch query.
+ * @param[in] revision    The database revision the listing is built from.
+ * @param[in] max_entries The number of entries to allocate space for.
+ * @return The listing, with one reference held by the caller.
+ */
+static listing_t *listing_alloc (const char    *query,
+                                 unsigned long  revision,
+                                 size_t         max_entries)
+{
+ listing_t *p_listing = malloc(sizeof(listing_t));
+
+ memset(p_listing, 0, sizeof(listing_t));
+ p_listing->query     = strdup(query);
+ p_listing->entries   = malloc(MAX(max_entries, 1) * sizeof(listing_entry_t));
+ p_listing->revision  = revision;
+ p_listing->built     = time(NULL);
+ p_listing->last_used = p_listing->built;
+ p_listing->refs      = 1;
+ p_listing->policy.ttl = -1;
+ strmap_init(&p_listing->index);
+ strmap_init(&p_listing->dirs);
+ return p_listing;
+}
+
+/*============================================================================*/
+
+/**
+ * Append a message to a listing being built, if its file exists.
+ *
+ * @param[in,out] p_ctx     The notmuch context.
+ * @param[in,out] p_listing The listing, with space for another entry.
+ * @param[in]     fname     The real file name of the message.
+ * @param[in]     id        The message ID.
+ */
+static void listing_add (notmuch_context_t *p_ctx,
+                         listing_t         *p_listing,
+                         const char        *fname,
+                         const char        *id)
+{
+ listing_entry_t *p_entry = &p_listing->entries[p_listing->n_entries];
+ char             trans_name[PATH_MAX];
+
+ virtual_name(trans_name, fname);
+ if (strmap_get(&p_listing->index, trans_name) != NULL)
+   return;
+
+ if (message_stat(p_ctx, fname, &p_entry->st) == 0) {
+   /* Perpetuate the file size inflation lie told in getattr(). */
+   p_entry->st.st_size += XLABEL_LENGTH;
+   p_entry->name          = strdup(trans_name);
+   p_entry->id            = strdup(id);
+   p_entry->deleted       = FALSE;
+   p_entry->header_length = 0;
+   strmap_put(&p_listing->index, trans_name, p_entry);
+   p_listing->n_entries++;
+ }
+ else if (errno == ENOENT) {
+   /* If a message is gone, don't stop the whole listing. */
+   fprintf(stderr, "WARNING: Skipping missing file \"%s\".\n", fname);
+ }
+ else {
+   fprintf(stderr, "ERROR: notmuch message stat error \"%s\" %s.\n", fname,
+           strerror(errno));
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * Find the storage tier of a message file, see global_config.file_tiers.
+ *
+ * @param[in] fname The real file name of the message.
+ * @return The index of its tier (0 is the fastest), or
+ *         global_config.n_tiers if it's in none of them.
+ */
+static unsigned file_tier (const char *fname)
+{
+ for (unsigned i = 0; i < global_config.n_tiers; i++) {
+   size_t length = strlen(global_config.tiers[i]);
+   if (strncmp(fname, global_config.tiers[i], length) == 0 &&
+       fname[length] == '/')
+     return i;
+ }
+ return global_config.n_tiers;
+}
+
+/**
+ * Find whether the start of a file is in the page cache, i.e. whether
+ * reading it is likely to be cheap.
+ *
+ * @param[in] fname The real file name.
+ * @return TRUE if its first page is cached.
+ */
+static bool file_is_cached (const char *fname)
+{
+ int fd = open(fname, O_RDONLY);
+ if (fd == -1)
+   return FALSE;
+
+ bool          cached = FALSE;
+ long          page   = sysconf(_SC_PAGESIZE);
+ struct stat   st;
+ unsigned char vec;
+ if (fstat(fd, &st) == 0 && st.st_size > 0) {
+   void *p = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+   if (p != MAP_FAILED) {
+     cached = (mincore(p, page, &vec) == 0 && (vec & 1) != 0);
+     munmap(p, page);
+   }
+ }
+ close(fd);
+ return cached;
+}
+
+/**
+ * Choose which file of a message to use, if it has several (duplicate
+ * copies): one on the fastest tier of global_config.file_tiers and, with
+ * global_config.prefer_cached, preferably one whose content is in the page
+ * cache.
+ *
+ * The choice is remembered, and kept for as long as the file is still one of
+ * the message's, so its virtual name doesn't change with the page cache.
+ *
+ * @param[in,out] p_ctx     The notmuch context.
+ * @param[in]     p_message The message.
+ * @return The real file name, to be freed by the caller, or NULL.
+ */
+static char *message_best_filename (notmuch_context_t *p_ctx,
+                                    notmuch_message_t *p_message)
+{
+ if (global_config.n_tiers == 0 && !global_config.prefer_cached) {
+   const char *fname = notmuch_message_get_filename(p_message);
+   return (fname != NULL) ? strdup(fname) : NULL;
+ }
+
+ file_choice_t *p_choices = &p_ctx->choices;
+ const char    *id        = notmuch_message_get_message_id(p_message);
+ char          *chosen    = NULL;
+
+ PTHREAD_LOCK(&p_choices->mutex);
+ if (p_choices->fnames.count > 0) {
+   const char *fname = strmap_get(&p_choices->fnames, id);
+   if (fname != NULL)
+     chosen = strdup(fname);
+ }
+ PTHREAD_UNLOCK(&p_choices->mutex);
+
+ char                *best        = NULL;
+ unsigned             best_tier   = 0;
+ /* Whether 'best' is in the page cache, -1 if not looked at yet. */
+ int                  best_cached = -1;
+ size_t               n_fnames    = 0;
+ bool                 kept        = FALSE;
+ notmuch_filenames_t *p_fnames    = notmuch_message_get_filenames(p_message);
+
+ for (; notmuch_filenames_valid(p_fnames);
+      notmuch_filenames_move_to_next(p_fnames)) {
+   const char *fname = notmuch_filenames_get(p_fnames);
+   unsigned    tier  = file_tier(fname);
+
+   n_fnames++;
+   if (kept) {
+     continue;
+   }
+   else if (chosen != NULL && strcmp(fname, chosen) == 0) {
+     /* Still there, so nothing to choose. */
+     kept = TRUE;
+     continue;
+   }
+   else if (best != NULL && tier == best_tier &&
+            global_config.prefer_cached) {
+     if (best_cached == -1)
+       best_cached = file_is_cached(best);
+     if (best_cached || !file_is_cached(fname))
+       continue;
+     best_cached = TRUE;
+   }
+   else if (best != NULL && tier >= best_tier) {
+     continue;
+   }
+   else {
+     best_cached = -1;
+   }
+   free(best);
+   best      = strdup(fname);
+   best_tier = tier;
+ }
+ notmuch_filenames_destroy(p_fnames);
+
+ if (kept) {
+   free(best);
+   return chosen;
+ }
+ free(chosen);
+
+ /* Only a choice between several files needs remembering. */
+ PTHREAD_LOCK(&p_choices->mutex);
+ char *old = (best != NULL && n_fnames > 1) ?
+               strmap_put(&p_choices->fnames, id, strdup(best)) :
+               strmap_remove(&p_choices->fnames, id);
+ PTHREAD_UNLOCK(&p_choices->mutex);
+ free(old);
+
+ if (best == NULL) {
+   const char *fname = notmuch_message_get_filename(p_message);
+   return (fname != NULL) ? strdup(fname) : NULL;
+ }
+ LOG_TRACE("message_best_filename: %s (tier %u)\n", best, best_tier);
+ return best;
+}
+
+/*============================================================================*/
+
+/**
+ * The messages (ID and file name) resulting from a notmuch query.
+ */
+typedef struct
+{
+ size_t   count;
+ size_t   max;
+ char   **ids;
+ char   **fnames;
+} message_list_t;
+
+/**
+ * Run a notmuch query, and collect the ID and file name of every message.
+ *
+ * @param[in]  p_ctx      The notmuch context.
+ * @param[in]  p_db       The open database.
+ * @param[in]  query      The notmuch query.
+ * @param[out] p_list     The list to fill. Must be freed with
+ *                        message_list_free(), even on failure.
+ * @return TRUE on success.
+ */
+static bool message_list_search (notmuch_context_t  *p_ctx,
+                                 notmuch_database_t *p_db,
+                                 const char         *query,
+                                 message_list_t     *p_list)
+{
+ memset(p_list, 0, sizeof(message_list_t));
+
+ notmuch_query_t *p_query = query_create(p_ctx, p_db, query);
+ if (p_query == NULL)
+   return FALSE;
+
+ notmuch_messages_t *p_messages = NULL;
+ if (notmuch_query_search_messages(p_query, &p_messages) !=
+     NOTMUCH_STATUS_SUCCESS) {
+   query_release(p_query);
+   return FALSE;
+ }
+
+ for (; notmuch_messages_valid(p_messages);
+      notmuch_messages_move_to_next(p_messages)) {
+   notmuch_message_t *p_message = notmuch_messages_get(p_messages);
+
+   if (p_list->count % POOL_CANCEL_CHECK_INTERVAL == 0 && pool_cancelled()) {
+     notmuch_message_destroy(p_message);
+     notmuch_messages_destroy(p_messages);
+     query_release(p_query);
+     return FALSE;
+   }
+
+   if (p_list->count == p_list->max) {
+     p_list->max    = MAX(p_list->max * 2, 256);
+     p_list->ids    = realloc(p_list->ids, p_list->max * sizeof(char *));
+     p_list->fnames = realloc(p_list->fnames, p_list->max * sizeof(char *));
+   }
+   p_list->ids[p_list->count] =
+     strdup(notmuch_message_get_message_id(p_message));
+   /* There's nothing we can do about a NULL file name, which I doubt can
+    * ever happen. It's skipped later.
+    */
+   p_list->fnames[p_list->count] = message_best_filename(p_ctx, p_message);
+   p_list->count++;
+   notmuch_message_destroy(p_message);
+ }
+ notmuch_messages_destroy(p_messages);
+ query_release(p_query);
+ return TRUE;
+}
+
+/**
+ * Free a list filled by message_list_search().
+ *
+ * @param[in,out] p_list The list.
+ */
+static void message_list_free (message_list_t *p_list)
+{
+ for (size_t i = 0; i < p_list->count; i++) {
+   free(p_list->ids[i]);
+   free(p_list->fnames[i]);
+ }
+ free(p_list->ids);
+ free(p_list->fnames);
+ memset(p_list, 0, sizeof(message_list_t));
+}
+
+/*============================================================================*/
+
+/**
+ * @section tag_index Tag Index
+ *
+ * With the 'tag_index' option, the ID, file name, date and tags of every
+ * message in the database are kept in memory: a slot for each message, and
+ * a bitmap of slots for each tag. The index is built by the watcher thread,
+ * and kept up to date from the messages changed since its revision (found
+ * with a 'lastmod:' query), so it's only used while the database is being
+ * watched.
+ *
+ * A query made only of 'tag:' terms, '*', 'and', 'or', 'not' and
+ * parentheses, with an operator between every two terms, is then answered
+ * by combining the bitmaps of its tags a word at a time, rather than by a
+ * database search. Any other query is searched as usual.
+ */
+
+/** The number of slots in each word of a tag index bitmap. */
+#define TAGINDEX_WORD_BITS 64
+
+/** The maximum length of a tag in a query answered from the tag index. */
+#define TAGINDEX_MAX_TAG 256
+
+/**
+ * Free a tagindex_tag_t.
+ *
+ * @param[in] p_tag_in The tagindex_tag_t.
+ */
+static void tagindex_tag_free (void *p_tag_in)
+{
+ tagindex_tag_t *p_tag = (tagindex_tag_t *)p_tag_in;
+
+ free(p_tag->bits);
+ free(p_tag);
+}
+
+/**
+ * Empty the tag index.
+ *
+ * @param[in,out] p_index The tag index, locked.
+ */
+static void tagindex_clear_locked (tagindex_t *p_index)
+{
+ for (size_t i = 0; i < p_index->n_messages; i++) {
+   free(p_index->messages[i].id);
+   free(p_index->messages[i].fname);
+   free(p_index->messages[i].tags);
+ }
+ free(p_index->messages);
+ free(p_index->live);
+ strmap_destroy(&p_index->ids, NULL);
+ strmap_destroy(&p_index->tags, tagindex_tag_free);
+ strmap_init(&p_index->ids);
+ strmap_init(&p_index->tags);
+ free(p_index->uuid);
+
+ p_index->built      = FALSE;
+ p_index->revision   = 0;
+ p_index->uuid       = NULL;
+ p_index->messages   = NULL;
+ p_index->n_messages = 0;
+ p_index->words      = 0;
+ p_index->live       = NULL;
+ p_index->n_live     = 0;
+}
+
+/**
+ * Initialize an empty tag index.
+ *
+ * @param[out] p_index The tag index.
+ * @return 0 on success, or an errno from pthread_mutex_init().
+ */
+static int tagindex_init (tagindex_t *p_index)
+{
+ memset(p_index, 0, sizeof(tagindex_t));
+ int res = pthread_mutex_init(&p_index->mutex, NULL);
+ if (res != 0)
+   return res;
+ strmap_init(&p_index->ids);
+ strmap_init(&p_index->tags);
+ return 0;
+}
+
+/**
+ * Free all resources of a tag index.
+ *
+ * @param[in,out] p_index The tag index, unlocked.
+ */
+static void tagindex_destroy (tagindex_t *p_index)
+{
+ tagindex_clear_locked(p_index);
+ strmap_destroy(&p_index->ids, NULL);
+ strmap_destroy(&p_index->tags, NULL);
+ int res = pthread_mutex_destroy(&p_index->mutex);
+ assert(res == 0);
+ (void)res;
+}
+
+/**
+ * Exchange the contents of two tag indexes, so one can be built without
+ * holding up searches of the other.
+ *
+ * @param[in,out] p_index The tag index, locked.
+ * @param[in,out] p_other The other tag index, not shared.
+ */
+static void tagindex_swap_locked (tagindex_t *p_index, tagindex_t *p_other)
+{
+ tagindex_t saved;
+
+ memcpy(&saved.ids, &p_index->ids, sizeof(strmap_t));
+ memcpy(&saved.tags, &p_index->tags, sizeof(strmap_t));
+ saved.built      = p_index->built;
+ saved.revision   = p_index->revision;
+ saved.uuid       = p_index->uuid;
+ saved.messages   = p_index->messages;
+ saved.n_messages = p_index->n_messages;
+ saved.words      = p_index->words;
+ saved.live       = p_index->live;
+ saved.n_live     = p_index->n_live;
+
+ memcpy(&p_index->ids, &p_other->ids, sizeof(strmap_t));
+ memcpy(&p_index->tags, &p_other->tags, sizeof(strmap_t));
+ p_index->built      = p_other->built;
+ p_index->revision   = p_other->revision;
+ p_index->uuid       = p_other->uuid;
+ p_index->messages   = p_other->messages;
+ p_index->n_messages = p_other->n_messages;
+ p_index->words      = p_other->words;
+ p_index->live       = p_other->live;
+ p_index->n_live     = p_other->n_live;
+
+ memcpy(&p_other->ids, &saved.ids, sizeof(strmap_t));
+ memcpy(&p_other->tags, &saved.tags, sizeof(strmap_t));
+ p_other->built      = saved.built;
+ p_other->revision   = saved.revision;
+ p_other->uuid       = saved.uuid;
+ p_other->messages   = saved.messages;
+ p_other->n_messages = saved.n_messages;
+ p_other->words      = saved.words;
+ p_other->live       = saved.live;
+ p_other->n_live     = saved.n_live;
+}
+
+/**
+ * Make room in the tag index for another slot.
+ *
+ * @param[in,out] p_index The tag index, locked.
+ */
+static void tagindex_grow_locked (tagindex_t *p_index)
+{
+ if (p_index->n_messages < p_index->words * TAGINDEX_WORD_BITS)
+   return;
+
+ size_t words = MAX(p_index->words * 2, 64);
+ p_index->messages = realloc(p_index->messages,
+                             words * TAGINDEX_WORD_BITS *
+                             sizeof(tagindex_message_t));
+ p_index->live = realloc(p_index->live, words * sizeof(uint64_t));
+ memset(p_index->live + p_index->words, 0,
+        (words - p_index->words) * sizeof(uint64_t));
+ if (p_index->tags.count > 0) {
+   tagindex_tag_t **tags = (tagindex_tag_t **)strmap_values(&p_index->tags);
+   for (size_t i = 0; i < p_index->tags.count; i++) {
+     tags[i]->bits = realloc(tags[i]->bits, words * sizeof(uint64_t));
+     memset(tags[i]->bits + p_index->words, 0,
+            (words - p_index->words) * sizeof(uint64_t));
+   }
+   free(tags);
+ }
+ p_index->words = words;
+}
+
+/**
+ * Add a message to the tag index, or bring its entry up to date.
+ *
+ * @param[in,out] p_ctx     The notmuch context.
+ * @param[in,out] p_index   The tag index, locked.
+ * @param[in]     p_message The message.
+ */
+static void tagindex_set_locked (notmuch_context_t *p_ctx,
+                                 tagindex_t        *p_index,
+                                 notmuch_message_t *p_message)
+{
+ const char *id   = notmuch_message_get_message_id(p_message);
+ size_t      slot = (uintptr_t)strmap_get(&p_index->ids, id);
+
+ if (slot == 0) {
+   tagindex_grow_locked(p_index);
+   slot = p_index->n_messages++;
+   p_index->messages[slot].id     = strdup(id);
+   p_index->messages[slot].tags   = NULL;
+   p_index->messages[slot].n_tags = 0;
+   strmap_put(&p_index->ids, id, (void *)(uintptr_t)(slot + 1));
+   p_index->live[slot / TAGINDEX_WORD_BITS] |=
+     (uint64_t)1 << (slot % TAGINDEX_WORD_BITS);
+   p_index->n_live++;
+ }
+ else {
+   slot--;
+   free(p_index->messages[slot].fname);
+ }
+
+ tagindex_message_t *p_slot = &p_index->messages[slot];
+ size_t              word   = slot / TAGINDEX_WORD_BITS;
+ uint64_t            bit    = (uint64_t)1 << (slot % TAGINDEX_WORD_BITS);
+ p_slot->fname = message_best_filename(p_ctx, p_message);
+ p_slot->date  = notmuch_message_get_date(p_message);
+
+ /* Only the tags it had can have its bit set (a new slot has none). */
+ for (size_t i = 0; i < p_slot->n_tags; i++)
+   p_slot->tags[i]->bits[word] &= ~bit;
+ p_slot->n_tags = 0;
+
+ notmuch_tags_t *p_tags = notmuch_message_get_tags(p_message);
+ for (; notmuch_tags_valid(p_tags); notmuch_tags_move_to_next(p_tags)) {
+   const char     *tag   = notmuch_tags_get(p_tags);
+   tagindex_tag_t *p_tag = strmap_get(&p_index->tags, tag);
+   if (p_tag == NULL) {
+     p_tag       = malloc(sizeof(tagindex_tag_t));
+     p_tag->bits = calloc(p_index->words, sizeof(uint64_t));
+     strmap_put(&p_index->tags, tag, p_tag);
+   }
+   p_tag->bits[word] |= bit;
+
+   if (p_slot->n_tags % 8 == 0) {
+     p_slot->tags = realloc(p_slot->tags,
+                            (p_slot->n_tags + 8) * sizeof(tagindex_tag_t *));
+   }
+   p_slot->tags[p_slot->n_tags++] = p_tag;
+ }
+ notmuch_tags_destroy(p_tags);
+}
+
+/**
+ * Add every message matching a query to the tag index.
+ *
+ * @param[in,out] p_ctx   The notmuch context.
+ * @param[in,out] p_index The tag index, locked.
+ * @param[in]     p_db    The open database.
+ * @param[in]     query   The notmuch query.
+ * @return TRUE on success.
+ */
+static bool tagindex_add_query_locked (notmuch_context_t  *p_ctx,
+                                       tagindex_t         *p_index,
+                                       notmuch_database_t *p_db,
+                                       const char         *query)
+{
+ notmuch_query_t    *p_query    = notmuch_query_create(p_db, query);
+ notmuch_messages_t *p_messages = NULL;
+ if (p_query == NULL)
+   return FALSE;
+
+ notmuch_query_set_sort(p_query, NOTMUCH_SORT_UNSORTED);
+ if (notmuch_query_search_messages(p_query, &p_messages) !=
+     NOTMUCH_STATUS_SUCCESS) {
+   notmuch_query_destroy(p_query);
+   return FALSE;
+ }
+ for (; notmuch_messages_valid(p_messages);
+      notmuch_messages_move_to_next(p_messages)) {
+   notmuch_message_t *p_message = notmuch_messages_get(p_messages);
+   tagindex_set_locked(p_ctx, p_index, p_message);
+   notmuch_message_destroy(p_message);
+ }
+ notmuch_messages_destroy(p_messages);
+ notmuch_query_destroy(p_query);
+ return TRUE;
+}
+
+/**
+ * Bring the tag index up to date with the database.
+ *
+ * @param[in,out] p_ctx       The notmuch context.
+ * @param[in]     p_db        The open database.
+ * @param[in]     allow_build Whether to (re)build the whole index if
+ *                            needed. Otherwise it's left unbuilt, and not
+ *                            used, until it is.
+ */
+static void tagindex_update (notmuch_context_t  *p_ctx,
+                             notmuch_database_t *p_db,
+                             bool                allow_build)
+{
+ tagindex_t *p_index = &p_ctx->tagindex;
+
+ if (!global_config.tag_index)
+   return;
+
+ const char   *uuid     = NULL;
+ unsigned long revision = notmuch_database_get_revision(p_db, &uuid);
+
+ PTHREAD_LOCK(&p_index->mutex);
+ if (p_index->built && strcmp(p_index->uuid, uuid) != 0) {
+   /* A different database. */
+   p_index->built = FALSE;
+ }
+ /* A handle opened before the index was last updated has nothing newer to
+  * add, and is left alone.
+  */
+ if (p_index->built && p_index->revision < revision) {
+   char lastmod[64];
+   snprintf(lastmod, sizeof(lastmod), "lastmod:%lu..%lu",
+            p_index->revision + 1, revision);
+   p_index->built    = tagindex_add_query_locked(p_ctx, p_index, p_db,
+                                                 lastmod);
+   p_index->revision = revision;
+
+   /* Messages removed from the database entirely aren't found by
+    * 'lastmod:', so check none were.
+    */
+   notmuch_query_t *p_all = notmuch_query_create(p_db, "*");
+   unsigned         count = 0;
+   if (p_all == NULL ||
+       notmuch_query_count_messages(p_all, &count) != NOTMUCH_STATUS_SUCCESS ||
+       count != p_index->n_live) {
+     LOG_TRACE("tagindex_update %zu != %u messages\n", p_index->n_live,
+               count);
+     p_index->built = FALSE;
+   }
+   if (p_all != NULL)
+     notmuch_query_destroy(p_all);
+ }
+ /* Searches are answered from the database while the index isn't built, so
+  * it's emptied, and any replacement built, aside rather than while it's
+  * locked.
+  */
+ bool       rebuild = !p_index->built && allow_build;
+ tagindex_t old;
+ bool       old_init = FALSE;
+ if (!p_index->built && p_index->n_messages > 0) {
+   old_init = (tagindex_init(&old) == 0);
+   if (old_init)
+     tagindex_swap_locked(p_index, &old);
+   else
+     tagindex_clear_locked(p_index);
+ }
+ PTHREAD_UNLOCK(&p_index->mutex);
+ if (old_init)
+   tagindex_destroy(&old);
+
+ tagindex_t fresh;
+ if (rebuild && tagindex_init(&fresh) == 0) {
+   fresh.built    = tagindex_add_query_locked(p_ctx, &fresh, p_db, "*");
+   fresh.revision = revision;
+   fresh.uuid     = strdup(uuid);
+   LOG_TRACE("tagindex_update built %zu messages, %zu tags\n",
+             fresh.n_live, fresh.tags.count);
+
+   PTHREAD_LOCK(&p_index->mutex);
+   if (fresh.built && !p_index->built)
+     tagindex_swap_locked(p_index, &fresh);
+   PTHREAD_UNLOCK(&p_index->mutex);
+   tagindex_destroy(&fresh);
+ }
+}
+
+/**
+ * Build the tag index, if it isn't (yet, or any more, e.g. because the
+ * database was replaced).
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void tagindex_build (notmuch_context_t *p_ctx)
+{
+ tagindex_t *p_index = &p_ctx->tagindex;
+
+ if (!global_config.tag_index)
+   return;
+
+ PTHREAD_LOCK(&p_index->mutex);
+ bool built = p_index->built;
+ PTHREAD_UNLOCK(&p_index->mutex);
+
+ if (!built) {
+   notmuch_database_t *p_db = database_open(p_ctx, FALSE);
+   tagindex_update(p_ctx, p_db, TRUE);
+   database_close(p_ctx, p_db);
+ }
+}
+
+/**
+ * The tokens of a query, see tagquery_next().
+ */
+typedef enum
+{
+ TAGQUERY_END,
+ TAGQUERY_OPEN,
+ TAGQUERY_CLOSE,
+ TAGQUERY_AND,
+ TAGQUERY_OR,
+ TAGQUERY_NOT,
+ TAGQUERY_ALL,
+ TAGQUERY_TAG,
+ /** Anything else, which the tag index can't answer. */
+ TAGQUERY_OTHER
+} tagquery_token_t;
+
+/**
+ * The state of evaluating a query against the tag index, see
+ * tagindex_evaluate_locked().
+ */
+typedef struct
+{
+ const tagindex_t *p_index;
+ /** The rest of the query. */
+ const char       *p;
+ /** The tag of the last #TAGQUERY_TAG token. */
+ char              tag[TAGINDEX_MAX_TAG];
+ /** The tags in the query, which aren't excluded, like notmuch. */
+ strmap_t          mentioned;
+ /** Cleared if the query can't be answered. */
+ bool              ok;
+} tagquery_t;
+
+/**
+ * Read the next token of a query.
+ *
+ * @param[in,out] p_query The query state.
+ * @param[in]     consume Whether to move past the token, or just peek.
+ * @return The token.
+ */
+static tagquery_token_t tagquery_next (tagquery_t *p_query, bool consume)
+{
+ const char *p = p_query->p;
+
+ while (isspace((unsigned char)*p))
+   p++;
+
+ const char      *end   = p + 1;
+ tagquery_token_t token = TAGQUERY_OTHER;
+ if (*p == '\0') {
+   token = TAGQUERY_END;
+   end   = p;
+ }
+ else if (*p == '(') {
+   token = TAGQUERY_OPEN;
+ }
+ else if (*p == ')') {
+   token = TAGQUERY_CLOSE;
+ }
+ else {
+   end = p;
+   while (*end != '\0' && !isspace((unsigned char)*end) && *end != '(' &&
+          *end != ')')
+     end++;
+   size_t length = end - p;
+
+   if (length == 3 && strncasecmp(p, "and", 3) == 0)
+     token = TAGQUERY_AND;
+   else if (length == 2 && strncasecmp(p, "or", 2) == 0)
+     token = TAGQUERY_OR;
+   else if (length == 3 && strncasecmp(p, "not", 3) == 0)
+     token = TAGQUERY_NOT;
+   else if (length == 1 && *p == '*')
+     token = TAGQUERY_ALL;
+   else if (length > 4 && strncmp(p, "tag:", 4) == 0 &&
+            length - 4 < TAGINDEX_MAX_TAG &&
+            memchr(p + 4, '"', length - 4) == NULL &&
+            memchr(p + 4, '*', length - 4) == NULL && p[4] != '/') {
+     /* Quoted tags, wildcards and regexes are left to notmuch. */
+     token = TAGQUERY_TAG;
+     memcpy(p_query->tag, p + 4, length - 4);
+     p_query->tag[length - 4] = '\0';
+   }
+ }
+
+ if (consume)
+   p_query->p = end;
+ return token;
+}
+
+static uint64_t *tagquery_or (tagquery_t *p_query);
+
+/**
+ * Evaluate a term of a query: a tag, '*', a negated term, or a parenthesized
+ * expression.
+ *
+ * @param[in,out] p_query The query state.
+ * @return The matching slots, to be freed by the caller, or NULL (with
+ *         'ok' cleared) if the query can't be answered.
+ */
+static uint64_t *tagquery_term (tagquery_t *p_query)
+{
+ const tagindex_t *p_index = p_query->p_index;
+ uint64_t         *bits    = NULL;
+
+ switch (tagquery_next(p_query, TRUE)) {
+ case TAGQUERY_TAG: {
+   tagindex_tag_t *p_tag = strmap_get(&p_index->tags, p_query->tag);
+   bits = calloc(MAX(p_index->words, 1), sizeof(uint64_t));
+   if (p_tag != NULL)
+     memcpy(bits, p_tag->bits, p_index->words * sizeof(uint64_t));
+   if (strmap_get(&p_query->mentioned, p_query->tag) == NULL)
+     strmap_put(&p_query->mentioned, p_query->tag, &p_query->mentioned);
+   break;
+ }
+
+ case TAGQUERY_ALL:
+   bits = malloc(MAX(p_index->words, 1) * sizeof(uint64_t));
+   memcpy(bits, p_index->live, p_index->words * sizeof(uint64_t));
+   break;
+
+ case TAGQUERY_NOT:
+   bits = tagquery_term(p_query);
+   for (size_t i = 0; bits != NULL && i < p_index->words; i++)
+     bits[i] = p_index->live[i] & ~bits[i];
+   break;
+
+ case TAGQUERY_OPEN:
+   bits = tagquery_or(p_query);
+   if (bits != NULL && tagquery_next(p_query, TRUE) != TAGQUERY_CLOSE) {
+     free(bits);
+     bits = NULL;
+   }
+   break;
+
+ default:
+   break;
+ }
+
+ if (bits == NULL)
+   p_query->ok = FALSE;
+ return bits;
+}
+
+/**
+ * Evaluate a conjunction of terms of a query, joined by 'and' or 'not' (as
+ * 'and not').
+ *
+ * Terms joined by nothing aren't answered: Xapian ORs together side by side
+ * terms with the same prefix, e.g. 'tag:a tag:b', but ANDs them with others,
+ * so such queries are left to notmuch.
+ *
+ * @param[in,out] p_query The query state.
+ * @return As tagquery_term().
+ */
+static uint64_t *tagquery_and (tagquery_t *p_query)
+{
+ uint64_t *bits = tagquery_term(p_query);
+
+ while (bits != NULL) {
+   tagquery_token_t token = tagquery_next(p_query, FALSE);
+   if (token == TAGQUERY_AND) {
+     (void)tagquery_next(p_query, TRUE);
+   }
+   else if (token == TAGQUERY_END || token == TAGQUERY_OR ||
+            token == TAGQUERY_CLOSE) {
+     break;
+   }
+   else if (token != TAGQUERY_NOT) {
+     free(bits);
+     p_query->ok = FALSE;
+     return NULL;
+   }
+
+   uint64_t *right = tagquery_term(p_query);
+   if (right == NULL) {
+     free(bits);
+     return NULL;
+   }
+   for (size_t i = 0; i < p_query->p_index->words; i++)
+     bits[i] &= right[i];
+   free(right);
+ }
+ return bits;
+}
+
+/**
+ * Evaluate a disjunction of conjunctions of a query, joined by 'or'.
+ *
+ * @param[in,out] p_query The query state.
+ * @return As tagquery_term().
+ */
+static uint64_t *tagquery_or (tagquery_t *p_query)
+{
+ uint64_t *bits = tagquery_and(p_query);
+
+ while (bits != NULL && tagquery_next(p_query, FALSE) == TAGQUERY_OR) {
+   (void)tagquery_next(p_query, TRUE);
+   uint64_t *right = tagquery_and(p_query);
+   if (right == NULL) {
+     free(bits);
+     return NULL;
+   }
+   for (size_t i = 0; i < p_query->p_index->words; i++)
+     bits[i] |= right[i];
+   free(right);
+ }
+ return bits;
+}
+
+/**
+ * Evaluate a query against the tag index, if it's made only of tags.
+ *
+ * @param[in] p_ctx   The notmuch context.
+ * @param[in] p_index The tag index, built and locked.
+ * @param[in] query   The notmuch query.
+ * @param[in] exclude Whether to leave out messages with an excluded tag that
+ *                    the query doesn't mention, as query_create() does. If
+ *                    not, the query is to be combined with one that did, so
+ *                    it mustn't mention an excluded tag either.
+ * @return The slots of the matching messages, to be freed by the caller.
+ *         NULL if the query can't be answered.
+ */
+static uint64_t *tagindex_evaluate_locked (notmuch_context_t *p_ctx,
+                                           const tagindex_t  *p_index,
+                                           const char        *query,
+                                           bool               exclude)
+{
+ tagquery_t state;
+
+ state.p_index = p_index;
+ state.p       = query;
+ state.ok      = TRUE;
+ strmap_init(&state.mentioned);
+
+ uint64_t *bits = tagquery_or(&state);
+ if (bits != NULL && tagquery_next(&state, TRUE) != TAGQUERY_END) {
+   free(bits);
+   bits = NULL;
+ }
+
+ if (bits != NULL) {
+   char *excluded_tags = strdup(p_ctx->excluded_tags);
+   char *save_ptr      = NULL;
+   char *exclude_tag   = strtok_r(excluded_tags, "\n", &save_ptr);
+   while (exclude_tag != NULL) {
+     tagindex_tag_t *p_tag = strmap_get(&p_index->tags, exclude_tag);
+     if (!exclude) {
+       if (strmap_get(&state.mentioned, exclude_tag) != NULL) {
+         free(bits);
+         bits = NULL;
+         break;
+       }
+     }
+     else if (p_tag != NULL &&
+              strmap_get(&state.mentioned, exclude_tag) == NULL) {
+       for (size_t i = 0; i < p_index->words; i++)
+         bits[i] &= ~p_tag->bits[i];
+     }
+     exclude_tag = strtok_r(NULL, "\n", &save_ptr);
+   }
+   free(excluded_tags);
+ }
+ strmap_destroy(&state.mentioned, NULL);
+ return bits;
+}
+
+/**
+ * Compare tag index messages newest first, for qsort().
+ */
+static int tagindex_message_compare_date (const void *a, const void *b)
+{
+ const tagindex_message_t *p_a = *(const tagindex_message_t * const *)a;
+ const tagindex_message_t *p_b = *(const tagindex_message_t * const *)b;
+
+ if (p_a->date != p_b->date)
+   return (p_a->date < p_b->date) ? 1 : -1;
+ /* Later additions first. */
+ return (p_a < p_b) ? 1 : (p_a > p_b) ? -1 : 0;
+}
+
+/**
+ * Find the messages in a tag index that match a query, if it's made only of
+ * tags.
+ *
+ * @param[in]  p_ctx   The notmuch context.
+ * @param[in]  p_index The tag index, built and locked.
+ * @param[in]  query   The notmuch query.
+ * @param[in]  p_only  If not NULL, only the messages with these IDs are
+ *                     wanted in 'p_list'.
+ * @param[out] p_list  The matching messages, newest first. Must be freed
+ *                     with message_list_free() if answered.
+ * @param[out] p_count If not NULL, the number of matching messages (not
+ *                     only those in 'p_only').
+ * @return TRUE if the query was answered.
+ */
+static bool tagindex_collect_locked (notmuch_context_t *p_ctx,
+                                     const tagindex_t  *p_index,
+                                     const char        *query,
+                                     const strmap_t    *p_only,
+                                     message_list_t    *p_list,
+                                     unsigned          *p_count)
+{
+ uint64_t *bits = tagindex_evaluate_locked(p_ctx, p_index, query, TRUE);
+ if (bits == NULL)
+   return FALSE;
+
+ tagindex_message_t **matches = NULL;
+ size_t               count   = 0;
+ size_t               wanted  = 0;
+ for (size_t i = 0; i < p_index->words; i++) {
+   for (uint64_t word = bits[i]; word != 0; word &= word - 1) {
+     size_t slot = i * TAGINDEX_WORD_BITS + __builtin_ctzll(word);
+     count++;
+     if (p_only != NULL &&
+         strmap_get(p_only, p_index->messages[slot].id) == NULL)
+       continue;
+     if (wanted % 256 == 0)
+       matches = realloc(matches, (wanted + 256) * sizeof(*matches));
+     matches[wanted++] = &p_index->messages[slot];
+   }
+ }
+ free(bits);
+ qsort(matches, wanted, sizeof(*matches), tagindex_message_compare_date);
+
+ memset(p_list, 0, sizeof(message_list_t));
+ p_list->count  = wanted;
+ p_list->max    = wanted;
+ p_list->ids    = malloc(MAX(wanted, 1) * sizeof(char *));
+ p_list->fnames = malloc(MAX(wanted, 1) * sizeof(char *));
+ for (size_t i = 0; i < wanted; i++) {
+   p_list->ids[i]    = strdup(matches[i]->id);
+   p_list->fnames[i] = (matches[i]->fname != NULL) ?
+                         strdup(matches[i]->fname) : NULL;
+ }
+ free(matches);
+ if (p_count != NULL)
+   *p_count = count;
+ return TRUE;
+}
+
+/**
+ * Answer a query from the tag index, if it's up to date and the query is
+ * made only of tags.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     revision The database revision the answer must be as of.
+ * @param[in]     query    The notmuch query.
+ * @param[in]     p_only   As tagindex_collect_locked().
+ * @param[out]    p_list   As tagindex_collect_locked().
+ * @param[out]    p_count  As tagindex_collect_locked().
+ * @return TRUE if the query was answered.
+ */
+static bool tagindex_search (notmuch_context_t *p_ctx,
+                             unsigned long      revision,
+                             const char        *query,
+                             const strmap_t    *p_only,
+                             message_list_t    *p_list,
+                             unsigned          *p_count)
+{
+ tagindex_t *p_index = &p_ctx->tagindex;
+ bool        found   = FALSE;
+
+ if (!global_config.tag_index)
+   return FALSE;
+
+ PTHREAD_LOCK(&p_index->mutex);
+ if (p_index->built && p_index->revision == revision) {
+   found = tagindex_collect_locked(p_ctx, p_index, query, p_only, p_list,
+                                   p_count);
+   if (found)
+     p_index->hits++;
+ }
+ PTHREAD_UNLOCK(&p_index->mutex);
+
+ LOG_TRACE("tagindex_search(%s) %s\n", query, found ? "hit" : "miss");
+ return found;
+}
+
+/*============================================================================*/
+
+/**
+ * Compare listing entries by real inode number, for qsort().
+ */
+static int listing_entry_compare_ino (const void *a, const void *b)
+{
+ const listing_entry_t *p_a = (const listing_entry_t *)a;
+ const listing_entry_t *p_b = (const listing_entry_t *)b;
+
+ return (p_a->st.st_ino > p_b->st.st_ino) - (p_a->st.st_ino < p_b->st.st_ino);
+}
+
+/**
+ * Put the entries of a listing being built in the order to list them in.
+ *
+ * @param[in,out] p_listing The listing, not yet published.
+ */
+static void listing_sort (listing_t *p_listing)
+{
+ if (!global_config.sort_by_inode || p_listing->n_entries < 2)
+   return;
+
+ qsort(p_listing->entries, p_listing->n_entries, sizeof(listing_entry_t),
+       listing_entry_compare_ino);
+
+ /* The entries moved, so index them again. */
+ strmap_destroy(&p_listing->index, NULL);
+ strmap_init(&p_listing->index);
+ for (size_t i = 0; i < p_listing->n_entries; i++)
+   strmap_put(&p_listing->index, p_listing->entries[i].name,
+              &p_listing->entries[i]);
+}
+
+/*============================================================================*/
+
+/**
+ * Materialize a listing, by running its notmuch query and getting the
+ * attributes of every resulting message file.
+ *
+ * @param[in] p_ctx The notmuch context.
+ * @param[in] query The notmuch query.
+ * @return The listing, with one reference held by the caller, or NULL on
+ *         error.
+ */
+static listing_t *listing_build (notmuch_context_t *p_ctx, const char *query)
+{
+ message_list_t messages;
+
+ /* Only hold the database for as long as it takes to collect the file
+  * names, the stat()s are done afterwards.
+  */
+ notmuch_database_t *p_db     = database_open(p_ctx, FALSE);
+ unsigned long       revision = notmuch_database_get_revision(p_db, NULL);
+ tagindex_update(p_ctx, p_db, FALSE);
+ bool                ok       =
+   tagindex_search(p_ctx, revision, query, NULL, &messages, NULL) ||
+   message_list_search(p_ctx, p_db, query, &messages);
+ database_close(p_ctx, p_db);
+
+ if (!ok) {
+   message_list_free(&messages);
+   return NULL;
+ }
+
+ listing_t *p_listing = listing_alloc(query, revision, messages.count);
+ p_listing->n_messages = messages.count;
+ for (size_t i = 0; i < messages.count; i++) {
+   if (i % POOL_CANCEL_CHECK_INTERVAL == 0 && pool_cancelled()) {
+     message_list_free(&messages);
+     p_listing->refs--;
+     listing_free(p_listing);
+     return NULL;
+   }
+   if (messages.fnames[i] != NULL)
+     listing_add(p_ctx, p_listing, messages.fnames[i], messages.ids[i]);
+ }
+ message_list_free(&messages);
+ listing_sort(p_listing);
+
+ LOG_TRACE("listing_build(%s) %zu entries at revision %lu\n", query,
+           p_listing->n_entries, revision);
+ return p_listing;
+}
+
+/**
+ * The arguments of listing_build_job().
+ */
+typedef struct
+{
+ const char *query;
+ listing_t  *p_listing;
+} listing_build_job_t;
+
+/**
+ * A pool job to run listing_build().
+ *
+ * @param[in]     p_ctx The notmuch context.
+ * @param[in,out] arg   The listing_build_job_t.
+ * @return 0 on success, -EINTR if interrupted, or -EIO.
+ */
+static int listing_build_job (notmuch_context_t *p_ctx, void *arg)
+{
+ listing_build_job_t *p_job = (listing_build_job_t *)arg;
+
+ p_job->p_listing = listing_build(p_ctx, p_job->query);
+ if (p_job->p_listing == NULL)
+   return pool_cancelled() ? -EINTR : -EIO;
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Build a new version of a listing from an old one, by applying the changes
+ * to the database since the old one was built.
+ *
+ * @param[in]  p_ctx       The notmuch context.
+ * @param[in]  p_old       The old listing.
+ * @param[in]  changed_ids The IDs of all messages changed since (at least)
+ *                         p_old->revision.
+ * @param[in]  p_matches   The changed messages that match the query now.
+ * @param[in]  count       The number of messages that match the query now.
+ * @param[in]  revision    The database revision of 'p_matches' and 'count'.
+ * @param[out] p_changed   Whether the set of message names is different.
+ * @return The new listing, with one reference held by the caller, or NULL
+ *         if the delta doesn't add up (e.g. messages were removed from the
+ *         database entirely) and the listing must be rebuilt from scratch.
+ */
+static listing_t *listing_apply_delta (notmuch_context_t    *p_ctx,
+                                       listing_t            *p_old,
+                                       const strmap_t       *changed_ids,
+                                       const message_list_t *p_matches,
+                                       unsigned              count,
+                                       unsigned long         revision,
+                                       bool                 *p_changed)
+{
+ cache_t   *p_cache    = &p_ctx->cache;
+ size_t     n_messages = p_old->n_messages + p_matches->count;
+ listing_t *p_new      = listing_alloc(p_old->query, revision,
+                                       p_old->n_entries + p_matches->count);
+
+ *p_changed = FALSE;
+
+ /* The changed messages go first, since notmuch sorts newest first. */
+ for (size_t i = 0; i < p_matches->count; i++) {
+   if (p_matches->fnames[i] != NULL)
+     listing_add(p_ctx, p_new, p_matches->fnames[i], p_matches->ids[i]);
+ }
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ for (size_t i = 0; i < p_new->n_entries; i++) {
+   if (strmap_get(&p_old->index, p_new->entries[i].name) == NULL)
+     *p_changed = TRUE;
+ }
+ for (size_t i = 0; i < p_old->n_entries; i++) {
+   listing_entry_t *p_entry = &p_old->entries[i];
+
+   if (strmap_get(changed_ids, p_entry->id) != NULL) {
+     /* Replaced by its entry in 'p_matches', if it still matches. */
+     n_messages--;
+     if (strmap_get(&p_new->index, p_entry->name) == NULL)
+       *p_changed = TRUE;
+   }
+   else if (strmap_get(&p_new->index, p_entry->name) == NULL) {
+     listing_entry_t *p_copy = &p_new->entries[p_new->n_entries++];
+     p_copy->name          = strdup(p_entry->name);
+     p_copy->id            = strdup(p_entry->id);
+     p_copy->st            = p_entry->st;
+     p_copy->deleted       = p_entry->deleted;
+     p_copy->header_length = p_entry->header_length;
+     strmap_put(&p_new->index, p_copy->name, p_copy);
+   }
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ p_new->n_messages = n_messages;
+ if (n_messages != count) {
+   LOG_TRACE("listing_apply_delta(%s) %zu != %u messages\n", p_old->query,
+             n_messages, count);
+   listing_unref(p_ctx, p_new);
+   return NULL;
+ }
+ listing_sort(p_new);
+ return p_new;
+}
+
+/*============================================================================*/
+
+/**
+ * Pack the entries of a listing for readdir(), if they aren't already, so
+ * that listing them again is a walk through one block of memory, rather
+ * than chasing each entry's name.
+ *
+ * @param[in,out] p_listing The listing. The cache must be locked.
+ */
+static void listing_dirents_locked (listing_t *p_listing)
+{
+ if (p_listing->dirents != NULL)
+   return;
+
+ size_t length = 0;
+ for (size_t i = 0; i < p_listing->n_entries; i++) {
+   if (!p_listing->entries[i].deleted)
+     length += LISTING_DIRENT_LENGTH(strlen(p_listing->entries[i].name));
+ }
+
+ p_listing->dirents        = malloc(MAX(length, 1));
+ p_listing->dirents_length = length;
+ p_listing->dirents_generation++;
+
+ char *p = p_listing->dirents;
+ for (size_t i = 0; i < p_listing->n_entries; i++) {
+   listing_entry_t  *p_entry     = &p_listing->entries[i];
+   listing_dirent_t *p_dirent    = (listing_dirent_t *)p;
+   size_t            name_length = strlen(p_entry->name);
+   if (p_entry->deleted)
+     continue;
+
+   p_dirent->index  = i;
+   p_dirent->length = LISTING_DIRENT_LENGTH(name_length);
+   p_dirent->ino    = p_entry->st.st_ino;
+   p_dirent->mode   = p_entry->st.st_mode;
+   memcpy(p_dirent->name, p_entry->name, name_length + 1);
+   p += p_dirent->length;
+ }
+}
+
+/**
+ * Forget the packed entries of a listing, because an entry changed.
+ *
+ * @param[in,out] p_listing The listing. The cache must be locked.
+ */
+static void listing_dirents_drop_locked (listing_t *p_listing)
+{
+ free(p_listing->dirents);
+ p_listing->dirents        = NULL;
+ p_listing->dirents_length = 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Mark a message as deleted in a listing, if it's there.
+ *
+ * @param[in,out] p_listing The listing. The cache must be locked.
+ * @param[in]     name      The virtual message name.
+ */
+static void listing_mark_deleted_locked (listing_t *p_listing,
+                                         const char *name)
+{
+ listing_entry_t *p_entry = strmap_get(&p_listing->index, name);
+ if (p_entry != NULL && !p_entry->deleted) {
+   p_entry->deleted = TRUE;
+   listing_dirents_drop_locked(p_listing);
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * Remember that a listing was opened through a virtual query directory.
+ *
+ * @param[in,out] p_listing The listing. The cache must be locked.
+ * @param[in]     dir       The virtual query directory.
+ */
+static void listing_add_dir_locked (listing_t *p_listing, const char *dir)
+{
+ if (strmap_get(&p_listing->dirs, dir) == NULL)
+   strmap_put(&p_listing->dirs, dir, strdup(dir));
+}
+
+/*============================================================================*/
+
+/**
+ * Publish a listing in the cache, replacing any older listing of the same
+ * query.
+ *
+ * @param[in,out] p_ctx     The notmuch context.
+ * @param[in]     p_listing The listing. The caller's reference is kept.
+ */
+static void cache_publish (notmuch_context_t *p_ctx, listing_t *p_listing)
+{
+ cache_t *p_cache = &p_ctx->cache;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ p_listing->refs++;
+ listing_t *p_old = strmap_put(&p_cache->listings, p_listing->query,
+                               p_listing);
+ if (p_old != NULL) {
+   /* Inherit what's known about the query from the old listing. */
+   if (p_old->dirs.count > 0) {
+     char **dirs = (char **)strmap_values(&p_old->dirs);
+     for (size_t i = 0; i < p_old->dirs.count; i++)
+       listing_add_dir_locked(p_listing, dirs[i]);
+     free(dirs);
+   }
+   p_listing->changed = MAX(p_listing->changed, p_old->changed);
+   p_listing->policy  = p_old->policy;
+   listing_unref_locked(p_cache, p_old);
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ /* Messages deleted while this listing was being built might have been
+  * missed by cache_mark_deleted(), so check again now that it's visible.
+  */
+ writer_t *p_writer = &p_ctx->writer;
+ char    **deleted  = NULL;
+ size_t    count    = 0;
+ PTHREAD_LOCK(&p_writer->mutex);
+ if (p_writer->pending_deletes.count > 0) {
+   writer_op_t **ops =
+     (writer_op_t **)strmap_values(&p_writer->pending_deletes);
+   count   = p_writer->pending_deletes.count;
+   deleted = malloc(count * sizeof(char *));
+   for (size_t i = 0; i < count; i++)
+     deleted[i] = strdup(ops[i]->filename);
+   free(ops);
+ }
+ PTHREAD_UNLOCK(&p_writer->mutex);
+
+ if (count > 0) {
+   PTHREAD_LOCK(&p_cache->mutex);
+   for (size_t i = 0; i < count; i++) {
+     char trans_name[PATH_MAX];
+     virtual_name(trans_name, deleted[i]);
+     listing_mark_deleted_locked(p_listing, trans_name);
+     free(deleted[i]);
+   }
+   PTHREAD_UNLOCK(&p_cache->mutex);
+   free(deleted);
+ }
+}
+
+/*============================================================================*/
+
+/** The prefix of the extended attributes that set a listing_policy_t. */
+#define POLICY_XATTR_PREFIX "user.notmuchfs."
+
+/**
+ * Read the policy of a query directory, from extended attributes of its
+ * backing store directory (following symlinks):
+ *
+ * - user.notmuchfs.ttl:     listing_policy_t::ttl, in seconds.
+ * - user.notmuchfs.refresh: 'full' or 'incremental' (the default).
+ * - user.notmuchfs.stale:   'yes' to serve out of date listings while they
+ *                           are refreshed, 'no' (the default) to wait.
+ *
+ * Missing or malformed attributes leave the default.
+ *
+ * @param[in]  dir      The query directory, relative to the backing store.
+ * @param[out] p_policy The policy.
+ */
+static void policy_read (const char *dir, listing_policy_t *p_policy)
+{
+ char    value[32];
+ ssize_t length;
+
+ p_policy->ttl          = -1;
+ p_policy->full_refresh = FALSE;
+ p_policy->serve_stale  = FALSE;
+
+ length = getxattr(dir, POLICY_XATTR_PREFIX "ttl", value, sizeof(value) - 1);
+ if (length > 0) {
+   char *end;
+   value[length] = '\0';
+   long ttl = strtol(value, &end, 10);
+   if (end != value && (*end == '\0' || *end == '\n') && ttl >= 0 &&
+       ttl <= INT_MAX)
+     p_policy->ttl = (int)ttl;
+ }
+
+ length = getxattr(dir, POLICY_XATTR_PREFIX "refresh", value,
+                   sizeof(value) - 1);
+ if (length > 0) {
+   value[length] = '\0';
+   p_policy->full_refresh = (strncmp(value, "full", 4) == 0);
+ }
+
+ length = getxattr(dir, POLICY_XATTR_PREFIX "stale", value,
+                   sizeof(value) - 1);
+ if (length > 0) {
+   value[length] = '\0';
+   p_policy->serve_stale = (strncmp(value, "yes", 3) == 0 ||
+                            strncmp(value, "1", 1) == 0);
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * Find a cached listing of a query that is up to date, as far as its policy
+ * requires.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     query    The notmuch query.
+ * @param[in]     p_policy The policy of the query.
+ * @param[out]    p_stale  Set if the listing returned is out of date, and
+ *                         should be refreshed in the background.
+ * @return The listing, with a reference held by the caller, or NULL if there
+ *         isn't one.
+ */
+static listing_t *cache_lookup (notmuch_context_t      *p_ctx,
+                                const char             *query,
+                                const listing_policy_t *p_policy,
+                                bool                   *p_stale)
+{
+ cache_t *p_cache = &p_ctx->cache;
+ time_t   now     = time(NULL);
+ time_t   ttl     = (p_policy->ttl >= 0) ? p_policy->ttl
+                                         : (time_t)global_config.cache_ttl;
+
+ *p_stale = FALSE;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ listing_t *p_listing = strmap_get(&p_cache->listings, query);
+ if (p_listing != NULL) {
+   bool fresh =
+     (p_cache->watching && p_listing->revision == p_cache->revision) ||
+     (now - p_listing->built < ttl);
+   if (!fresh && p_policy->serve_stale && p_cache->watching)
+     *p_stale = TRUE;
+
+   if (fresh || *p_stale) {
+     p_listing->refs++;
+     p_listing->last_used = now;
+   }
+   else {
+     p_listing = NULL;
+   }
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ LOG_TRACE("cache_lookup(%s) %s\n", query,
+           p_listing ? (*p_stale ? "stale" : "hit") : "miss");
+ return p_listing;
+}
+
+/*============================================================================*/
+
+/**
+ * Build the listing of a nested query directory without searching the
+ * database, by filtering the cached listing of its parent in memory. This
+ * needs an up to date parent listing, and the tag index to evaluate the
+ * nested directory's own query, which must be made only of tags.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     dir   The nested query directory, relative to the backing
+ *                      store.
+ * @param[in]     query The notmuch query of 'dir', see resolve_query().
+ * @return The listing, with one reference held by the caller, not yet
+ *         published, or NULL if it can't be built this way.
+ */
+static listing_t *cache_refine (notmuch_context_t *p_ctx,
+                                const char        *dir,
+                                const char        *query)
+{
+ tagindex_t *p_index    = &p_ctx->tagindex;
+ const char *last_slash = strrchr(dir, '/');
+
+ if (!global_config.tag_index || last_slash == NULL)
+   return NULL;
+
+ char parent_dir[PATH_MAX];
+ char parent_query[PATH_MAX];
+ char child_query[PATH_MAX];
+ memcpy(parent_dir, dir, last_slash - dir);
+ parent_dir[last_slash - dir] = '\0';
+ strcpy(parent_query, parent_dir);
+ if (resolve_query(parent_query) != 0 ||
+     resolve_query_component(dir, child_query) != 0)
+   return NULL;
+
+ listing_policy_t policy;
+ bool             stale;
+ policy_read(parent_dir, &policy);
+ listing_t *p_parent = cache_lookup(p_ctx, parent_query, &policy, &stale);
+ if (p_parent == NULL)
+   return NULL;
+
+ /* Messages without a file aren't among the entries, so whether they match
+  * wouldn't be known, nor the number of messages in the refined listing.
+  */
+ bool *matched = NULL;
+ if (!stale && p_parent->n_messages == p_parent->n_entries) {
+   PTHREAD_LOCK(&p_index->mutex);
+   uint64_t *bits = NULL;
+   if (p_index->built && p_index->revision == p_parent->revision)
+     bits = tagindex_evaluate_locked(p_ctx, p_index, child_query, FALSE);
+   if (bits != NULL) {
+     /* The IDs of the entries never change, so the cache needn't be locked
+      * to read them.
+      */
+     matched = malloc(MAX(p_parent->n_entries, 1) * sizeof(bool));
+     for (size_t i = 0; i < p_parent->n_entries; i++) {
+       size_t slot = (size_t)(uintptr_t)strmap_get(&p_index->ids,
+                                                   p_parent->entries[i].id);
+       if (slot == 0) {
+         free(matched);
+         matched = NULL;
+         break;
+       }
+       slot--;
+       matched[i] = (bits[slot / TAGINDEX_WORD_BITS] >>
+                     (slot % TAGINDEX_WORD_BITS)) & 1;
+     }
+     free(bits);
+     if (matched != NULL)
+       p_index->hits++;
+   }
+   PTHREAD_UNLOCK(&p_index->mutex);
+ }
+
+ listing_t *p_listing = NULL;
+ if (matched != NULL) {
+   cache_t *p_cache = &p_ctx->cache;
+   p_listing = listing_alloc(query, p_parent->revision, p_parent->n_entries);
+
+   PTHREAD_LOCK(&p_cache->mutex);
+   for (size_t i = 0; i < p_parent->n_entries; i++) {
+     listing_entry_t *p_entry = &p_parent->entries[i];
+     if (!matched[i])
+       continue;
+
+     listing_entry_t *p_copy = &p_listing->entries[p_listing->n_entries++];
+     p_copy->name          = strdup(p_entry->name);
+     p_copy->id            = strdup(p_entry->id);
+     p_copy->st            = p_entry->st;
+     p_copy->deleted       = p_entry->deleted;
+     p_copy->header_length = p_entry->header_length;
+     strmap_put(&p_listing->index, p_copy->name, p_copy);
+   }
+   p_listing->n_messages = p_listing->n_entries;
+   /* It's only as fresh as the parent. */
+   p_listing->built      = p_parent->built;
+   p_cache->refined++;
+   PTHREAD_UNLOCK(&p_cache->mutex);
+   free(matched);
+ }
+ listing_unref(p_ctx, p_parent);
+
+ LOG_TRACE("cache_refine(%s) %s\n", query,
+           (p_listing != NULL) ? "refined" : "not refined");
+ return p_listing;
+}
+
+/*============================================================================*/
+
+/** The number of messages a listing being streamed grows by at a time. */
+#define STREAM_BATCH 128
+
+/**
+ * The arguments of stream_job().
+ */
+typedef struct
+{
+ notmuch_context_t *p_ctx;
+ /** The listing being streamed, a reference held by the job. */
+ listing_t         *p_listing;
+ /** The number of entries the listing has space for. */
+ size_t             max_entries;
+ /** Where the next batch of messages is stat()ed into. */
+ listing_t         *p_batch;
+} stream_arg_t;
+
+/**
+ * Add messages to a listing being streamed, and wake up anyone waiting to
+ * list them.
+ *
+ * @param[in,out] p_arg  The stream.
+ * @param[in]     ids    The IDs of the messages.
+ * @param[in]     fnames The real file names of the messages.
+ * @param[in]     count  The number of messages.
+ */
+static void stream_append (stream_arg_t *p_arg,
+                           char        **ids,
+                           char        **fnames,
+                           size_t        count)
+{
+ cache_t   *p_cache   = &p_arg->p_ctx->cache;
+ listing_t *p_listing = p_arg->p_listing;
+ listing_t *p_batch   = p_arg->p_batch;
+
+ /* The files are stat()ed without the cache locked. The batch's index is
+  * left with all the names so far, to skip duplicates.
+  */
+ for (size_t i = 0; i < count; i++) {
+   if (fnames[i] != NULL)
+     listing_add(p_arg->p_ctx, p_batch, fnames[i], ids[i]);
+ }
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_listing->n_entries + p_batch->n_entries > p_arg->max_entries) {
+   p_arg->max_entries = MAX(p_arg->max_entries * 2,
+                            p_listing->n_entries + p_batch->n_entries);
+   p_listing->entries = realloc(p_listing->entries,
+                                p_arg->max_entries * sizeof(listing_entry_t));
+ }
+ memcpy(&p_listing->entries[p_listing->n_entries], p_batch->entries,
+        p_batch->n_entries * sizeof(listing_entry_t));
+ p_listing->n_entries  += p_batch->n_entries;
+ p_listing->n_messages += count;
+ p_batch->n_entries     = 0;
+ pthread_cond_broadcast(&p_cache->streamed);
+ PTHREAD_UNLOCK(&p_cache->mutex);
+}
+
+/**
+ * The pool job that streams a listing, see cache_stream(). It runs the query
+ * like listing_build(), but hands over the messages a batch at a time as
+ * they're found, and publishes the listing once it's complete.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     arg   The stream_arg_t, freed by the job.
+ * @return 0.
+ */
+static int stream_job (notmuch_context_t *p_ctx, void *arg)
+{
+ stream_arg_t      *p_arg     = (stream_arg_t *)arg;
+ cache_t           *p_cache   = &p_ctx->cache;
+ listing_t         *p_listing = p_arg->p_listing;
+ message_list_t     messages;
+ bool               ok;
+
+ notmuch_database_t *p_db     = database_open(p_ctx, FALSE);
+ unsigned long       revision = notmuch_database_get_revision(p_db, NULL);
+ tagindex_update(p_ctx, p_db, FALSE);
+
+ if (tagindex_search(p_ctx, revision, p_listing->query, NULL, &messages,
+                     NULL)) {
+   /* Found all at once, but there's still every file to stat(). */
+   database_close(p_ctx, p_db);
+   for (size_t i = 0; i < messages.count; i += STREAM_BATCH)
+     stream_append(p_arg, &messages.ids[i], &messages.fnames[i],
+                   MIN(STREAM_BATCH, messages.count - i));
+   message_list_free(&messages);
+   ok = TRUE;
+ }
+ else {
+   notmuch_query_t    *p_query    = query_create(p_ctx, p_db,
+                                                 p_listing->query);
+   notmuch_messages_t *p_messages = NULL;
+
+   memset(&messages, 0, sizeof(message_list_t));
+   ok = p_query != NULL &&
+        notmuch_query_search_messages(p_query, &p_messages) ==
+        NOTMUCH_STATUS_SUCCESS;
+   for (; ok && notmuch_messages_valid(p_messages);
+        notmuch_messages_move_to_next(p_messages)) {
+     notmuch_message_t *p_message = notmuch_messages_get(p_messages);
+
+     if (messages.count == messages.max) {
+       messages.max    = STREAM_BATCH;
+       messages.ids    = realloc(messages.ids, messages.max * sizeof(char *));
+       messages.fnames = realloc(messages.fnames,
+                                 messages.max * sizeof(char *));
+     }
+     messages.ids[messages.count] =
+       strdup(notmuch_message_get_message_id(p_message));
+     messages.fnames[messages.count] = message_best_filename(p_ctx,
+                                                             p_message);
+     messages.count++;
+     notmuch_message_destroy(p_message);
+
+     if (messages.count == STREAM_BATCH) {
+       stream_append(p_arg, messages.ids, messages.fnames, messages.count);
+       message_list_free(&messages);
+     }
+   }
+   if (ok)
+     stream_append(p_arg, messages.ids, messages.fnames, messages.count);
+   message_list_free(&messages);
+   if (p_messages != NULL)
+     notmuch_messages_destroy(p_messages);
+   if (p_query != NULL)
+     query_release(p_query);
+   database_close(p_ctx, p_db);
+ }
+
+ p_arg->p_batch->refs--;
+ listing_free(p_arg->p_batch);
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (ok) {
+   p_listing->revision = revision;
+   for (size_t i = 0; i < p_listing->n_entries; i++)
+     strmap_put(&p_listing->index, p_listing->entries[i].name,
+                &p_listing->entries[i]);
+ }
+ else {
+   fprintf(stderr, "ERROR: Can't list query \"%s\".\n", p_listing->query);
+ }
+ p_listing->streaming = FALSE;
+ p_listing->failed    = !ok;
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ if (ok)
+   cache_publish(p_ctx, p_listing);
+
+ LOG_TRACE("stream_job(%s) %zu entries at revision %lu\n", p_listing->query,
+           p_listing->n_entries, revision);
+
+ /* notmuchfs_destroy() waits for every stream to be forgotten, so this is
+  * the last use of the context.
+  */
+ PTHREAD_LOCK(&p_cache->mutex);
+ strmap_remove(&p_cache->streams, p_listing->query);
+ listing_unref_locked(p_cache, p_listing);
+ pthread_cond_broadcast(&p_cache->streamed);
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ free(p_arg);
+ return 0;
+}
+
+/**
+ * Get the listing of a query by streaming it: queue a job in the worker pool
+ * to run the query, and return at once with the listing it is adding
+ * messages to, which readdir() lists as they arrive (see
+ * stream_wait_locked()). If the query is already being streamed, join in.
+ *
+ * The job runs as a #POOL_CLASS_LIST job, so streams share the workers (and
+ * their limit) with listings built any other way.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     query The notmuch query.
+ * @return The listing, with one reference held by the caller.
+ */
+static listing_t *cache_stream (notmuch_context_t *p_ctx, const char *query)
+{
+ cache_t *p_cache = &p_ctx->cache;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ listing_t *p_listing = strmap_get(&p_cache->streams, query);
+ if (p_listing != NULL) {
+   p_listing->refs++;
+   PTHREAD_UNLOCK(&p_cache->mutex);
+   LOG_TRACE("cache_stream(%s) joined\n", query);
+   return p_listing;
+ }
+
+ stream_arg_t *p_arg = malloc(sizeof(stream_arg_t));
+ p_arg->p_ctx       = p_ctx;
+ p_arg->p_listing   = listing_alloc(query, 0, STREAM_BATCH);
+ p_arg->max_entries = STREAM_BATCH;
+ p_arg->p_batch     = listing_alloc(query, 0, STREAM_BATCH);
+ p_listing = p_arg->p_listing;
+ p_listing->streaming = TRUE;
+ /* One reference for the job, one for the caller. */
+ p_listing->refs++;
+ strmap_put(&p_cache->streams, query, p_listing);
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ LOG_TRACE("cache_stream(%s) started\n", query);
+ pool_submit(p_ctx, POOL_CLASS_LIST, stream_job, p_arg);
+ return p_listing;
+}
+
+/**
+ * Wait until a listing being streamed has more than a number of entries, or
+ * is complete.
+ *
+ * @param[in,out] p_ctx     The notmuch context.
+ * @param[in]     p_listing The listing. The cache must be locked.
+ * @param[in]     count     The number of entries already listed.
+ * @return 0, or -EINTR if the FUSE request was interrupted.
+ */
+static int stream_wait_locked (notmuch_context_t *p_ctx,
+                               listing_t         *p_listing,
+                               size_t             count)
+{
+ while (p_listing->streaming && p_listing->n_entries <= count) {
+   if (fuse_interrupted())
+     return -EINTR;
+
+   struct timespec deadline;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_nsec += POOL_INTERRUPT_POLL_MS * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L) {
+     deadline.tv_sec++;
+     deadline.tv_nsec -= 1000000000L;
+   }
+   pthread_cond_timedwait(&p_ctx->cache.streamed, &p_ctx->cache.mutex,
+                          &deadline);
+ }
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Find when the set of messages in a query last changed.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     query The notmuch query.
+ * @return The time, or 0 if not known.
+ */
+static time_t cache_changed_time (notmuch_context_t *p_ctx, const char *query)
+{
+ cache_t *p_cache = &p_ctx->cache;
+ time_t   changed = 0;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ listing_t *p_listing = strmap_get(&p_cache->listings, query);
+ if (p_listing != NULL)
+   changed = p_listing->changed;
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ return changed;
+}
+
+/*============================================================================*/
+
+/**
+ * Mark a message as deleted in every cached listing.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     name  The virtual message name.
+ */
+static void cache_mark_deleted (notmuch_context_t *p_ctx, const char *name)
+{
+ cache_t *p_cache = &p_ctx->cache;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->listings.count > 0) {
+   listing_t **listings = (listing_t **)strmap_values(&p_cache->listings);
+   for (size_t i = 0; i < p_cache->listings.count; i++)
+     listing_mark_deleted_locked(listings[i], name);
+   free(listings);
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * Rename a message in every cached listing, so that the new name shows up
+ * straight away, even before the database change is noticed.
+ *
+ * @param[in,out] p_ctx     The notmuch context.
+ * @param[in]     name_from The old virtual message name.
+ * @param[in]     name_to   The new virtual message name.
+ */
+static void cache_rename (notmuch_context_t *p_ctx,
+                          const char        *name_from,
+                          const char        *name_to)
+{
+ cache_t *p_cache = &p_ctx->cache;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->listings.count > 0) {
+   listing_t **listings = (listing_t **)strmap_values(&p_cache->listings);
+   for (size_t i = 0; i < p_cache->listings.count; i++) {
+     listing_entry_t *p_entry = strmap_remove(&listings[i]->index, name_from);
+     if (p_entry != NULL) {
+       free(p_entry->name);
+       p_entry->name = strdup(name_to);
+       strmap_put(&listings[i]->index, name_to, p_entry);
+       listing_dirents_drop_locked(listings[i]);
+     }
+   }
+   free(listings);
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * Find the attributes of a message in the cached listings, to save a stat()
+ * of the real file. Message files aren't modified in place (a change of
+ * flags is a rename), so the attributes in any up to date listing hold.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @param[in]     name  The virtual message name.
+ * @param[out]    p_st  The attributes, as given to readdir().
+ * @return 0 if found, -ENOENT if the message was deleted through notmuchfs,
+ *         or 1 if no up to date listing has the message.
+ */
+static int cache_stat (notmuch_context_t *p_ctx,
+                       const char        *name,
+                       struct stat       *p_st)
+{
+ cache_t *p_cache = &p_ctx->cache;
+ time_t   now     = time(NULL);
+ int      res     = 1;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->listings.count > 0) {
+   listing_t **listings = (listing_t **)strmap_values(&p_cache->listings);
+   for (size_t i = 0; i < p_cache->listings.count && res == 1; i++) {
+     listing_t *p_listing = listings[i];
+     time_t     ttl       = (p_listing->policy.ttl >= 0)
+                              ? p_listing->policy.ttl
+                              : (time_t)global_config.cache_ttl;
+     bool       fresh     =
+       (p_cache->watching && p_listing->revision == p_cache->revision) ||
+       (now - p_listing->built < ttl);
+     if (!fresh)
+       continue;
+
+     listing_entry_t *p_entry = strmap_get(&p_listing->index, name);
+     if (p_entry != NULL) {
+       if (p_entry->deleted) {
+         res = -ENOENT;
+       }
+       else {
+         *p_st = p_entry->st;
+         res   = 0;
+       }
+     }
+   }
+   free(listings);
+   if (res == 0)
+     p_cache->stat_hits++;
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ return res;
+}
+
+/*============================================================================*/
+
+/** The most virtual message paths cache_t::xlabels remembers. */
+#define XLABEL_CACHE_MAX 65536
+
+/**
+ * Record the X-Label header a message is being opened with, and find whether
+ * it's the same as the last time it was opened through the same virtual path,
+ * so the content the kernel has cached for that path is still right.
+ *
+ * The kernel caches each path separately: a message in several query
+ * directories (or opened through a symlinked one) may have been cached
+ * through each of them with different tags.
+ *
+ * @param[in,out] p_ctx   The notmuch context.
+ * @param[in]     path    The virtual path of the message.
+ * @param[in]     x_label The X-Label header, #MAX_XLABEL_LENGTH long.
+ * @return TRUE if the message was last opened through 'path' with the same
+ *         header.
+ */
+static bool cache_xlabel_unchanged (notmuch_context_t *p_ctx,
+                                    const char        *path,
+                                    const char        *x_label)
+{
+ cache_t *p_cache   = &p_ctx->cache;
+ size_t   hash      = memory_hash(x_label, MAX_XLABEL_LENGTH);
+ bool     unchanged = FALSE;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ size_t *p_hash = strmap_get(&p_cache->xlabels, path);
+ if (p_hash != NULL) {
+   unchanged = (*p_hash == hash);
+ }
+ else {
+   if (p_cache->xlabels.count >= XLABEL_CACHE_MAX) {
+     /* Forgetting only costs one more read of each message. */
+     strmap_destroy(&p_cache->xlabels, free);
+     strmap_init(&p_cache->xlabels);
+   }
+   p_hash = malloc(sizeof(size_t));
+   strmap_put(&p_cache->xlabels, path, p_hash);
+ }
+ *p_hash = hash;
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ return unchanged;
+}
+
+/*============================================================================*/
+
+/**
+ * Find the length of the header block of a message, for the headers-only
+ * view. It's remembered in the cached listings, so each message file is
+ * only scanned once.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     name     The virtual message name.
+ * @param[in]     fname    The real file name of the message.
+ * @param[in]     fd       The open message file.
+ * @param[out]    p_length The length.
+ * @return 0 on success, or a negative errno.
+ */
+static int cache_header_length (notmuch_context_t *p_ctx,
+                                const char        *name,
+                                const char        *fname,
+                                int                fd,
+                                off_t             *p_length)
+{
+ cache_t *p_cache = &p_ctx->cache;
+
+ *p_length = 0;
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->listings.count > 0) {
+   listing_t **listings = (listing_t **)strmap_values(&p_cache->listings);
+   for (size_t i = 0; i < p_cache->listings.count && *p_length == 0; i++) {
+     listing_entry_t *p_entry = strmap_get(&listings[i]->index, name);
+     if (p_entry != NULL)
+       *p_length = p_entry->header_length;
+   }
+   free(listings);
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+ if (*p_length != 0)
+   return 0;
+
+ /* Scan the file without holding the lock. */
+ plain_t *p_plain;
+ int      res = plain_get(p_ctx, fname, fd, &p_plain);
+ if (res == 0)
+   res = message_header_length(fd, p_plain, p_length);
+ plain_unref(p_ctx, p_plain);
+ if (res != 0 || *p_length == 0)
+   return res;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->listings.count > 0) {
+   listing_t **listings = (listing_t **)strmap_values(&p_cache->listings);
+   for (size_t i = 0; i < p_cache->listings.count; i++) {
+     listing_entry_t *p_entry = strmap_get(&listings[i]->index, name);
+     if (p_entry != NULL)
+       p_entry->header_length = *p_length;
+   }
+   free(listings);
+ }
+ PTHREAD_UNLOCK(&p_cache->mutex);
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Drop every cached listing.
+ *
+ * @param[in,out] p_cache The cache, which must be locked.
+ */
+static void cache_clear_locked (cache_t *p_cache)
+{
+ if (p_cache->listings.count > 0) {
+   listing_t **listings = (listing_t **)strmap_values(&p_cache->listings);
+   size_t      count    = p_cache->listings.count;
+   for (size_t i = 0; i < count; i++) {
+     strmap_remove(&p_cache->listings, listings[i]->query);
+     listing_unref_locked(p_cache, listings[i]);
+   }
+   free(listings);
+ }
+}
+
+/*============================================================================*/
+
+/** How long (in seconds) an unused listing is kept in the cache. */
+#define LISTING_IDLE_EXPIRY 600
+
+/**
+ * Tell anyone watching the cur/ and new/ directories of a virtual maildir
+ * (with inotify, e.g. mutt) that its contents changed. The kernel only
+ * generates inotify events for changes made through the mount, so touch the
+ * directories through the mount.
+ *
+ * @param[in] dir The virtual query directory.
+ */
+static void notify_dir_changed (const char *dir)
+{
+ if (global_config.mountpoint == NULL)
+   return;
+
+ const char *subdirs[] = { "cur", "new" };
+ for (size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+   char path[PATH_MAX];
+   snprintf(path, PATH_MAX, "%s/%s/%s", global_config.mountpoint, dir,
+            subdirs[i]);
+   LOG_TRACE("notify utimensat(%s)\n", path);
+   if (utimensat(AT_FDCWD, path, NULL, 0) != 0) {
+     LOG_TRACE("WARNING: Can't notify change of \"%s\": %s.\n", path,
+               strerror(errno));
+   }
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * The database state of a listing being refreshed by cache_refresh().
+ */
+typedef struct
+{
+ listing_t      *p_listing;
+ /** Whether to rebuild the listing rather than apply the changes. */
+ bool            full_refresh;
+ /** Whether the queries below succeeded. */
+ bool            ok;
+ /** The changed messages that match the listing's query now. */
+ message_list_t  matches;
+ /** The number of messages that match the listing's query now. */
+ unsigned        count;
+} listing_delta_t;
+
+/**
+ * Bring the cache up to date with the database, incrementally. The messages
+ * changed since the oldest listing's revision are found with a single
+ * 'lastmod:' query, and only those are re-checked against each listing's
+ * query: in memory, against their tags, if the query is made only of tags
+ * (see tagindex_evaluate_locked()), or else by searching within them.
+ * Listings whose set of messages changed get a new 'changed' time, and their
+ * directories are notified.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void cache_refresh (notmuch_context_t *p_ctx)
+{
+ cache_t    *p_cache = &p_ctx->cache;
+ const char *uuid    = NULL;
+ time_t      now     = time(NULL);
+
+ notmuch_database_t *p_db = database_open(p_ctx, FALSE);
+ unsigned long revision = notmuch_database_get_revision(p_db, &uuid);
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ if (p_cache->uuid == NULL || strcmp(p_cache->uuid, uuid) != 0) {
+   /* A different database, nothing cached can be trusted. */
+   LOG_TRACE("cache_refresh new database %s revision %lu\n", uuid, revision);
+   cache_clear_locked(p_cache);
+   free(p_cache->uuid);
+   p_cache->uuid     = strdup(uuid);
+   p_cache->revision = revision;
+   PTHREAD_UNLOCK(&p_cache->mutex);
+   database_close(p_ctx, p_db);
+   return;
+ }
+ /* Take the listings to check, expiring unused ones on the way. Listings
+  * whose policy tolerates staleness are left until their TTL is up.
+  */
+ listing_t      **listings   = (listing_t **)strmap_values(&p_cache->listings);
+ size_t           count      = p_cache->listings.count;
+ size_t           n_deltas   = 0;
+ listing_delta_t *deltas     = calloc(MAX(count, 1), sizeof(listing_delta_t));
+ unsigned long    since      = revision;
+ for (size_t i = 0; i < count; i++) {
+   listing_t *p_listing = listings[i];
+   if (p_listing->refs == 1 &&
+       now - p_listing->last_used > LISTING_IDLE_EXPIRY) {
+     strmap_remove(&p_cache->listings, p_listing->query);
+     listing_unref_locked(p_cache, p_listing);
+   }
+   else if (p_listing->revision < revision &&
+            (p_listing->policy.ttl <= 0 ||
+             now - p_listing->built >= p_listing->policy.ttl)) {
+     p_listing->refs++;
+     since = MIN(since, p_listing->revision);
+     deltas[n_deltas].p_listing    = p_listing;
+     deltas[n_deltas].full_refresh = p_listing->policy.full_refresh;
+     n_deltas++;
+   }
+ }
+ free(listings);
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ LOG_TRACE("cache_refresh revision %lu..%lu, %zu listings\n", since, revision,
+           n_deltas);
+
+ /* Collect every changed message (with its tags), once for all listings. */
+ tagindex_t changes;
+ bool       changes_init = (tagindex_init(&changes) == 0);
+ bool       changes_ok   = changes_init;
+ if (changes_ok && n_deltas > 0) {
+   char lastmod[64];
+   snprintf(lastmod, sizeof(lastmod), "lastmod:%lu..%lu", since + 1,
+            revision);
+   changes_ok = tagindex_add_query_locked(p_ctx, &changes, p_db, lastmod);
+ }
+ tagindex_update(p_ctx, p_db, FALSE);
+
+ /* Then which of them match each query now. */
+ unsigned long shared = 0;
+ for (size_t i = 0; changes_ok && i < n_deltas; i++) {
+   listing_delta_t *p_delta = &deltas[i];
+   char            *query_changed = NULL;
+
+   if (p_delta->full_refresh)
+     continue;
+
+   if (tagindex_search(p_ctx, revision, p_delta->p_listing->query,
+                       &changes.ids, &p_delta->matches, &p_delta->count)) {
+     p_delta->ok = TRUE;
+     continue;
+   }
+
+   notmuch_query_t *p_all = query_create(p_ctx, p_db,
+                                         p_delta->p_listing->query);
+   p_delta->ok = p_all != NULL &&
+                 notmuch_query_count_messages(p_all, &p_delta->count) ==
+                 NOTMUCH_STATUS_SUCCESS;
+   if (p_all != NULL)
+     query_release(p_all);
+   if (!p_delta->ok)
+     continue;
+
+   /* A query made only of tags is tested against the tags of each changed
+    * message in memory. Others are searched, within the changed messages
+    * (all of them, as they're all replaced by listing_apply_delta()).
+    */
+   if (tagindex_collect_locked(p_ctx, &changes, p_delta->p_listing->query,
+                               NULL, &p_delta->matches, NULL)) {
+     shared++;
+     continue;
+   }
+
+   if (asprintf(&query_changed, "(%s) and lastmod:%lu..%lu",
+                p_delta->p_listing->query, since + 1, revision) < 0) {
+     p_delta->ok = FALSE;
+     continue;
+   }
+   p_delta->ok = message_list_search(p_ctx, p_db, query_changed,
+                                     &p_delta->matches);
+   free(query_changed);
+ }
+ database_close(p_ctx, p_db);
+
+ /* Now the database is released, apply the changes. The directories of
+  * changed listings are notified once the new revision is published, so
+  * whoever looks in them then doesn't get a database handle from before.
+  */
+ char   **notify   = NULL;
+ size_t   n_notify = 0;
+ for (size_t i = 0; i < n_deltas; i++) {
+   listing_delta_t *p_delta   = &deltas[i];
+   listing_t       *p_listing = p_delta->p_listing;
+   listing_t       *p_new     = NULL;
+   bool             changed   = TRUE;
+
+   if (p_delta->ok && !p_delta->full_refresh) {
+     p_new = listing_apply_delta(p_ctx, p_listing, &changes.ids,
+                                 &p_delta->matches, p_delta->count, revision,
+                                 &changed);
+   }
+   if (p_new == NULL) {
+     LOG_TRACE("cache_refresh rebuilding '%s'\n", p_listing->query);
+     p_new = listing_build(p_ctx, p_listing->query);
+   }
+   message_list_free(&p_delta->matches);
+
+   if (!changed && p_new != NULL) {
+     /* Nothing to see, keep the old listing (with any deletions marked). */
+     listing_unref(p_ctx, p_new);
+     p_new = NULL;
+     PTHREAD_LOCK(&p_cache->mutex);
+     p_listing->revision = revision;
+     p_listing->built    = now;
+     PTHREAD_UNLOCK(&p_cache->mutex);
+   }
+
+   if (p_new != NULL) {
+     LOG_TRACE("cache_refresh '%s' changed\n", p_listing->query);
+     PTHREAD_LOCK(&p_cache->mutex);
+     bool current =
+       (strmap_get(&p_cache->listings, p_listing->query) == p_listing);
+     size_t n_dirs = p_listing->dirs.count;
+     if (n_dirs > 0) {
+       char **dirs = (char **)strmap_values(&p_listing->dirs);
+       notify = realloc(notify, (n_notify + n_dirs) * sizeof(char *));
+       for (size_t j = 0; j < n_dirs; j++)
+         notify[n_notify++] = strdup(dirs[j]);
+       free(dirs);
+     }
+     p_new->changed = now;
+     PTHREAD_UNLOCK(&p_cache->mutex);
+
+     /* Don't resurrect a listing that was dropped meanwhile. */
+     if (current)
+       cache_publish(p_ctx, p_new);
+     listing_unref(p_ctx, p_new);
+   }
+   listing_unref(p_ctx, p_listing);
+ }
+ if (changes_init)
+   tagindex_destroy(&changes);
+ free(deltas);
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ p_cache->revision          = MAX(p_cache->revision, revision);
+ p_cache->shared_refreshes += shared;
+ PTHREAD_UNLOCK(&p_cache->mutex);
+
+ for (size_t i = 0; i < n_notify; i++) {
+   notify_dir_changed(notify[i]);
+   free(notify[i]);
+ }
+ free(notify);
+}
+
+/*============================================================================*/
+
+/**
+ * How long (in milliseconds) the database directory must be quiet, after a
+ * change, before the watcher checks the database revision.
+ */
+#define WATCHER_SETTLE_MS 5
+
+/**
+ * The maximum time (in milliseconds) the watcher waits for the database
+ * directory to be quiet, before checking the database revision anyway.
+ */
+#define WATCHER_MAX_DELAY_MS 250
+
+/**
+ * Start watching the Xapian directory of the database.
+ *
+ * @param[in,out] p_watcher The watcher.
+ * @return TRUE on success.
+ */
+static bool watcher_add_watch (watcher_t *p_watcher)
+{
+ char xapian_dir[PATH_MAX];
+ snprintf(xapian_dir, PATH_MAX, "%s/.notmuch/xapian", global_config.mail_dir);
+
+ /* Xapian commits by writing (and renaming into place) its files, the
+  * version file last.
+  */
+ if (inotify_add_watch(p_watcher->inotify_fd, xapian_dir,
+                       IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                       IN_DELETE) == -1) {
+   fprintf(stderr, "WARNING: Can't watch \"%s\": %s.\n", xapian_dir,
+           strerror(errno));
+   return FALSE;
+ }
+ return TRUE;
+}
+
+/*============================================================================*/
+
+/**
+ * The watcher thread main loop. Waits for changes in the Xapian directory,
+ * then, once things settle, refreshes the cache.
+ *
+ * @param[in] p_ctx_in The notmuch context.
+ * @return NULL.
+ */
+static void *watcher_main (void *p_ctx_in)
+{
+ notmuch_context_t *p_ctx     = (notmuch_context_t *)p_ctx_in;
+ watcher_t         *p_watcher = &p_ctx->watcher;
+ bool               pending   = FALSE;
+ struct timespec    first_change;
+
+ struct pollfd fds[2];
+ fds[0].fd     = p_watcher->inotify_fd;
+ fds[0].events = POLLIN;
+ fds[1].fd     = p_watcher->stop_pipe[0];
+ fds[1].events = POLLIN;
+
+ tagindex_build(p_ctx);
+
+ while (TRUE) {
+   int res = poll(fds, 2, pending ? WATCHER_SETTLE_MS : -1);
+   if (res == -1) {
+     if (errno == EINTR)
+       continue;
+     fprintf(stderr, "ERROR: Watcher poll error %s.\n", strerror(errno));
+     break;
+   }
+   if (fds[1].revents != 0) {
+     char    buf[64];
+     ssize_t length = read(p_watcher->stop_pipe[0], buf, sizeof(buf));
+     if (length <= 0 || memchr(buf, '\0', length) != NULL)
+       break;
+
+     /* Asked to refresh now, see watcher_kick(). */
+     pending = FALSE;
+     cache_refresh(p_ctx);
+     tagindex_build(p_ctx);
+     continue;
+   }
+
+   if (fds[0].revents & POLLIN) {
+     char buf[4096]
+       __attribute__ ((aligned(__alignof__(struct inotify_event))));
+     ssize_t length = read(p_watcher->inotify_fd, buf, sizeof(buf));
+     for (char *ptr = buf; length > 0 && ptr < buf + length;
+          ptr += sizeof(struct inotify_event) +
+                 ((struct inotify_event *)ptr)->len) {
+       if (((struct inotify_event *)ptr)->mask & IN_IGNORED) {
+         /* The directory was replaced (e.g. 'notmuch compact'). */
+         (void)watcher_add_watch(p_watcher);
+       }
+     }
+     if (!pending)
+       clock_gettime(CLOCK_MONOTONIC, &first_change);
+     pending = TRUE;
+
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     long waited_ms = (now.tv_sec - first_change.tv_sec) * 1000 +
+                      (now.tv_nsec - first_change.tv_nsec) / 1000000;
+     if (waited_ms < WATCHER_MAX_DELAY_MS)
+       continue;
+   }
+   else if (!pending) {
+     continue;
+   }
+
+   pending = FALSE;
+   cache_refresh(p_ctx);
+   tagindex_build(p_ctx);
+ }
+
+ return NULL;
+}
+
+/*============================================================================*/
+
+/**
+ * Start the watcher thread. If the database can't be watched, no thread is
+ * started, and cached listings are only used for global_config.cache_ttl.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void watcher_start (notmuch_context_t *p_ctx)
+{
+ watcher_t *p_watcher = &p_ctx->watcher;
+
+ p_watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+ if (p_watcher->inotify_fd == -1) {
+   fprintf(stderr, "WARNING: Can't watch database: %s.\n", strerror(errno));
+   return;
+ }
+ if (!watcher_add_watch(p_watcher) ||
+     pipe2(p_watcher->stop_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+   close(p_watcher->inotify_fd);
+   p_watcher->inotify_fd = -1;
+   return;
+ }
+
+ /* Find the current revision before anything relies on it. */
+ cache_refresh(p_ctx);
+
+ int res = pthread_create(&p_watcher->thread, NULL, watcher_main, p_ctx);
+ if (res != 0) {
+   fprintf(stderr, "WARNING: Can't start watcher thread: %s.\n",
+           strerror(res));
+   close(p_watcher->stop_pipe[0]);
+   close(p_watcher->stop_pipe[1]);
+   close(p_watcher->inotify_fd);
+   p_watcher->inotify_fd = -1;
+   return;
+ }
+
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ p_ctx->cache.watching = TRUE;
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * Ask the watcher thread to refresh the cache now, e.g. because an out of
+ * date listing is being served.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void watcher_kick (notmuch_context_t *p_ctx)
+{
+ watcher_t *p_watcher = &p_ctx->watcher;
+
+ if (p_watcher->inotify_fd == -1)
+   return;
+
+ /* If the pipe is full, a refresh is coming anyway. */
+ if (write(p_watcher->stop_pipe[1], "r", 1) != 1) {
+   LOG_TRACE("watcher_kick: %s\n", strerror(errno));
+ }
+}
+
+/*============================================================================*/
+
+/**
+ * Stop the watcher thread, if it was started.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void watcher_stop (notmuch_context_t *p_ctx)
+{
+ watcher_t *p_watcher = &p_ctx->watcher;
+
+ if (p_watcher->inotify_fd == -1)
+   return;
+
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ p_ctx->cache.watching = FALSE;
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+
+ ssize_t res = write(p_watcher->stop_pipe[1], "", 1);
+ assert(res == 1);
+ res = pthread_join(p_watcher->thread, NULL);
+ assert(res == 0);
+
+ close(p_watcher->stop_pipe[0]);
+ close(p_watcher->stop_pipe[1]);
+ close(p_watcher->inotify_fd);
+ p_watcher->inotify_fd = -1;
+}
+
+/*============================================================================*/
+
+/**
+ * Initialize the negative lookup cache.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ * @return 0 on success, or an errno.
+ */
+static int negcache_init (notmuch_context_t *p_ctx)
+{
+ negcache_t *p_neg = &p_ctx->negcache;
+
+ int res = pthread_mutex_init(&p_neg->mutex, NULL);
+ if (res != 0)
+   return res;
+ strmap_init(&p_neg->names);
+ p_neg->ring = calloc(MAX(global_config.negative_cache, 1),
+                      sizeof(negcache_entry_t *));
+ p_neg->next = 0;
+ p_neg->hits = 0;
+ return 0;
+}
+
+/**
+ * Free all resources of the negative lookup cache.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void negcache_destroy (notmuch_context_t *p_ctx)
+{
+ negcache_t *p_neg = &p_ctx->negcache;
+
+ strmap_destroy(&p_neg->names, NULL);
+ for (unsigned i = 0; i < global_config.negative_cache; i++) {
+   if (p_neg->ring[i] != NULL) {
+     free(p_neg->ring[i]->name);
+     free(p_neg->ring[i]);
+   }
+ }
+ free(p_neg->ring);
+ int res = pthread_mutex_destroy(&p_neg->mutex);
+ assert(res == 0);
+}
+
+/**
+ * Find the current cache revision, against which negative entries are
+ * checked.
+ *
+ * @param[in]  p_ctx      The notmuch context.
+ * @param[out] p_watching Whether the revision is kept up to date.
+ * @return The revision.
+ */
+static unsigned long negcache_revision (notmuch_context_t *p_ctx,
+                                        bool              *p_watching)
+{
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ unsigned long revision = p_ctx->cache.revision;
+ *p_watching = p_ctx->cache.watching;
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+ return revision;
+}
+
+/**
+ * Whether a message file is known not to exist.
+ *
+ * While the database is watched, an entry holds until the database changes.
+ * Otherwise it holds for global_config.cache_ttl, like a cached listing.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     filename The real file name of the message.
+ * @return TRUE if 'filename' doesn't exist.
+ */
+static bool negcache_lookup (notmuch_context_t *p_ctx, const char *filename)
+{
+ negcache_t *p_neg = &p_ctx->negcache;
+
+ if (global_config.negative_cache == 0)
+   return FALSE;
+
+ bool          watching;
+ unsigned long revision = negcache_revision(p_ctx, &watching);
+
+ PTHREAD_LOCK(&p_neg->mutex);
+ negcache_entry_t *p_entry = strmap_get(&p_neg->names, filename);
+ bool              hit     = FALSE;
+ if (p_entry != NULL && p_entry->valid) {
+   if (watching)
+     hit = (p_entry->revision == revision);
+   else
+     hit = (time(NULL) - p_entry->time < (time_t)global_config.cache_ttl);
+ }
+ if (hit)
+   p_neg->hits++;
+ PTHREAD_UNLOCK(&p_neg->mutex);
+ return hit;
+}
+
+/**
+ * Record that a message file doesn't exist.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     filename The real file name of the message.
+ */
+static void negcache_insert (notmuch_context_t *p_ctx, const char *filename)
+{
+ negcache_t *p_neg = &p_ctx->negcache;
+
+ if (global_config.negative_cache == 0)
+   return;
+
+ bool          watching;
+ unsigned long revision = negcache_revision(p_ctx, &watching);
+
+ PTHREAD_LOCK(&p_neg->mutex);
+ negcache_entry_t *p_entry = strmap_get(&p_neg->names, filename);
+ if (p_entry == NULL) {
+   /* Replace the oldest entry. */
+   p_entry = p_neg->ring[p_neg->next];
+   if (p_entry != NULL) {
+     strmap_remove(&p_neg->names, p_entry->name);
+     free(p_entry->name);
+   }
+   else {
+     p_entry = malloc(sizeof(negcache_entry_t));
+     p_neg->ring[p_neg->next] = p_entry;
+   }
+   p_neg->next = (p_neg->next + 1) % global_config.negative_cache;
+
+   p_entry->name = strdup(filename);
+   strmap_put(&p_neg->names, filename, p_entry);
+ }
+ p_entry->revision = revision;
+ p_entry->time     = time(NULL);
+ p_entry->valid    = TRUE;
+ PTHREAD_UNLOCK(&p_neg->mutex);
+}
+
+/**
+ * Forget that a message file doesn't exist, because notmuchfs has created
+ * it.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     filename The real file name of the message.
+ */
+static void negcache_forget (notmuch_context_t *p_ctx, const char *filename)
+{
+ negcache_t *p_neg = &p_ctx->negcache;
+
+ if (global_config.negative_cache == 0)
+   return;
+
+ PTHREAD_LOCK(&p_neg->mutex);
+ negcache_entry_t *p_entry = strmap_get(&p_neg->names, filename);
+ if (p_entry != NULL)
+   p_entry->valid = FALSE;
+ PTHREAD_UNLOCK(&p_neg->mutex);
+}
+
+/*============================================================================*/
+
+/**
+ * The virtual files in each query directory, next to cur/, new/ and tmp/.
+ * These are not listed by readdir(), so they don't upset MUAs, or anything
+ * copying whole directories.
+ */
+typedef enum
+{
+ /** Not a query file. */
+ QUERY_FILE_NONE,
+ /** '.changes?since=REV': the changes to the query results since REV. */
+ QUERY_FILE_CHANGES,
+ /** '.mbox': the messages matching the query, in mbox format. */
+ QUERY_FILE_MBOX,
+ /**
+  * '/.notmuchfs_stats': not a query file, but the notmuchfs statistics, at
+  * the root of the file system.
+  */
+ QUERY_FILE_STATS
+} query_file_t;
+
+/** The name of the changes feed file. */
+#define CHANGES_FILE ".changes"
+
+/** The name of the mbox view file. */
+#define MBOX_FILE ".mbox"
+
+/** The name of the stats file. */
+#define STATS_FILE ".notmuchfs_stats"
+
+/**
+ * Split a virtual path of the form '/<query>/<file>', where 'file' is one of
+ * the virtual query files.
+ *
+ * @param[in]  path  The virtual path.
+ * @param[out] dir   The '<query>' part of the path. Must be PATH_MAX long.
+ * @param[out] p_arg Any argument to the file (after '?'), pointing into
+ *                   'path', or NULL.
+ * @return The type of file, or #QUERY_FILE_NONE if 'path' is not one.
+ */
+static query_file_t split_query_file_path (const char  *path,
+                                           char        *dir,
+                                           const char **p_arg)
+{
+ assert(path[0] == '/');
+
+ *p_arg = NULL;
+ if (strcmp(path + 1, STATS_FILE) == 0) {
+   dir[0] = '\0';
+   return QUERY_FILE_STATS;
+ }
+
+ const char *last_slash = strrchr(path, '/');
+ if (last_slash == path || last_slash[1] != '.' ||
+     (size_t)(last_slash - path) > PATH_MAX)
+   return QUERY_FILE_NONE;
+
+ query_file_t type = QUERY_FILE_NONE;
+ const char  *name = last_slash + 1;
+ if (strncmp(name, CHANGES_FILE, strlen(CHANGES_FILE)) == 0) {
+   const char *rest = name + strlen(CHANGES_FILE);
+   if (*rest == '?') {
+     type   = QUERY_FILE_CHANGES;
+     *p_arg = rest + 1;
+   }
+   else if (*rest == '\0') {
+     type = QUERY_FILE_CHANGES;
+   }
+ }
+ else if (strcmp(name, MBOX_FILE) == 0) {
+   type = QUERY_FILE_MBOX;
+ }
+
+ if (type != QUERY_FILE_NONE) {
+   memcpy(dir, path + 1, last_slash - path - 1);
+   dir[last_slash - path - 1] = '\0';
+ }
+ return type;
+}
+
+/*============================================================================*/
+
+/**
+ * Append the tags of a message to a string buffer, comma separated.
+ *
+ * @param[in,out] p_buf     The buffer.
+ * @param[in]     p_message The message.
+ */
+static void strbuf_append_tags (strbuf_t *p_buf, notmuch_message_t *p_message)
+{
+ notmuch_tags_t *p_tags = notmuch_message_get_tags(p_message);
+ bool            first  = TRUE;
+
+ for (; notmuch_tags_valid(p_tags); notmuch_tags_move_to_next(p_tags)) {
+   const char *tag = notmuch_tags_get(p_tags);
+   if (!first)
+     strbuf_append(p_buf, ",", 1);
+   strbuf_append(p_buf, tag, strlen(tag));
+   first = FALSE;
+ }
+ notmuch_tags_destroy(p_tags);
+}
+
+/*============================================================================*/
+
+/**
+ * Generate the changes feed of a query: every message changed since a
+ * database revision, in a form that lets a consumer apply them to its own
+ * copy of the query results, in time proportional to the number of
+ * changes. The format is:
+ *
+ *   revision REVISION UUID
+ *   count N
+ *   + ID<TAB>NAME<TAB>TAGS
+ *   - ID
+ *
+ * 'revision' is the revision to ask for changes since next time. 'count' is
+ * the number of messages matching the query now. '+' is a message that was
+ * added, renamed or retagged, and matches now. '-' is a message that changed
+ * and no longer matches. Messages removed from the database entirely can't be
+ * reported, so a consumer whose message count doesn't match 'count' must
+ * start again from revision 0, which lists just the matching messages.
+ *
+ * @param[in]  p_ctx The notmuch context.
+ * @param[in]  query The notmuch query.
+ * @param[in]  since The revision to report changes since.
+ * @param[out] p_buf The buffer to fill.
+ * @return 0 on success, or a negative errno.
+ */
+static int changes_generate (notmuch_context_t *p_ctx,
+                             const char        *query,
+                             unsigned long      since,
+                             strbuf_t          *p_buf)
+{
+ const char *uuid = NULL;
+ int         res  = 0;
+
+ notmuch_database_t *p_db = database_open(p_ctx, FALSE);
+ unsigned long revision = notmuch_database_get_revision(p_db, &uuid);
+
+ unsigned         count   = 0;
+ notmuch_query_t *p_query = query_create(p_ctx, p_db, query);
+ if (p_query == NULL ||
+     notmuch_query_count_messages(p_query, &count) != NOTMUCH_STATUS_SUCCESS)
+   res = -EIO;
+ if (p_query != NULL)
+   query_release(p_query);
+
+ strbuf_printf(p_buf, "revision %lu %s\ncount %u\n", revision, uuid, count);
+
+ if (res == 0 && since < revision) {
+   strmap_t matched;
+   char    *query_matches = NULL;
+   char     lastmod[64];
+   size_t   n_changed     = 0;
+
+   strmap_init(&matched);
+   snprintf(lastmod, sizeof(lastmod), "lastmod:%lu..%lu", since + 1,
+            revision);
+   if (asprintf(&query_matches, "(%s) and %s", query, lastmod) < 0)
+     query_matches = NULL;
+
+   /* First the changed messages that match. */
+   notmuch_messages_t *p_messages = NULL;
+   p_query = (query_matches != NULL) ?
+               query_create(p_ctx, p_db, query_matches) : NULL;
+   if (p_query != NULL &&
+       notmuch_query_search_messages(p_query, &p_messages) ==
+       NOTMUCH_STATUS_SUCCESS) {
+     for (; notmuch_messages_valid(p_messages);
+          notmuch_messages_move_to_next(p_messages)) {
+       if (++n_changed % POOL_CANCEL_CHECK_INTERVAL == 0 && pool_cancelled()) {
+         res = -EINTR;
+         break;
+       }
+
+       notmuch_message_t *p_message = notmuch_messages_get(p_messages);
+       const char        *id        = notmuch_message_get_message_id(p_message);
+       char              *fname     = message_best_filename(p_ctx,
+                                                               p_message);
+
+       if (since > 0)
+         strmap_put(&matched, id, &matched);
+       if (fname != NULL) {
+         char trans_name[PATH_MAX];
+         virtual_name(trans_name, fname);
+         strbuf_printf(p_buf, "+ %s\t%s\t", id, trans_name);
+         strbuf_append_tags(p_buf, p_message);
+         strbuf_append(p_buf, "\n", 1);
+       }
+       free(fname);
+       notmuch_message_destroy(p_message);
+     }
+     notmuch_messages_destroy(p_messages);
+   }
+   else {
+     res = -EIO;
+   }
+   if (p_query != NULL)
+     query_release(p_query);
+   free(query_matches);
+
+   /* Then the rest of the changed messages, which don't. Starting from
+    * revision 0, the consumer has nothing to remove, so they aren't looked
+    * for: that would be every other message in the database.
+    */
+   if (since > 0) {
+     p_query = notmuch_query_create(p_db, lastmod);
+     if (res == 0 && p_query != NULL &&
+         notmuch_query_search_messages(p_query, &p_messages) ==
+         NOTMUCH_STATUS_SUCCESS) {
+       for (; notmuch_messages_valid(p_messages);
+            notmuch_messages_move_to_next(p_messages)) {
+         if (++n_changed % POOL_CANCEL_CHECK_INTERVAL == 0 &&
+             pool_cancelled()) {
+           res = -EINTR;
+           break;
+         }
+
+         notmuch_message_t *p_message = notmuch_messages_get(p_messages);
+         const char        *id        =
+           notmuch_message_get_message_id(p_message);
+
+         if (strmap_get(&matched, id) == NULL)
+           strbuf_printf(p_buf, "- %s\n", id);
+         notmuch_message_destroy(p_message);
+       }
+       notmuch_messages_destroy(p_messages);
+     }
+     else if (res == 0) {
+       res = -EIO;
+     }
+     if (p_query != NULL)
+       notmuch_query_destroy(p_query);
+   }
+   strmap_destroy(&matched, NULL);
+ }
+
+ database_close(p_ctx, p_db);
+ return res;
+}
+
+/*============================================================================*/
+
+/**
+ * @section mime_parts MIME Parts
+ *
+ * With the 'mime_parts' option, each message '/<query>/cur/<name>' also has
+ * a virtual directory '/<query>/cur/<name>.parts/', containing a file for
+ * each leaf MIME part of the message, with its content transfer encoding
+ * undone. Reading a part only reads its byte range of the message file.
+ */
+
+/** The suffix of the MIME parts directory of a message. */
+#define PARTS_SUFFIX ".parts"
+
+/** The deepest nesting of multipart entities that is followed. */
+#define MIME_MAX_DEPTH 8
+
+/** The size of the window that MIME parts are decoded in. */
+#define MIME_WINDOW_SIZE 65536
+
+/**
+ * The content transfer encodings of MIME parts.
+ */
+typedef enum
+{
+ /** '7bit', '8bit', 'binary' or unknown: the content is as is. */
+ MIME_ENCODING_NONE,
+ MIME_ENCODING_BASE64,
+ MIME_ENCODING_QUOTED_PRINTABLE
+} mime_encoding_t;
+
+/**
+ * A leaf MIME part of a message.
+ */
+typedef struct
+{
+ /** The name of the part in the '.parts/' directory, e.g. '2-report.pdf'. */
+ char            *name;
+ /** The byte range of the (encoded) body of the part in the message file. */
+ off_t            start;
+ off_t            end;
+ mime_encoding_t  encoding;
+ /** The size of the decoded body. */
+ off_t            size;
+} mime_part_t;
+
+/**
+ * The MIME structure of a message: the offsets of its leaf parts.
+ */
+typedef struct mime_index
+{
+ /** The real file name of the message. */
+ char        *fname;
+ mime_part_t *parts;
+ size_t       n_parts;
+ /** Protected by the mime_cache_t mutex. */
+ unsigned     refs;
+} mime_index_t;
+
+/**
+ * Which kind of MIME parts path a virtual path is.
+ */
+typedef enum
+{
+ /** Neither. */
+ PARTS_PATH_NONE,
+ /** '/<query>/cur/<name>.parts' */
+ PARTS_PATH_DIR,
+ /** '/<query>/cur/<name>.parts/<part>' */
+ PARTS_PATH_PART
+} parts_path_t;
+
+/**
+ * Split a virtual path of a message's MIME parts directory, or of a part in
+ * it.
+ *
+ * @param[in]  path     The virtual path.
+ * @param[out] filename The real file name of the message. Must be PATH_MAX
+ *                      long.
+ * @param[out] p_part   The '<part>' part of the path, pointing into 'path',
+ *                      or NULL.
+ * @return The kind of path.
+ */
+static parts_path_t split_parts_path (const char  *path,
+                                      char        *filename,
+                                      const char **p_part)
+{
+ assert(path[0] == '/');
+
+ *p_part = NULL;
+ if (!global_config.mime_parts)
+   return PARTS_PATH_NONE;
+
+ /* Neither message names nor part names contain '/', and nested query
+  * directories can't be called 'cur', so it's the last '/cur/'.
+  */
+ const char *cur_slash = NULL;
+ for (const char *p = strstr(path, "/cur/"); p != NULL;
+      p = strstr(p + 1, "/cur/"))
+   cur_slash = p;
+ if (cur_slash == NULL || cur_slash == path)
+   return PARTS_PATH_NONE;
+
+ const char *name     = cur_slash + 5;
+ const char *name_end = strchr(name, '/');
+ if (name_end == NULL)
+   name_end = name + strlen(name);
+ size_t length = name_end - name;
+ if (length <= strlen(PARTS_SUFFIX) || length >= PATH_MAX ||
+     memcmp(name_end - strlen(PARTS_SUFFIX), PARTS_SUFFIX,
+            strlen(PARTS_SUFFIX)) != 0 ||
+     memchr(name, '#', length) == NULL)
+   return PARTS_PATH_NONE;
+
+ length -= strlen(PARTS_SUFFIX);
+ memcpy(filename, name, length);
+ filename[length] = '\0';
+ string_replace(filename, '#', '/');
+
+ if (*name_end == '\0')
+   return PARTS_PATH_DIR;
+ if (name_end[1] == '\0' || strchr(name_end + 1, '/') != NULL)
+   return PARTS_PATH_NONE;
+ *p_part = name_end + 1;
+ return PARTS_PATH_PART;
+}
+
+/**
+ * Find the end of the header block of a MIME entity.
+ *
+ * @param[in] p The start of the entity.
+ * @param[in] e The end of the entity.
+ * @return The start of the body, or 'e' if there isn't one.
+ */
+static const char *mime_body_start (const char *p, const char *e)
+{
+ /* A blank line, possibly with a carriage return. */
+ while (p < e) {
+   const char *nl = memchr(p, '\n', e - p);
+   if (nl == NULL)
+     return e;
+   if (nl == p || (nl == p + 1 && *p == '\r'))
+     return nl + 1;
+   p = nl + 1;
+ }
+ return e;
+}
+
+/**
+ * Find the value of a header in a header block, unfolded.
+ *
+ * @param[in]  p      The start of the header block.
+ * @param[in]  e      The end of the header block.
+ * @param[in]  header The header name, e.g. "Content-Type".
+ * @param[out] value  The value, truncated to 'max' bytes.
+ * @param[in]  max    The size of 'value'.
+ * @return TRUE if the header is present.
+ */
+static bool mime_header (const char *p,
+                         const char *e,
+                         const char *header,
+                         char       *value,
+                         size_t      max)
+{
+ size_t header_length = strlen(header);
+
+ while (p < e) {
+   const char *nl = memchr(p, '\n', e - p);
+   if (nl == NULL)
+     nl = e;
+   if ((size_t)(nl - p) > header_length && p[header_length] == ':' &&
+       strncasecmp(p, header, header_length) == 0) {
+     size_t length = 0;
+     p += header_length + 1;
+     while (p < nl && (*p == ' ' || *p == '\t'))
+       p++;
+     for (;;) {
+       for (; p < nl; p++) {
+         if (*p != '\r' && length < max - 1)
+           value[length++] = (*p == '\t') ? ' ' : *p;
+       }
+       /* Continuation lines start with white space. */
+       if (nl + 1 >= e || (nl[1] != ' ' && nl[1] != '\t'))
+         break;
+       p  = nl + 1;
+       nl = memchr(p, '\n', e - p);
+       if (nl == NULL)
+         nl = e;
+     }
+     value[length] = '\0';
+     return TRUE;
+   }
+   p = nl + 1;
+ }
+ return FALSE;
+}
+
+/**
+ * Find a parameter of a structured header value, such as the 'boundary' of
+ * a Content-Type.
+ *
+ * @param[in]  value The header value.
+ * @param[in]  name  The parameter name.
+ * @param[out] param The parameter value, unquoted, truncated to 'max' bytes.
+ * @param[in]  max   The size of 'param'.
+ * @return TRUE if the parameter is present.
+ */
+static bool mime_param (const char *value,
+                        const char *name,
+                        char       *param,
+                        size_t      max)
+{
+ size_t      name_length = strlen(name);
+ const char *p           = strchr(value, ';');
+
+ while (p != NULL) {
+   p++;
+   while (*p == ' ')
+     p++;
+   if (strncasecmp(p, name, name_length) == 0 && p[name_length] == '=') {
+     size_t length = 0;
+     p += name_length + 1;
+     if (*p == '"') {
+       for (p++; *p != '\0' && *p != '"'; p++) {
+         if (*p == '\\' && p[1] != '\0')
+           p++;
+         if (length < max - 1)
+           param[length++] = *p;
+       }
+     }
+     else {
+       for (; *p != '\0' && *p != ';' && *p != ' '; p++) {
+         if (length < max - 1)
+           param[length++] = *p;
+       }
+     }
+     param[length] = '\0';
+     return length > 0;
+   }
+   p = strchr(p, ';');
+ }
+ return FALSE;
+}
+
+/**
+ * Decode (complete tokens of) a MIME part body.
+ *
+ * @param[in]  encoding   The content transfer encoding.
+ * @param[in]  in         The encoded data.
+ * @param[in]  in_length  The length of 'in'.
+ * @param[in]  at_end     Whether 'in' runs to the end of the body, so an
+ *                        incomplete token at the end is final.
+ * @param[out] out        The buffer to decode into, at least 'in_length'
+ *                        long, or NULL to just count.
+ * @param[out] p_consumed The number of bytes of 'in' decoded. The rest must
+ *                        be passed again, with more data.
+ * @return The number of bytes decoded.
+ */
+static size_t mime_decode (mime_encoding_t  encoding,
+                           const char      *in,
+                           size_t           in_length,
+                           bool             at_end,
+                           char            *out,
+                           size_t          *p_consumed)
+{
+ static const char base64[] =
+   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+ size_t            produced = 0;
+ size_t            consumed = 0;
+
+#define MIME_EMIT(BYTE) \
+  do { \
+    if (out != NULL) \
+      out[produced] = (char)(BYTE); \
+    produced++; \
+  } while (0)
+
+ if (encoding == MIME_ENCODING_BASE64) {
+   unsigned long quantum = 0;
+   int           n       = 0;
+   for (size_t i = 0; i < in_length; i++) {
+     const char *digit = (in[i] != '\0') ? strchr(base64, in[i]) : NULL;
+     if (digit != NULL) {
+       quantum = (quantum << 6) | (unsigned long)(digit - base64);
+       if (++n == 4) {
+         MIME_EMIT(quantum >> 16);
+         MIME_EMIT(quantum >> 8);
+         MIME_EMIT(quantum);
+         n        = 0;
+         quantum  = 0;
+         consumed = i + 1;
+       }
+     }
+     else if (in[i] == '=' && n >= 2) {
+       /* Padding ends the quantum early. */
+       if (n == 2) {
+         MIME_EMIT(quantum >> 4);
+       }
+       else {
+         MIME_EMIT(quantum >> 10);
+         MIME_EMIT(quantum >> 2);
+       }
+       n        = 0;
+       quantum  = 0;
+       consumed = i + 1;
+     }
+     /* Anything else, e.g. line breaks, is ignored. */
+   }
+ }
+ else if (encoding == MIME_ENCODING_QUOTED_PRINTABLE) {
+   size_t i = 0;
+   while (i < in_length) {
+     if (in[i] != '=') {
+       MIME_EMIT(in[i]);
+       consumed = ++i;
+       continue;
+     }
+
+     /* A soft line break: '=', optional white space, then a newline. */
+     size_t j = i + 1;
+     while (j < in_length && (in[j] == ' ' || in[j] == '\t' || in[j] == '\r'))
+       j++;
+     if (j == in_length && !at_end)
+       break;
+     if (j < in_length && in[j] == '\n') {
+       consumed = i = j + 1;
+       continue;
+     }
+
+     if (i + 2 >= in_length && !at_end)
+       break;
+     if (i + 2 < in_length &&
+         isxdigit((unsigned char)in[i + 1]) &&
+         isxdigit((unsigned char)in[i + 2])) {
+       char hex[3] = { in[i + 1], in[i + 2], '\0' };
+       MIME_EMIT(strtoul(hex, NULL, 16));
+       i += 3;
+     }
+     else {
+       /* Not valid, pass it through. */
+       MIME_EMIT('=');
+       i++;
+     }
+     consumed = i;
+   }
+ }
+ else {
+   if (out != NULL)
+     memcpy(out, in, in_length);
+   produced = consumed = in_length;
+ }
+
+#undef MIME_EMIT
+
+ *p_consumed = at_end ? in_length : consumed;
+ return produced;
+}
+
+/**
+ * Free a MIME structure index.
+ *
+ * @param[in] p_index The index, with no references left.
+ */
+static void mime_index_free (mime_index_t *p_index)
+{
+ assert(p_index->refs == 0);
+
+ for (size_t i = 0; i < p_index->n_parts; i++)
+   free(p_index->parts[i].name);
+ free(p_index->parts);
+ free(p_index->fname);
+ free(p_index);
+}
+
+/**
+ * Add the leaf parts of a MIME entity to an index.
+ *
+ * @param[in,out] p_index The index.
+ * @param[in]     base    The message file content.
+ * @param[in]     start   The offset of the entity in 'base'.
+ * @param[in]     end     The end offset of the entity in 'base'.
+ * @param[in]     depth   The multipart nesting depth of the entity.
+ */
+static void mime_index_entity (mime_index_t *p_index,
+                               const char   *base,
+                               off_t         start,
+                               off_t         end,
+                               int           depth)
+{
+ const char *p    = base + start;
+ const char *e    = base + end;
+ const char *body = mime_body_start(p, e);
+ char        content_type[1024];
+ char        boundary[256];
+
+ if (!mime_header(p, body, "Content-Type", content_type,
+                  sizeof(content_type)))
+   content_type[0] = '\0';
+
+ if (strncasecmp(content_type, "multipart/", 10) == 0 &&
+     depth < MIME_MAX_DEPTH &&
+     mime_param(content_type, "boundary", boundary, sizeof(boundary))) {
+   size_t      boundary_length = strlen(boundary);
+   const char *part_start      = NULL;
+   const char *line            = body;
+
+   while (line < e) {
+     const char *nl = memchr(line, '\n', e - line);
+     const char *next = (nl != NULL) ? nl + 1 : e;
+
+     if ((size_t)(e - line) >= boundary_length + 2 &&
+         line[0] == '-' && line[1] == '-' &&
+         memcmp(line + 2, boundary, boundary_length) == 0) {
+       bool closing = ((size_t)(e - line) >= boundary_length + 4 &&
+                       line[boundary_length + 2] == '-' &&
+                       line[boundary_length + 3] == '-');
+       if (part_start != NULL) {
+         /* The line break before the boundary belongs to the boundary. */
+         const char *part_end = line;
+         if (part_end > part_start && part_end[-1] == '\n')
+           part_end--;
+         if (part_end > part_start && part_end[-1] == '\r')
+           part_end--;
+         mime_index_entity(p_index, base, part_start - base,
+                           part_end - base, depth + 1);
+       }
+       if (closing)
+         return;
+       part_start = next;
+     }
+     line = next;
+   }
+   /* No closing boundary, the last part runs to the end. */
+   if (part_start != NULL)
+     mime_index_entity(p_index, base, part_start - base, end, depth + 1);
+   return;
+ }
+
+ mime_part_t part;
+ char        value[256];
+ char        filename[NAME_MAX - 16];
+ part.start    = body - base;
+ part.end      = end;
+ part.encoding = MIME_ENCODING_NONE;
+ if (mime_header(p, body, "Content-Transfer-Encoding", value,
+                 sizeof(value))) {
+   if (strncasecmp(value, "base64", 6) == 0)
+     part.encoding = MIME_ENCODING_BASE64;
+   else if (strncasecmp(value, "quoted-printable", 16) == 0)
+     part.encoding = MIME_ENCODING_QUOTED_PRINTABLE;
+ }
+
+ size_t consumed;
+ part.size = mime_decode(part.encoding, body, e - body, TRUE, NULL,
+                         &consumed);
+
+ filename[0] = '\0';
+ if ((!mime_header(p, body, "Content-Disposition", value, sizeof(value)) ||
+      !mime_param(value, "filename", filename, sizeof(filename))) &&
+     !mime_param(content_type, "name", filename, sizeof(filename)))
+   filename[0] = '\0';
+ for (char *c = filename; *c != '\0'; c++) {
+   /* Keep it a single, printable, path component. */
+   if (*c == '/' || (unsigned char)*c < ' ')
+     *c = '_';
+ }
+
+ char name[NAME_MAX];
+ if (filename[0] != '\0')
+   snprintf(name, sizeof(name), "%zu-%s", p_index->n_parts + 1, filename);
+ else
+   snprintf(name, sizeof(name), "%zu", p_index->n_parts + 1);
+ part.name = strdup(name);
+
+ p_index->parts = realloc(p_index->parts,
+                          (p_index->n_parts + 1) * sizeof(mime_part_t));
+ p_index->parts[p_index->n_parts++] = part;
+}
+
+/**
+ * Build the MIME structure index of a message file.
+ *
+ * @param[in]  fname     The real file name of the message.
+ * @param[out] pp_index  The index, with one reference held by the caller.
+ * @return 0 on success, or a negative errno.
+ */
+static int mime_index_build (const char *fname, mime_index_t **pp_index)
+{
+ int fd = open(fname, O_RDONLY);
+ if (fd == -1)
+   return -errno;
+
+ struct stat st;
+ if (fstat(fd, &st) != 0) {
+   int err = errno;
+   close(fd);
+   return -err;
+ }
+
+ /* The parts of compressed messages aren't offered, as they'd have to be
+  * read from the decompressed content.
+  */
+ const char *base = NULL;
+ if (st.st_size > 0 && compression_detect(fd) == COMPRESSION_NONE) {
+   base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (base == MAP_FAILED) {
+     int err = errno;
+     close(fd);
+     return -err;
+   }
+ }
+ close(fd);
+
+ mime_index_t *p_index = malloc(sizeof(mime_index_t));
+ memset(p_index, 0, sizeof(mime_index_t));
+ p_index->fname = strdup(fname);
+ p_index->refs  = 1;
+ if (base != NULL) {
+   mime_index_entity(p_index, base, 0, st.st_size, 0);
+   munmap((void *)base, st.st_size);
+ }
+
+ LOG_TRACE("mime_index_build(%s) %zu parts\n", fname, p_index->n_parts);
+ *pp_index = p_index;
+ return 0;
+}
+
+/**
+ * Find the MIME structure index of a message, building it if it isn't
+ * cached.
+ *
+ * @param[in,out] p_ctx    The notmuch context.
+ * @param[in]     fname    The real file name of the message.
+ * @param[out]    pp_index The index, with a reference held by the caller.
+ * @return 0 on success, or a negative errno.
+ */
+static int mime_index_get (notmuch_context_t  *p_ctx,
+                           const char         *fname,
+                           mime_index_t      **pp_index)
+{
+ mime_cache_t *p_cache = &p_ctx->mime_cache;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ *pp_index = strmap_get(&p_cache->indexes, fname);
+ if (*pp_index != NULL)
+   (*pp_index)->refs++;
+ PTHREAD_UNLOCK(&p_cache->mutex);
+ if (*pp_index != NULL)
+   return 0;
+
+ /* Build it without holding the lock. */
+ int res = mime_index_build(fname, pp_index);
+ if (res != 0)
+   return res;
+
+ PTHREAD_LOCK(&p_cache->mutex);
+ mime_index_t *p_old = p_cache->ring[p_cache->next];
+ if (p_old != NULL) {
+   if (strmap_get(&p_cache->indexes, p_old->fname) == p_old)
+     strmap_remove(&p_cache->indexes, p_old->fname);
+   if (--p_old->refs == 0)
+     mime_index_free(p_old);
+ }
+ p_cache->ring[p_cache->next] = *pp_index;
+ p_cache->next = (p_cache->next + 1) % MIME_CACHE_SIZE;
+ (*pp_index)->refs++;
+ strmap_put(&p_cache->indexes, fname, *pp_index);
+ PTHREAD_UNLOCK(&p_cache->mutex);
+ return 0;
+}
+
+/**
+ * Drop a reference to a MIME structure index, freeing it if it was the last
+ * one.
+ *
+ * @param[in,out] p_ctx   The notmuch context.
+ * @param[in]     p_index The index.
+ */
+static void mime_index_unref (notmuch_context_t *p_ctx, mime_index_t *p_index)
+{
+ PTHREAD_LOCK(&p_ctx->mime_cache.mutex);
+ assert(p_index->refs > 0);
+ if (--p_index->refs == 0)
+   mime_index_free(p_index);
+ PTHREAD_UNLOCK(&p_ctx->mime_cache.mutex);
+}
+
+/**
+ * Find a part of a message by its name in the '.parts/' directory.
+ *
+ * @param[in] p_index The MIME structure index of the message.
+ * @param[in] name    The name of the part.
+ * @return The part, or NULL if there's no such part.
+ */
+static const mime_part_t *mime_index_find (const mime_index_t *p_index,
+                                           const char         *name)
+{
+ /* Names start with the part number. */
+ char         *end;
+ unsigned long number = strtoul(name, &end, 10);
+
+ if (end == name || number == 0 || number > p_index->n_parts ||
+     strcmp(p_index->parts[number - 1].name, name) != 0)
+   return NULL;
+ return &p_index->parts[number - 1];
+}
+
+/**
+ * Free every cached MIME structure index.
+ *
+ * @param[in,out] p_ctx The notmuch context.
+ */
+static void mime_cache_clear (notmuch_context_t *p_ctx)
+{
+ mime_cache_t *p_cache = &p_ctx->mime_cache;
+
+ for (size_t i = 0; i < MIME_CACHE_SIZE; i++) {
+   mime_index_t *p_index = p_cache->ring[i];
+   if (p_index != NULL && --p_index->refs == 0)
+     mime_index_free(p_index);
+   p_cache->ring[i] = NULL;
+ }
+ strmap_destroy(&p_cache->indexes, NULL);
+}
+
+/*============================================================================*/
+
+/**
+ * An open MIME part, decoded as it's read.
+ */
+typedef struct
+{
+ /** Serializes reads, which share the decoding state. */
+ pthread_mutex_t mutex;
+ /** The open message file. */
+ int             fd;
+ /** The part. Its 'name' isn't set. */
+ mime_part_t     part;
+ /** The offset in the message file of the next data to decode. */
+ off_t           in_pos;
+ /** The decoded data, and its offset in the decoded part. */
+ char           *window;
+ size_t          window_length;
+ off_t           window_start;
+ /** The encoded data being decoded. */
+ char           *raw;
+ /** The size of 'raw' and 'window', grown while a window of encoded data
+  * holds no complete token.
+  */
+ size_t          raw_size;
+} mime_reader_t;
+
+/**
+ * Free an open MIME part.
+ *
+ * @param[in] p_reader The open part.
+ */
+static void mime_reader_free (mime_reader_t *p_reader)
+{
+ close(p_reader->fd);
+ free(p_reader->window);
+ free(p_reader->raw);
+ pthread_mutex_destroy(&p_reader->mutex);
+ free(p_reader);
+}
+
+/**
+ * Read from an open MIME part. Sequential reads decode the part once,
+ * reading backwards starts decoding again.
+ *
+ * @param[in,out] p_reader The open part.
+ * @param[out]    buf      The buffer to fill.
+ * @param[in]     size     The number of bytes to read.
+ * @param[in]     offset   The offset in the decoded part to read from.
+ * @return The number of bytes read, or a negative errno.
+ */
+static int mime_reader_read (mime_reader_t *p_reader,
+                             char          *buf,
+                             size_t         size,
+                             off_t          offset)
+{
+ const mime_part_t *p_part = &p_reader->part;
+
+ if (offset >= p_part->size)
+   return 0;
+ size = MIN(size, (size_t)(p_part->size - offset));
+
+ if (p_part->encoding == MIME_ENCODING_NONE) {
+   ssize_t bytes_read = pread(p_reader->fd, buf, size, p_part->start + offset);
+   return (bytes_read == -1) ? -errno : (int)bytes_read;
+ }
+
+ int    res    = 0;
+ size_t copied = 0;
+ PTHREAD_LOCK(&p_reader->mutex);
+ while (copied < size) {
+   off_t want = offset + copied;
+   if (want < p_reader->window_start) {
+     /* Start again. */
+     p_reader->in_pos        = p_part->start;
+     p_reader->window_start  = 0;
+     p_reader->window_length = 0;
+   }
+
+   off_t window_end = p_reader->window_start + p_reader->window_length;
+   if (want < window_end) {
+     size_t bytes_to_copy = MIN(size - copied, (size_t)(window_end - want));
+     memcpy(buf + copied, p_reader->window + (want - p_reader->window_start),
+            bytes_to_copy);
+     copied += bytes_to_copy;
+     continue;
+   }
+
+   /* Decode the next window. */
+   size_t  raw_length = MIN(p_reader->raw_size,
+                            (size_t)(p_part->end - p_reader->in_pos));
+   ssize_t bytes_read = pread(p_reader->fd, p_reader->raw, raw_length,
+                              p_reader->in_pos);
+   if (bytes_read == -1) {
+     res = -errno;
+     break;
+   }
+   size_t consumed;
+   bool   at_end = ((size_t)bytes_read < raw_length ||
+                    p_reader->in_pos + bytes_read == p_part->end);
+   p_reader->window_start  = window_end;
+   p_reader->window_length = mime_decode(p_part->encoding, p_reader->raw,
+                                         bytes_read, at_end, p_reader->window,
+                                         &consumed);
+   p_reader->in_pos += consumed;
+   if (p_reader->window_length == 0 && at_end)
+     break;
+   if (consumed == 0 && !at_end) {
+     /* No complete token, e.g. a long run of junk in base64, so decode a
+      * bigger window.
+      */
+     p_reader->raw_size *= 2;
+     p_reader->raw       = realloc(p_reader->raw, p_reader->raw_size);
+     p_reader->window    = realloc(p_reader->window, p_reader->raw_size);
+   }
+ }
+ PTHREAD_UNLOCK(&p_reader->mutex);
+
+ return (copied > 0) ? (int)copied : res;
+}
+
+/*============================================================================*/
+
+/* FUSE operations. */
+
+/** The maximum length of the tag exclusion string. Arbitrarily chosen. */
+#define EXCLUDED_TAGS_MAX_LENGTH 128
+
+static void *notmuchfs_init (struct fuse_conn_info *conn)
+{
+ (void)conn;
+
+ int res = chdir(global_config.backing_dir);
+ if (res == -1)
+   return NULL;
+
+ notmuch_context_t *p_ctx = malloc(sizeof(notmuch_context_t));
+ memset(p_ctx, 0, sizeof(notmuch_context_t));
+ res = pthread_mutex_init(&p_ctx->write_mutex, NULL);
+ if (res != 0) {
+   free(p_ctx);
+   return NULL;
+ }
+
+ res = pthread_mutex_init(&p_ctx->cache.mutex, NULL);
+ if (res != 0) {
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+ strmap_init(&p_ctx->cache.listings);
+ strmap_init(&p_ctx->cache.streams);
+ strmap_init(&p_ctx->cache.xlabels);
+ pthread_cond_init(&p_ctx->cache.streamed, NULL);
+
+ res = negcache_init(p_ctx);
+ if (res != 0) {
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+
+ res = pthread_mutex_init(&p_ctx->mime_cache.mutex, NULL);
+ if (res != 0) {
+   negcache_destroy(p_ctx);
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+ strmap_init(&p_ctx->mime_cache.indexes);
+
+ res = pthread_mutex_init(&p_ctx->plain_cache.mutex, NULL);
+ if (res != 0) {
+   pthread_mutex_destroy(&p_ctx->mime_cache.mutex);
+   negcache_destroy(p_ctx);
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+ strmap_init(&p_ctx->plain_cache.messages);
+ strmap_init(&p_ctx->plain_cache.sizes);
+
+ res = tagindex_init(&p_ctx->tagindex);
+ if (res != 0) {
+   plain_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->plain_cache.mutex);
+   mime_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->mime_cache.mutex);
+   negcache_destroy(p_ctx);
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+
+ res = pthread_mutex_init(&p_ctx->choices.mutex, NULL);
+ if (res != 0) {
+   tagindex_destroy(&p_ctx->tagindex);
+   plain_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->plain_cache.mutex);
+   mime_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->mime_cache.mutex);
+   negcache_destroy(p_ctx);
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+ strmap_init(&p_ctx->choices.fnames);
+
+ res = writer_start(p_ctx);
+ if (res != 0) {
+   fprintf(stderr, "ERROR: Can't start writer thread: %s.\n", strerror(res));
+   strmap_destroy(&p_ctx->choices.fnames, free);
+   pthread_mutex_destroy(&p_ctx->choices.mutex);
+   tagindex_destroy(&p_ctx->tagindex);
+   plain_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->plain_cache.mutex);
+   mime_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->mime_cache.mutex);
+   negcache_destroy(p_ctx);
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+
+ res = pool_start(p_ctx);
+ if (res != 0) {
+   fprintf(stderr, "ERROR: Can't start worker pool: %s.\n", strerror(res));
+   writer_stop(p_ctx);
+   strmap_destroy(&p_ctx->choices.fnames, free);
+   pthread_mutex_destroy(&p_ctx->choices.mutex);
+   tagindex_destroy(&p_ctx->tagindex);
+   plain_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->plain_cache.mutex);
+   mime_cache_clear(p_ctx);
+   pthread_mutex_destroy(&p_ctx->mime_cache.mutex);
+   negcache_destroy(p_ctx);
+   strmap_destroy(&p_ctx->cache.listings, NULL);
+   strmap_destroy(&p_ctx->cache.xlabels, free);
+   pthread_cond_destroy(&p_ctx->cache.streamed);
+   pthread_mutex_destroy(&p_ctx->cache.mutex);
+   pthread_mutex_destroy(&p_ctx->write_mutex);
+   free(p_ctx);
+   return NULL;
+ }
+
+ /* Fetch the list of excluded tags from notmuch config.
+  * If only there was an API for this...
+  */
+ p_ctx->excluded_tags = malloc(EXCLUDED_TAGS_MAX_LENGTH);
+ p_ctx->excluded_tags[0] = '\0';
+ FILE *fp = popen("notmuch config get search.exclude_tags", "r");
+ if (fp != NULL) {
+   size_t bytes_read = fread(p_ctx->excluded_tags, 1, EXCLUDED_TAGS_MAX_LENGTH,
+                             fp);
+   if (bytes_read > 0) {
+     p_ctx->excluded_tags[bytes_read - 1] = '\0';
+   }
+   (void)pclose(fp);
+ }
+
+ p_ctx->watcher.inotify_fd = -1;
+ watcher_start(p_ctx);
+
+ return p_ctx;
+}
+
+/*============================================================================*/
+
+static void notmuchfs_destroy (void *p_ctx_in)
+{
+ notmuch_context_t *p_ctx = (notmuch_context_t *)p_ctx_in;
+
+ /* Let any listings being streamed finish. */
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ while (p_ctx->cache.streams.count > 0)
+   pthread_cond_wait(&p_ctx->cache.streamed, &p_ctx->cache.mutex);
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+
+ watcher_stop(p_ctx);
+
+ /* Flush any updates still queued. */
+ writer_stop(p_ctx);
+ pool_stop(p_ctx);
+
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ cache_clear_locked(&p_ctx->cache);
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+ strmap_destroy(&p_ctx->cache.listings, NULL);
+ strmap_destroy(&p_ctx->cache.streams, NULL);
+ strmap_destroy(&p_ctx->cache.xlabels, free);
+ free(p_ctx->cache.uuid);
+ pthread_cond_destroy(&p_ctx->cache.streamed);
+ int res = pthread_mutex_destroy(&p_ctx->cache.mutex);
+ assert(res == 0);
+
+ negcache_destroy(p_ctx);
+
+ mime_cache_clear(p_ctx);
+ res = pthread_mutex_destroy(&p_ctx->mime_cache.mutex);
+ assert(res == 0);
+
+ plain_cache_clear(p_ctx);
+ res = pthread_mutex_destroy(&p_ctx->plain_cache.mutex);
+ assert(res == 0);
+
+ tagindex_destroy(&p_ctx->tagindex);
+
+ strmap_destroy(&p_ctx->choices.fnames, free);
+ res = pthread_mutex_destroy(&p_ctx->choices.mutex);
+ assert(res == 0);
+
+ free(p_ctx->excluded_tags);
+ res = pthread_mutex_destroy(&p_ctx->write_mutex);
+ /* Any failure here is a problem that we caused. */
+ assert(res == 0);
+
+ free(p_ctx);
+}
+
+/*============================================================================*/
+
+static int notmuchfs_getattr (const char *path, struct stat *stbuf)
+{
+ int res = 0;
+
+ memset(stbuf, 0, sizeof(struct stat));
+
+ if (strcmp(path, "/") == 0) {
+   /* Querying the base directory, pass to backing store. */
+   if (stat(".", stbuf) != 0)
+     res = -errno;
+   return res;
+ }
+
+ char         query_dir[PATH_MAX];
+ const char  *query_arg;
+ query_file_t type        = split_query_file_path(path, query_dir,
+                                                  &query_arg);
+ char        *last_slash  = strrchr(path + 1, '/');
+ if (type != QUERY_FILE_NONE) {
+   /* Querying a virtual query file (or the stats file). It's generated when
+    * opened, so the size isn't known.
+    */
+   if (stat(query_dir[0] != '\0' ? query_dir : ".", stbuf) != 0)
+     return -errno;
+   stbuf->st_ino   = VIRTUAL_INO(stbuf->st_ino, type);
+   stbuf->st_mode  = S_IFREG | (stbuf->st_mode & 0444);
+   stbuf->st_nlink = 1;
+   stbuf->st_size  = 0;
+ }
+ else if (is_query_dir_path(path)) {
+   /* Querying '/<query>' (or a nested '/<query>/<query>'), pass to backing
+    * store.
+    */
+   LOG_TRACE("getattr stat1: %s\n", path + 1);
+   if (lstat(path + 1, stbuf) != 0)
+     res = -errno;
+ }
+ else if (strcmp(last_slash + 1, "new") == 0 ||
+          strcmp(last_slash + 1, "tmp") == 0 ||
+          strcmp(last_slash + 1, "cur") == 0 ||
+          strcmp(last_slash + 1, HEADER_VIEW_DIR) == 0) {
+   /* Querying a maildir directory (or the headers-only view), so copy the
+    * parent directory.
+    */
+   char trans_name[PATH_MAX];
+   strncpy(trans_name, path + 1, last_slash - path);
+   trans_name[last_slash - path] = '\0';
+   LOG_TRACE("getattr stat2: %s\n", trans_name);
+   if (stat(trans_name, stbuf) != 0)
+     res = -errno;
+   /* They differ in their first letter. */
+   stbuf->st_ino = VIRTUAL_INO(stbuf->st_ino, last_slash[1]);
+
+   if (res == 0 && strcmp(last_slash + 1, "tmp") != 0) {
+     /* Make the mtime of cur/ and new/ show when the query results last
+      * changed, so MUAs can notice new mail without listing them.
+      */
+     struct fuse_context *p_fuse_ctx = fuse_get_context();
+     notmuch_context_t   *p_ctx      =
+       (notmuch_context_t *)p_fuse_ctx->private_data;
+
+     trans_name[last_slash - path - 1] = '\0';
+     if (resolve_query(trans_name) == 0) {
+       time_t changed = cache_changed_time(p_ctx, trans_name);
+       if (changed > stbuf->st_mtime) {
+         stbuf->st_mtime = changed;
+         stbuf->st_ctime = MAX(stbuf->st_ctime, changed);
+       }
+     }
+   }
+ }
+ else if (split_parts_path(path, query_dir, &query_arg) !=
+          PARTS_PATH_NONE) {
+   /* '/<query>/cur/translated#msg#name.parts[/part]', 'query_dir' being
+    * the real file name.
+    */
+   LOG_TRACE("getattr stat6: %s\n", query_dir);
+   if (stat(query_dir, stbuf) != 0)
+     return -errno;
+
+   if (query_arg == NULL) {
+     stbuf->st_ino   = VIRTUAL_INO(stbuf->st_ino, 'p');
+     stbuf->st_mode  = S_IFDIR | (stbuf->st_mode & 0444) |
+                       ((stbuf->st_mode & 0444) >> 2);
+     stbuf->st_nlink = 2;
+     stbuf->st_size  = 0;
+   }
+   else {
+     struct fuse_context *p_fuse_ctx = fuse_get_context();
+     notmuch_context_t   *p_ctx      =
+       (notmuch_context_t *)p_fuse_ctx->private_data;
+
+     mime_index_t *p_index;
+     res = mime_index_get(p_ctx, query_dir, &p_index);
+     if (res != 0)
+       return res;
+     const mime_part_t *p_part = mime_index_find(p_index, query_arg);
+     if (p_part == NULL) {
+       res = -ENOENT;
+     }
+     else {
+       /* Part numbers beyond 127 share inode numbers. */
+       stbuf->st_ino   = VIRTUAL_INO(stbuf->st_ino,
+                                     0x80 | ((p_part - p_index->parts) & 0x7f));
+       stbuf->st_mode  = S_IFREG | (stbuf->st_mode & 0444);
+       stbuf->st_nlink = 1;
+       stbuf->st_size  = p_part->size;
+     }
+     mime_index_unref(p_ctx, p_index);
+   }
+ }
+ else if (header_view_name(path) != NULL) {
+   /* '/<query>/hdr/translated#msg#name' */
+   char trans_name[PATH_MAX];
+   strncpy(trans_name, header_view_name(path), PATH_MAX - 1);
+   trans_name[PATH_MAX - 1] = '\0';
+   string_replace(trans_name, '#', '/');
+
+   struct fuse_context *p_fuse_ctx = fuse_get_context();
+   notmuch_context_t   *p_ctx      =
+     (notmuch_context_t *)p_fuse_ctx->private_data;
+
+   if (writer_is_pending_delete(p_ctx, trans_name))
+     return -ENOENT;
+
+   LOG_TRACE("getattr stat5: %s\n", trans_name);
+   int fd = open(trans_name, O_RDONLY);
+   if (fd == -1 || fstat(fd, stbuf) != 0) {
+     res = -errno;
+   }
+   else {
+     off_t length;
+     res = cache_header_length(p_ctx, header_view_name(path), trans_name, fd,
+                               &length);
+     stbuf->st_size = XLABEL_LENGTH + length;
+   }
+   if (fd != -1)
+     close(fd);
+ }
+ else {
+   /* '/<query>/cur/translated#msg#name' */
+   bool mutt_2476_workaround = FALSE;
+
+   char        query[PATH_MAX];
+   char        subdir[4];
+   const char *name;
+   if (split_message_path(path, query, subdir, &name) &&
+       strchr(name, '#') == NULL) {
+     /* '/<query>/tmp/name', a message being delivered (or just delivered, if
+      * 'cur' or 'new').
+      */
+     char real_name[PATH_MAX];
+     res = deliver_path(real_name, subdir, name);
+     if (res == 0) {
+       LOG_TRACE("getattr stat4: %s\n", real_name);
+       if (stat(real_name, stbuf) != 0)
+         res = -errno;
+     }
+     else {
+       res = -ENOENT;
+     }
+     return res;
+   }
+
+   if (global_config.mutt_2476_workaround_allowed) {
+     /* The workaround here is to intercept all getattr()s of a path like:
+      *   /real/path/new/fake#maildir#cur#foofile
+      * and treat it as if 'new' was 'cur' thus:
+      *   /real/path/cur/fake#maildir#cur#foofile
+      */
+
+     if ((last_slash - path) >= 3 &&
+         memcmp(last_slash - 3, "new", 3) == 0) {
+       LOG_TRACE("Activating mutt_bug_2476 workaround for getattr(%s)\n", path);
        mutt_2476_workaround = TRUE;
      }
    }
 
    if (mutt_2476_workaround ||
-       (last_slash - first_slash > 3 &&
-        strncmp(first_slash, "/cur/", 5) == 0)) {
+       (last_slash - path > 4 && memcmp(last_slash - 4, "/cur", 4) == 0)) {
      char trans_name[PATH_MAX];
      strncpy(trans_name, last_slash + 1, PATH_MAX - 1);
      trans_name[PATH_MAX - 1] = '\0';
      string_replace(trans_name, '#', '/');
 
+     struct fuse_context *p_fuse_ctx = fuse_get_context();
+     notmuch_context_t   *p_ctx      =
+       (notmuch_context_t *)p_fuse_ctx->private_data;
+
+     if (writer_is_pending_delete(p_ctx, trans_name))
+       return -ENOENT;
+
+     /* Usually readdir() has just got the attributes. */
+     res = cache_stat(p_ctx, last_slash + 1, stbuf);
+     if (res != 1)
+       return res;
+     res = 0;
+
      LOG_TRACE("getattr stat3: %s\n", trans_name);
-     if (stat(trans_name, stbuf) != 0)
+     if (negcache_lookup(p_ctx, trans_name))
+       return -ENOENT;
+     if (message_stat(p_ctx, trans_name, stbuf) != 0) {
        res = -errno;
+       if (res == -ENOENT)
+         negcache_insert(p_ctx, trans_name);
+     }
 
      /* Inflate the size of the file by the maximum length of a synthetic
       * X-Label header.
       */
-     stbuf->st_size += MAX_XLABEL_LENGTH;
+     stbuf->st_size += XLABEL_LENGTH;
    }
    else {
      res = -ENOENT;
@@ -401,7 +7459,9 @@ typedef enum
  /** A real directory in the backing store. */
  OPENDIR_TYPE_BACKING_DIR,
  /** A maildir with message files taken from a notmuch query. */
- OPENDIR_TYPE_NOTMUCH_QUERY
+ OPENDIR_TYPE_NOTMUCH_QUERY,
+ /** The MIME parts of a message. */
+ OPENDIR_TYPE_MIME_PARTS
 } opendir_type_t;
 
 
@@ -412,18 +7472,25 @@ typedef struct
 {
  opendir_type_t      type;
 
+ /** This is for type == OPENDIR_TYPE_NOTMUCH_QUERY. */
+ listing_t          *p_listing;
  /**
-  * These are for type == OPENDIR_TYPE_NOTMUCH_QUERY.
-  * @{
+  * Where the last readdir() stopped in the listing's packed entries: the
+  * offset it will continue from, and the position of the next record, if
+  * they're still packed as of 'resume_generation'.
   */
- notmuch_query_t    *p_query;
- notmuch_messages_t *p_messages;
- /** @} */
+ off_t               resume_offset;
+ size_t              resume_pos;
+ unsigned long       resume_generation;
 
- /** This is for type == OPENDIR_TYPE_BACKING_DIR. */
+ /**
+  * This is for type == OPENDIR_TYPE_BACKING_DIR, and
+  * OPENDIR_TYPE_MAIL_DIR (for nested query directories, may be NULL).
+  */
  DIR                *fd;
 
- off_t               next_offset;
+ /** This is for type == OPENDIR_TYPE_MIME_PARTS. */
+ mime_index_t       *p_index;
 } opendir_t;
 
 /*============================================================================*/
@@ -446,11 +7513,24 @@ static int notmuchfs_opendir (const char* path, struct fuse_file_info* fi)
    dir_fd->fd = opendir(trans_name);
  }
  else {
-   char *last_slash = strrchr(path + 1, '/');
-   if (last_slash == NULL) {
-     /* Listing '/<query>', so return the 3 maildir dirs. */
+   char        filename[PATH_MAX];
+   const char *part;
+   char       *last_slash = strrchr(path + 1, '/');
+   if (split_parts_path(path, filename, &part) == PARTS_PATH_DIR) {
+     /* Listing '/<query>/cur/<name>.parts', so index the message. */
+     struct fuse_context *p_fuse_ctx = fuse_get_context();
+     notmuch_context_t *p_ctx = (notmuch_context_t *)p_fuse_ctx->private_data;
+
+     dir_fd->type = OPENDIR_TYPE_MIME_PARTS;
+     res = mime_index_get(p_ctx, filename, &dir_fd->p_index);
+   }
+   else if (is_query_dir_path(path)) {
+     /* Listing '/<query>', so return the 3 maildir dirs, and any query
+      * directories nested in it.
+      */
      LOG_TRACE("opendir fake maildir: %s\n", path);
      dir_fd->type = OPENDIR_TYPE_MAIL_DIR;
+     dir_fd->fd   = opendir(path + 1);
    }
    else if (strcmp(last_slash + 1, "new") == 0 ||
             strcmp(last_slash + 1, "tmp") == 0) {
@@ -458,69 +7538,64 @@ static int notmuchfs_opendir (const char* path, struct fuse_file_info* fi)
      LOG_TRACE("opendir fake empty new/, tmp/ maildir: %s\n", path);
      dir_fd->type = OPENDIR_TYPE_EMPTY_DIR;
    }
-   else if (strcmp(last_slash + 1, "cur") == 0) {
-     /* Listing '/<query>/cur', so parse the query from the pathname, and
-      * execute it to get the iterator, and remember it.
+   else if (strcmp(last_slash + 1, "cur") == 0 ||
+            strcmp(last_slash + 1, HEADER_VIEW_DIR) == 0) {
+     /* Listing '/<query>/cur' (or the headers-only view of it), so parse the
+      * query from the pathname, and execute it to get the iterator, and
+      * remember it.
       */
-     dir_fd->type = OPENDIR_TYPE_NOTMUCH_QUERY;
-     char trans_name[PATH_MAX];
-     strncpy(trans_name, path + 1, last_slash - path - 1);
-     trans_name[last_slash - path - 1] = '\0';
+     dir_fd->type          = OPENDIR_TYPE_NOTMUCH_QUERY;
+     dir_fd->resume_offset = -1;
+     char dir_name[PATH_MAX];
+     strncpy(dir_name, path + 1, last_slash - path - 1);
+     dir_name[last_slash - path - 1] = '\0';
 
-     /* If it's a symlink, dereference it. */
-     struct stat stbuf;
-     while (res == 0) {
-       LOG_TRACE("opendir stat(%s)\n", trans_name);
-       if (lstat(trans_name, &stbuf) == 0 &&
-           S_ISLNK(stbuf.st_mode)) {
-         char link_name[PATH_MAX + 1];
-         LOG_TRACE("opendir dereference symlink %s for query\n", trans_name);
-         res = readlink(trans_name, link_name, PATH_MAX);
-         if (res >= 0) {
-           link_name[res] = '\0';
-           memcpy(trans_name, link_name, res + 1);
-           res = 0;
-         }
-         else
-           res = -errno;
-       }
-       else
-         break;
+     char trans_name[PATH_MAX];
+     memcpy(trans_name, dir_name, last_slash - path);
+     res = resolve_query(trans_name);
+     if (res != 0) {
+       free(dir_fd);
+       return res;
      }
 
      LOG_TRACE("opendir notmuch query: '%s'\n", trans_name);
 
      struct fuse_context *p_fuse_ctx = fuse_get_context();
      notmuch_context_t *p_ctx = (notmuch_context_t *)p_fuse_ctx->private_data;
-     database_open(p_ctx, FALSE);
-
-     dir_fd->next_offset = 1;
-     dir_fd->p_query = notmuch_query_create(p_ctx->db, trans_name);
-     if (dir_fd->p_query != NULL) {
-       /* Exclude messages that match the 'excluded' tags. */
-       char *exclude_tag = strtok(p_ctx->excluded_tags, "\n");
-       while (exclude_tag != NULL) {
-         notmuch_query_add_tag_exclude(dir_fd->p_query, exclude_tag);
-         exclude_tag = strtok(NULL, "\n");
-       }
-       notmuch_query_set_omit_excluded(dir_fd->p_query, NOTMUCH_EXCLUDE_ALL);
 
-       /* Run the query. */
-       notmuch_status_t status =
-         notmuch_query_search_messages(dir_fd->p_query, &dir_fd->p_messages);
-       if (status != NOTMUCH_STATUS_SUCCESS) {
-         notmuch_query_destroy(dir_fd->p_query);
-         dir_fd->p_query = NULL;
-         database_close(p_ctx);
-         res = -EIO;
-       }
-       else {
-         /* On success, the database is left open here. */
-       }
+     /* Use the cached listing if the query results can't have changed (or
+      * the policy says it will do for now), otherwise run the query now.
+      */
+     listing_policy_t policy;
+     bool             stale;
+     policy_read(dir_name, &policy);
+     dir_fd->p_listing = cache_lookup(p_ctx, trans_name, &policy, &stale);
+     if (stale)
+       watcher_kick(p_ctx);
+     if (dir_fd->p_listing == NULL) {
+       /* A nested query directory is usually opened after its parent. */
+       dir_fd->p_listing = cache_refine(p_ctx, dir_name, trans_name);
+       if (dir_fd->p_listing != NULL)
+         cache_publish(p_ctx, dir_fd->p_listing);
      }
-     else {
-       database_close(p_ctx);
-       res = -EIO;
+     if (dir_fd->p_listing == NULL && global_config.stream_listings &&
+         !global_config.sort_by_inode) {
+       /* Return now, and list the messages as the query finds them. */
+       dir_fd->p_listing = cache_stream(p_ctx, trans_name);
+     }
+     if (dir_fd->p_listing == NULL) {
+       listing_build_job_t job = { trans_name, NULL };
+       res = pool_run(p_ctx, POOL_CLASS_LIST, FALSE, listing_build_job, &job);
+       dir_fd->p_listing = job.p_listing;
+       if (res == 0)
+         cache_publish(p_ctx, dir_fd->p_listing);
+     }
+
+     if (res == 0) {
+       PTHREAD_LOCK(&p_ctx->cache.mutex);
+       listing_add_dir_locked(dir_fd->p_listing, dir_name);
+       dir_fd->p_listing->policy = policy;
+       PTHREAD_UNLOCK(&p_ctx->cache.mutex);
      }
    }
    else {
@@ -549,88 +7624,27 @@ static int notmuchfs_releasedir (const char *path, struct fuse_file_info *fi)
  opendir_t *dir_fd = (opendir_t *)(uintptr_t)fi->fh;
  if (dir_fd != NULL) {
    if (dir_fd->type == OPENDIR_TYPE_NOTMUCH_QUERY) {
-     if (dir_fd->p_messages != NULL)
-       notmuch_messages_destroy(dir_fd->p_messages);
-     if (dir_fd->p_query != NULL)
-       notmuch_query_destroy(dir_fd->p_query);
-
      struct fuse_context *p_fuse_ctx = fuse_get_context();
      notmuch_context_t *p_ctx = (notmuch_context_t *)p_fuse_ctx->private_data;
-     database_close(p_ctx);
+     listing_unref(p_ctx, dir_fd->p_listing);
    }
-   else if (dir_fd->type == OPENDIR_TYPE_BACKING_DIR) {
+   else if (dir_fd->type == OPENDIR_TYPE_MIME_PARTS) {
+     struct fuse_context *p_fuse_ctx = fuse_get_context();
+     notmuch_context_t *p_ctx = (notmuch_context_t *)p_fuse_ctx->private_data;
+     mime_index_unref(p_ctx, dir_fd->p_index);
+   }
+   else if (dir_fd->type == OPENDIR_TYPE_BACKING_DIR ||
+            (dir_fd->type == OPENDIR_TYPE_MAIL_DIR && dir_fd->fd != NULL)) {
      int ret = closedir(dir_fd->fd);
      /* The only possible error value is EBADF, which would be a programming
       * error.
       */
      assert(ret == 0);
    }
-   free(dir_fd);
-   dir_fd = NULL;
- }
- return 0;
-}
-
-/*============================================================================*/
-
-/**
- * Adds an entry to a readdir() buffer with a maildir file, representing the
- * given notmuch messages.
- *
- * @param[in,out] dir_fd    The opendir context.
- * @param[in]     p_message The notmuch message to add to the directory
- *                          listing.
- * @param[in,out] buf       The readdir() buffer.
- * @param[in]     filler    The filler function.
- *
- * @return A negative errno on error, 0 on success, #INT_MAX if the
- *         directory is too full to add this message.
- */
-static int fill_dir_with_message (opendir_t         *dir_fd,
-                                  notmuch_message_t *p_message,
-                                  void              *buf,
-                                  fuse_fill_dir_t    filler)
-{
- assert(p_message != NULL);
-
- int res = 0;
-
- const char *fname = notmuch_message_get_filename(p_message);
- if (fname != NULL) {
-   struct stat stbuf;
-   if (stat(fname, &stbuf) == 0) {
-     char trans_name[PATH_MAX];
-     strncpy(trans_name, fname, PATH_MAX - 1);
-     trans_name[PATH_MAX - 1] = '\0';
-     string_replace(trans_name, '/', '#');
-
-     /* Perpetuate the file size inflation lie told in getattr(). */
-     stbuf.st_size += MAX_XLABEL_LENGTH;
-     LOG_TRACE("readdir filling dir %s at %ld\n",
-               trans_name, dir_fd->next_offset);
-     if (filler(buf, trans_name, &stbuf, dir_fd->next_offset++) != 0) {
-       LOG_TRACE("readdir filler full \"%s\".\n", trans_name);
-       dir_fd->next_offset--;
-       res = INT_MAX;
-     }
-   }
-   else if (errno == ENOENT) {
-     /* If a message is gone, don't stop the whole readdir(). */
-     fprintf(stderr, "WARNING: Skipping missing file \"%s\".\n", fname);
-   }
-   else {
-     fprintf(stderr, "ERROR: notmuch message stat error \"%s\" %s.\n", fname,
-             strerror(errno));
-     res = -errno;
-   }
- }
- else {
-   /* There's nothing we can do about this case, which I doubt can ever
-    * happen. Just ignore it.
-    */
+   free(dir_fd);
+   dir_fd = NULL;
  }
-
- return res;
+ return 0;
 }
 
 /*============================================================================*/
@@ -649,30 +7663,93 @@ static int notmuchfs_readdir (const char            *path,
  switch (dir_fd->type) {
    case OPENDIR_TYPE_NOTMUCH_QUERY:
      {
+      /* Offsets 1 and 2 are '.' and '..', entry i is at offset i + 3. */
       if (offset_in == 0) {
-        filler(buf, ".", NULL, dir_fd->next_offset++);
-        filler(buf, "..", NULL, dir_fd->next_offset++);
+        if (filler(buf, ".", NULL, 1) != 0 ||
+            filler(buf, "..", NULL, 2) != 0)
+          break;
+      }
+
+      struct fuse_context *p_fuse_ctx = fuse_get_context();
+      notmuch_context_t   *p_ctx      =
+        (notmuch_context_t *)p_fuse_ctx->private_data;
+      listing_t           *p_listing  = dir_fd->p_listing;
+
+      size_t first = (offset_in <= 2) ? 0 : (size_t)offset_in - 2;
+
+      PTHREAD_LOCK(&p_ctx->cache.mutex);
+      if (p_listing->streaming) {
+        /* Still being streamed, so list what's there so far (at least one
+         * entry, as listing none means the end, so wait for more if all
+         * there is has been deleted), straight from the entries.
+         */
+        bool   filled = (offset_in == 0);
+        bool   full   = FALSE;
+        size_t i      = first;
+        do {
+          res = stream_wait_locked(p_ctx, p_listing, i);
+          for (; res == 0 && p_listing->streaming && i < p_listing->n_entries;
+               i++) {
+            listing_entry_t *p_entry = &p_listing->entries[i];
+            if (p_entry->deleted)
+              continue;
+            if (filler(buf, p_entry->name, &p_entry->st, i + 3) != 0) {
+              full = TRUE;
+              break;
+            }
+            filled = TRUE;
+          }
+        } while (res == 0 && p_listing->streaming && !filled && !full);
+        if (res != 0 || p_listing->streaming) {
+          PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+          break;
+        }
       }
-      else if (offset_in + 1 != dir_fd->next_offset) {
-        fprintf(stderr, "ERROR: discontiguous dir offsets %ld %ld.\n",
-                (long int)offset_in, (long int)dir_fd->next_offset);
-        res = -EDOM;
+      if (p_listing->failed) {
+        PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+        res = -EIO;
         break;
       }
+      listing_dirents_locked(p_listing);
+
+      /* Usually this continues where the last call stopped, otherwise find
+       * the first entry after 'offset_in' again.
+       */
+      size_t pos = 0;
+      if (offset_in == dir_fd->resume_offset &&
+          dir_fd->resume_generation == p_listing->dirents_generation) {
+        pos = dir_fd->resume_pos;
+      }
+      else {
+        while (pos < p_listing->dirents_length &&
+               ((listing_dirent_t *)(p_listing->dirents + pos))->index < first)
+          pos += ((listing_dirent_t *)(p_listing->dirents + pos))->length;
+      }
 
-      notmuch_message_t *p_message = NULL;
-      while (res == 0 &&
-             (p_message = notmuch_messages_get(dir_fd->p_messages)) != NULL) {
-
-        res = fill_dir_with_message(dir_fd, p_message, buf, filler);
-
-        notmuch_message_destroy(p_message);
-        if (res == INT_MAX) {
-          res = 0;
+      /* Only the inode number and type are used. */
+      struct stat st;
+      off_t       offset = offset_in;
+      memset(&st, 0, sizeof(st));
+      while (pos < p_listing->dirents_length) {
+        const listing_dirent_t *p_dirent =
+          (const listing_dirent_t *)(p_listing->dirents + pos);
+
+        st.st_ino  = p_dirent->ino;
+        st.st_mode = p_dirent->mode;
+        if (filler(buf, p_dirent->name, &st, p_dirent->index + 3) != 0) {
+          LOG_TRACE("readdir filler full \"%s\".\n", p_dirent->name);
           break;
         }
-        notmuch_messages_move_to_next(dir_fd->p_messages);
+        offset  = p_dirent->index + 3;
+        pos    += p_dirent->length;
       }
+      LOG_TRACE("readdir filled dir from %lld to %lld\n", (long long)offset_in,
+                (long long)offset);
+
+      dir_fd->resume_offset     = offset;
+      dir_fd->resume_pos        = pos;
+      dir_fd->resume_generation = p_listing->dirents_generation;
+      PTHREAD_UNLOCK(&p_ctx->cache.mutex);
       break;
      }
 
@@ -710,6 +7787,32 @@ static int notmuchfs_readdir (const char            *path,
       filler(buf, "cur", NULL, 0);
       filler(buf, "new", NULL, 0);
       filler(buf, "tmp", NULL, 0);
+      if (dir_fd->fd == NULL)
+        break;
+
+      rewinddir(dir_fd->fd);
+      struct dirent *de;
+      while ((de = readdir(dir_fd->fd)) != NULL) {
+        if (de->d_name[0] == '.' ||
+            (de->d_type != DT_DIR && de->d_type != DT_LNK &&
+             de->d_type != DT_UNKNOWN))
+          continue;
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino  = de->d_ino;
+        st.st_mode = de->d_type << 12;
+        filler(buf, de->d_name, &st, 0);
+      }
+      break;
+     }
+
+   case OPENDIR_TYPE_MIME_PARTS:
+     {
+      filler(buf, ".", NULL, 0);
+      filler(buf, "..", NULL, 0);
+      for (size_t i = 0; i < dir_fd->p_index->n_parts; i++)
+        filler(buf, dir_fd->p_index->parts[i].name, NULL, 0);
       break;
      }
  }
@@ -775,25 +7878,761 @@ static size_t fill_string_with_tags (char              *buf_in,
  }
  notmuch_tags_destroy(tags);
 
- return buf - buf_in;
+ return buf - buf_in;
+}
+
+/*============================================================================*/
+
+/**
+ * A message in an mbox view, see mbox_t.
+ */
+typedef struct
+{
+ /** The real file name of the message. */
+ char  *fname;
+ /** The message tags, comma separated, for the X-Label header. */
+ char  *tags;
+ /** The date of the message, for the 'From ' line. */
+ time_t date;
+ /**
+  * The 'From ' line and synthesized headers preceding the message, set when
+  * the message is laid out.
+  */
+ char  *prefix;
+ /** The length of 'prefix'. */
+ size_t prefix_length;
+ /** The offset of the message (its prefix) in the mbox, once laid out. */
+ off_t  start;
+ /** The size of the message file, once laid out. */
+ off_t  size;
+} mbox_message_t;
+
+/**
+ * An mbox view of a query: all of its messages concatenated, in mboxcl2
+ * format, i.e. with a Content-Length header instead of '>From ' quoting, so
+ * the message files can be passed through unmodified.
+ *
+ * The query is run, and the tags of every message collected, in one go when
+ * the view is opened. Each message is then laid out (its file size and header
+ * length found) only when a read first reaches it, so a sequential export
+ * streams, rather than waiting for every file to be examined up front.
+ */
+typedef struct
+{
+ /** Serializes reads, which may lay out messages and share 'fd'. */
+ pthread_mutex_t   mutex;
+ /** The messages, in query order. */
+ mbox_message_t    *messages;
+ /** The number of 'messages'. */
+ size_t            n_messages;
+ /** The number of 'messages' laid out so far. */
+ size_t            n_laid_out;
+ /** The end offset of the last message laid out. */
+ off_t             laid_out_end;
+ /** The open file of message 'fd_index', or -1. */
+ int               fd;
+ /** The index of the message 'fd' is open on. */
+ size_t            fd_index;
+ /** The decompressed content of 'fd', if it's a compressed message. */
+ plain_t           *p_plain;
+ /** The notmuch context, for plain_get(). */
+ notmuch_context_t *p_ctx;
+} mbox_t;
+
+/**
+ * Free an mbox view.
+ *
+ * @param[in] p_mbox The mbox view.
+ */
+static void mbox_free (mbox_t *p_mbox)
+{
+ for (size_t i = 0; i < p_mbox->n_messages; i++) {
+   free(p_mbox->messages[i].fname);
+   free(p_mbox->messages[i].tags);
+   free(p_mbox->messages[i].prefix);
+ }
+ free(p_mbox->messages);
+ if (p_mbox->fd != -1)
+   close(p_mbox->fd);
+ plain_unref(p_mbox->p_ctx, p_mbox->p_plain);
+ pthread_mutex_destroy(&p_mbox->mutex);
+ free(p_mbox);
+}
+
+/**
+ * Create the mbox view of a query.
+ *
+ * @param[in]  p_ctx    The notmuch context.
+ * @param[in]  query    The notmuch query.
+ * @param[out] pp_mbox  The mbox view.
+ * @return 0 on success, or a negative errno.
+ */
+static int mbox_create (notmuch_context_t *p_ctx,
+                        const char        *query,
+                        mbox_t           **pp_mbox)
+{
+ mbox_t *p_mbox = malloc(sizeof(mbox_t));
+ memset(p_mbox, 0, sizeof(mbox_t));
+ pthread_mutex_init(&p_mbox->mutex, NULL);
+ p_mbox->fd    = -1;
+ p_mbox->p_ctx = p_ctx;
+
+ notmuch_database_t *p_db = database_open(p_ctx, FALSE);
+
+ int                 res        = 0;
+ size_t              max        = 0;
+ notmuch_messages_t *p_messages = NULL;
+ notmuch_query_t    *p_query    = query_create(p_ctx, p_db, query);
+ if (p_query == NULL ||
+     notmuch_query_search_messages(p_query, &p_messages) !=
+     NOTMUCH_STATUS_SUCCESS) {
+   res = -EIO;
+ }
+ else {
+   for (; notmuch_messages_valid(p_messages);
+        notmuch_messages_move_to_next(p_messages)) {
+     if (p_mbox->n_messages % POOL_CANCEL_CHECK_INTERVAL == 0 &&
+         pool_cancelled()) {
+       res = -EINTR;
+       break;
+     }
+
+     notmuch_message_t *p_message = notmuch_messages_get(p_messages);
+     char              *fname     = message_best_filename(p_mbox->p_ctx,
+                                                             p_message);
+
+     if (fname != NULL) {
+       if (p_mbox->n_messages == max) {
+         max = max ? max * 2 : 256;
+         p_mbox->messages = realloc(p_mbox->messages,
+                                    max * sizeof(mbox_message_t));
+       }
+       mbox_message_t *p_mbox_message = &p_mbox->messages[p_mbox->n_messages++];
+       strbuf_t        tags           = { NULL, 0, 0 };
+
+       memset(p_mbox_message, 0, sizeof(mbox_message_t));
+       strbuf_append_tags(&tags, p_message);
+       strbuf_append(&tags, "", 1);
+       p_mbox_message->fname = fname;
+       p_mbox_message->tags  = tags.data;
+       p_mbox_message->date  = notmuch_message_get_date(p_message);
+     }
+     notmuch_message_destroy(p_message);
+   }
+   notmuch_messages_destroy(p_messages);
+ }
+ if (p_query != NULL)
+   query_release(p_query);
+
+ database_close(p_ctx, p_db);
+
+ if (res != 0) {
+   mbox_free(p_mbox);
+   return res;
+ }
+ *pp_mbox = p_mbox;
+ return 0;
+}
+
+/**
+ * Find the length of the header of a message file, including the blank line
+ * separating it from the body.
+ *
+ * @param[in] fd      The open message file.
+ * @param[in] p_plain The decompressed content of the file, or NULL.
+ * @param[in] size    The size of the file.
+ * @return The header length, or 'size' if there's no body.
+ */
+static off_t mbox_header_length (int fd, const plain_t *p_plain, off_t size)
+{
+ char  buf[4096 + 1];
+ off_t offset = 0;
+ char  last   = '\0';
+
+ while (offset < size) {
+   ssize_t bytes_read = message_pread(fd, p_plain, buf + 1, sizeof(buf) - 1,
+                                      offset);
+   if (bytes_read <= 0)
+     break;
+
+   /* Carry the previous chunk's last byte over, to match across chunks. */
+   buf[0] = last;
+   for (ssize_t i = 1; i <= bytes_read; i++) {
+     if (buf[i] == '\n' &&
+         (buf[i - 1] == '\n' ||
+          (buf[i - 1] == '\r' && i >= 2 && buf[i - 2] == '\n'))) {
+       return offset + i;
+     }
+   }
+   last    = buf[bytes_read];
+   offset += bytes_read;
+ }
+ return size;
+}
+
+/**
+ * Open a message of an mbox view as its 'fd', closing the last one. Must be
+ * called with its mutex held.
+ *
+ * @param[in,out] p_mbox The mbox view.
+ * @param[in]     index  The index of the message.
+ * @return 0 on success, or a negative errno.
+ */
+static int mbox_open_message (mbox_t *p_mbox, size_t index)
+{
+ if (p_mbox->fd != -1)
+   close(p_mbox->fd);
+ plain_unref(p_mbox->p_ctx, p_mbox->p_plain);
+ p_mbox->p_plain  = NULL;
+ p_mbox->fd_index = index;
+ p_mbox->fd       = open(p_mbox->messages[index].fname, O_RDONLY);
+ if (p_mbox->fd == -1)
+   return -errno;
+ return plain_get(p_mbox->p_ctx, p_mbox->messages[index].fname, p_mbox->fd,
+                  &p_mbox->p_plain);
+}
+
+/**
+ * Lay out the next message of an mbox view. Must be called with its mutex
+ * held.
+ *
+ * @param[in,out] p_mbox The mbox view, with messages left to lay out.
+ */
+static void mbox_lay_out_next (mbox_t *p_mbox)
+{
+ size_t          index     = p_mbox->n_laid_out;
+ mbox_message_t *p_message = &p_mbox->messages[index];
+ struct stat     st;
+
+ p_message->start = p_mbox->laid_out_end;
+ p_mbox->n_laid_out++;
+
+ int res = mbox_open_message(p_mbox, index);
+ if (res == 0 && fstat(p_mbox->fd, &st) != 0)
+   res = -errno;
+ if (res != 0) {
+   /* Gone since the query was run, leave it out. */
+   LOG_TRACE("mbox skipping %s: %s\n", p_message->fname, strerror(-res));
+   return;
+ }
+ if (p_mbox->p_plain != NULL)
+   st.st_size = p_mbox->p_plain->length;
+
+ off_t header_length = mbox_header_length(p_mbox->fd, p_mbox->p_plain,
+                                          st.st_size);
+
+ char date[32];
+ struct tm tm;
+ gmtime_r(&p_message->date, &tm);
+ strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", &tm);
+
+ p_message->size = st.st_size;
+ if (asprintf(&p_message->prefix,
+              "From MAILER-DAEMON %s\n%s%s\nContent-Length: %lld\n",
+              date, XLABEL, p_message->tags,
+              (long long)(st.st_size - header_length)) < 0) {
+   p_message->prefix = NULL;
+   p_message->size   = 0;
+   return;
+ }
+ p_message->prefix_length = strlen(p_message->prefix);
+
+ /* Prefix, the message, and a blank line before the next 'From '. */
+ p_mbox->laid_out_end += p_message->prefix_length + p_message->size + 1;
+}
+
+/**
+ * Read from an mbox view.
+ *
+ * @param[in]  p_mbox The mbox view.
+ * @param[out] buf    The buffer to fill.
+ * @param[in]  size   The number of bytes to read.
+ * @param[in]  offset The offset to read from.
+ * @return The number of bytes read, less than 'size' only at the end of the
+ *         view, or a negative errno.
+ */
+static int mbox_read (mbox_t *p_mbox, char *buf, size_t size, off_t offset)
+{
+ size_t copied = 0;
+
+ PTHREAD_LOCK(&p_mbox->mutex);
+
+ while (copied < size) {
+   off_t pos = offset + copied;
+
+   /* Lay out messages until one contains 'pos'. */
+   while (p_mbox->laid_out_end <= pos &&
+          p_mbox->n_laid_out < p_mbox->n_messages)
+     mbox_lay_out_next(p_mbox);
+   if (p_mbox->laid_out_end <= pos)
+     break;
+
+   /* Find the last message starting at or before 'pos'. */
+   size_t lo = 0, hi = p_mbox->n_laid_out;
+   while (hi - lo > 1) {
+     size_t mid = lo + (hi - lo) / 2;
+     if (p_mbox->messages[mid].start <= pos)
+       lo = mid;
+     else
+       hi = mid;
+   }
+
+   mbox_message_t *p_message = &p_mbox->messages[lo];
+   off_t           rel       = pos - p_message->start;
+   size_t          left      = size - copied;
+
+   if (rel < (off_t)p_message->prefix_length) {
+     size_t n = MIN(left, p_message->prefix_length - rel);
+     memcpy(buf + copied, p_message->prefix + rel, n);
+     copied += n;
+     continue;
+   }
+   rel -= p_message->prefix_length;
+
+   if (rel < p_message->size) {
+     if (p_mbox->fd_index != lo || p_mbox->fd == -1) {
+       int res = mbox_open_message(p_mbox, lo);
+       if (res != 0) {
+         PTHREAD_UNLOCK(&p_mbox->mutex);
+         return copied > 0 ? (int)copied : res;
+       }
+     }
+     size_t  n          = MIN(left, (size_t)(p_message->size - rel));
+     ssize_t bytes_read = message_pread(p_mbox->fd, p_mbox->p_plain,
+                                        buf + copied, n, rel);
+     if (bytes_read <= 0) {
+       /* Shrunk since it was laid out; pad, to keep the offsets right. */
+       memset(buf + copied, '\n', n);
+       bytes_read = n;
+     }
+     copied += bytes_read;
+     continue;
+   }
+
+   buf[copied++] = '\n';
+ }
+
+ PTHREAD_UNLOCK(&p_mbox->mutex);
+ return (int)copied;
+}
+
+/*============================================================================*/
+
+/**
+ * A notmuchfs open file handle type, created by notmuchfs_open().
+ */
+typedef struct
+{
+ /** The actual file handle. */
+ int  fh;
+ /**
+  * Whether the file content is passed through untouched, without an X-Label
+  * header, because this is a message being delivered, or because of
+  * global_config.xattr_tags.
+  */
+ bool raw;
+ /**
+  * The content of a generated virtual file, or NULL. If set, 'fh' is -1.
+  */
+ strbuf_t content;
+ /** The mbox view being read, or NULL. If set, 'fh' is -1. */
+ mbox_t  *p_mbox;
+ /** The MIME part being read, or NULL. If set, 'fh' is -1. */
+ mime_reader_t *p_part;
+ /** The decompressed content of 'fh', if it's a compressed message. */
+ plain_t *p_plain;
+ /**
+  * The length of the content, if it's cut short (in the headers-only view),
+  * or 0.
+  */
+ off_t length;
+ /** The X-Label header - filled by open(), used later. */
+ char x_label[MAX_XLABEL_LENGTH];
+} open_t;
+
+
+/**
+ * Open a message file in the delivery maildir.
+ *
+ * @param[in]     path  The virtual path of the message.
+ * @param[in,out] fi    The FUSE file info, to fill with the open_t.
+ * @param[in]     mode  The mode to create the file with, if 'fi->flags'
+ *                      includes O_CREAT.
+ * @return 0 on success, 1 if 'path' is not a message being delivered, or a
+ *         negative errno on error.
+ */
+static int open_delivery (const char            *path,
+                          struct fuse_file_info *fi,
+                          mode_t                 mode)
+{
+ char        query[PATH_MAX];
+ char        subdir[4];
+ const char *name;
+
+ if (global_config.deliver_dir == NULL ||
+     !split_message_path(path, query, subdir, &name) ||
+     strchr(name, '#') != NULL)
+   return 1;
+
+ char real_name[PATH_MAX];
+ int  res = deliver_path(real_name, subdir, name);
+ if (res != 0)
+   return res;
+
+ /* Only messages in tmp/ can be written to, per the maildir spec. */
+ if (strcmp(subdir, "tmp") != 0 && (fi->flags & 3) != O_RDONLY)
+   return -EACCES;
+
+ LOG_TRACE("open delivery(%s)\n", real_name);
+ int fd = open(real_name, fi->flags, mode);
+ if (fd == -1)
+   return -errno;
+
+ open_t *p_open = malloc(sizeof(open_t));
+ memset(p_open, 0, sizeof(open_t));
+ p_open->fh  = fd;
+ p_open->raw = TRUE;
+ fi->fh = (uint64_t)(uintptr_t)p_open;
+
+ return 0;
+}
+
+
+/**
+ * The arguments of query_file_job().
+ */
+typedef struct
+{
+ query_file_t  type;
+ const char   *query;
+ const char   *arg;
+ open_t       *p_open;
+} query_file_job_t;
+
+/**
+ * A pool job to generate the content of a virtual query file.
+ *
+ * @param[in]     p_ctx The notmuch context.
+ * @param[in,out] arg   The query_file_job_t.
+ * @return 0 on success, or a negative errno.
+ */
+static int query_file_job (notmuch_context_t *p_ctx, void *arg)
+{
+ query_file_job_t *p_job  = (query_file_job_t *)arg;
+ open_t           *p_open = p_job->p_open;
+ int               res    = 0;
+
+ switch (p_job->type) {
+   case QUERY_FILE_NONE:
+   case QUERY_FILE_STATS:
+     break;
+
+   case QUERY_FILE_CHANGES:
+     {
+      unsigned long since = 0;
+      if (p_job->arg != NULL) {
+        char *end = NULL;
+        if (strncmp(p_job->arg, "since=", 6) != 0 ||
+            (since = strtoul(p_job->arg + 6, &end, 10), *end != '\0')) {
+          res = -ENOENT;
+          break;
+        }
+      }
+      LOG_TRACE("open changes(%s, %lu)\n", p_job->query, since);
+      res = changes_generate(p_ctx, p_job->query, since, &p_open->content);
+      break;
+     }
+
+   case QUERY_FILE_MBOX:
+     LOG_TRACE("open mbox(%s)\n", p_job->query);
+     res = (p_job->arg == NULL) ?
+             mbox_create(p_ctx, p_job->query, &p_open->p_mbox) : -ENOENT;
+     break;
+ }
+ return res;
+}
+
+/**
+ * Generate the content of the stats file: one 'name value' line for each
+ * statistic.
+ *
+ * @param[in]  p_ctx The notmuch context.
+ * @param[out] p_buf The buffer to fill.
+ */
+static void stats_generate (notmuch_context_t *p_ctx, strbuf_t *p_buf)
+{
+ pool_t *p_pool = &p_ctx->pool;
+
+ PTHREAD_LOCK(&p_pool->mutex);
+ for (int i = 0; i < POOL_N_CLASSES; i++) {
+   pool_queue_t *p_queue = &p_pool->queues[i];
+   const char   *name    = pool_class_names[i];
+
+   strbuf_printf(p_buf, "pool.%s.threads %u\n", name, p_queue->threads);
+   strbuf_printf(p_buf, "pool.%s.idle %u\n", name, p_queue->idle);
+   strbuf_printf(p_buf, "pool.%s.queued %u\n", name,
+                 p_queue->queued[POOL_PRIORITY_INTERACTIVE]);
+   strbuf_printf(p_buf, "pool.%s.queued_bulk %u\n", name,
+                 p_queue->queued[POOL_PRIORITY_BULK]);
+   strbuf_printf(p_buf, "pool.%s.running_bulk %u\n", name,
+                 p_queue->running_bulk);
+   strbuf_printf(p_buf, "pool.%s.max_queued %u\n", name,
+                 p_queue->max_queued);
+   strbuf_printf(p_buf, "pool.%s.completed %lu\n", name,
+                 p_queue->completed);
+ }
+ unsigned bulk_pids = 0;
+ time_t   now       = time(NULL);
+ for (int i = 0; i < POOL_PIDS; i++) {
+   if (p_pool->pids[i].bulk && p_pool->pids[i].second >= now - 1)
+     bulk_pids++;
+ }
+ strbuf_printf(p_buf, "pool.bulk_processes %u\n", bulk_pids);
+ strbuf_printf(p_buf, "pool.db_reuses %lu\n",
+               __atomic_load_n(&p_pool->db_reuses, __ATOMIC_RELAXED));
+ strbuf_printf(p_buf, "pool.query_reuses %lu\n",
+               __atomic_load_n(&p_pool->query_reuses, __ATOMIC_RELAXED));
+ PTHREAD_UNLOCK(&p_pool->mutex);
+
+ PTHREAD_LOCK(&p_ctx->cache.mutex);
+ strbuf_printf(p_buf, "cache.listings %zu\n", p_ctx->cache.listings.count);
+ strbuf_printf(p_buf, "cache.revision %lu\n", p_ctx->cache.revision);
+ strbuf_printf(p_buf, "cache.stat_hits %lu\n", p_ctx->cache.stat_hits);
+ strbuf_printf(p_buf, "cache.shared_refreshes %lu\n",
+               p_ctx->cache.shared_refreshes);
+ strbuf_printf(p_buf, "cache.refined %lu\n", p_ctx->cache.refined);
+ strbuf_printf(p_buf, "cache.streaming %zu\n", p_ctx->cache.streams.count);
+ PTHREAD_UNLOCK(&p_ctx->cache.mutex);
+
+ PTHREAD_LOCK(&p_ctx->negcache.mutex);
+ strbuf_printf(p_buf, "negcache.entries %zu\n",
+               p_ctx->negcache.names.count);
+ strbuf_printf(p_buf, "negcache.hits %lu\n", p_ctx->negcache.hits);
+ PTHREAD_UNLOCK(&p_ctx->negcache.mutex);
+
+ PTHREAD_LOCK(&p_ctx->plain_cache.mutex);
+ strbuf_printf(p_buf, "plain_cache.messages %zu\n",
+               p_ctx->plain_cache.messages.count);
+ strbuf_printf(p_buf, "plain_cache.bytes %zu\n", p_ctx->plain_cache.bytes);
+ strbuf_printf(p_buf, "plain_cache.sizes %zu\n",
+               p_ctx->plain_cache.sizes.count);
+ PTHREAD_UNLOCK(&p_ctx->plain_cache.mutex);
+
+ PTHREAD_LOCK(&p_ctx->tagindex.mutex);
+ strbuf_printf(p_buf, "tagindex.messages %zu\n", p_ctx->tagindex.n_live);
+ strbuf_printf(p_buf, "tagindex.tags %zu\n", p_ctx->tagindex.tags.count);
+ strbuf_printf(p_buf, "tagindex.revision %lu\n", p_ctx->tagindex.revision);
+ strbuf_printf(p_buf, "tagindex.hits %lu\n", p_ctx->tagindex.hits);
+ PTHREAD_UNLOCK(&p_ctx->tagindex.mutex);
+
+ PTHREAD_LOCK(&p_ctx->writer.mutex);
+ strbuf_printf(p_buf, "writer.queued %zu\n", (size_t)p_ctx->writer.queued);
+ PTHREAD_UNLOCK(&p_ctx->writer.mutex);
+}
+
+/**
+ * Open a virtual query file (or the stats file), generating its content.
+ *
+ * @param[in]     path The virtual path of the file.
+ * @param[in,out] fi   The FUSE file info, to fill with the open_t.
+ * @return 0 on success, 1 if 'path' is not a virtual query file, or a
+ *         negative errno on error.
+ */
+static int open_query_file (const char *path, struct fuse_file_info *fi)
+{
+ char         dir[PATH_MAX];
+ const char  *arg;
+ query_file_t type = split_query_file_path(path, dir, &arg);
+
+ if (type == QUERY_FILE_NONE)
+   return 1;
+ if ((fi->flags & 3) != O_RDONLY)
+   return -EACCES;
+
+ struct fuse_context *p_fuse_ctx = fuse_get_context();
+ notmuch_context_t   *p_ctx      =
+   (notmuch_context_t *)p_fuse_ctx->private_data;
+
+ open_t *p_open = malloc(sizeof(open_t));
+ memset(p_open, 0, sizeof(open_t));
+ p_open->fh = -1;
+
+ int res = 0;
+ if (type == QUERY_FILE_STATS) {
+   stats_generate(p_ctx, &p_open->content);
+ }
+ else {
+   res = resolve_query(dir);
+   if (res == 0) {
+     /* An mbox view reads every message, whoever asks for it. */
+     query_file_job_t job = { type, dir, arg, p_open };
+     res = pool_run(p_ctx, POOL_CLASS_LIST, type == QUERY_FILE_MBOX,
+                    query_file_job, &job);
+   }
+ }
+
+ if (res != 0) {
+   free(p_open->content.data);
+   free(p_open);
+   return res;
+ }
+
+ /* The size reported by getattr() is a lie, so bypass the page cache. */
+ fi->direct_io = 1;
+ fi->fh        = (uint64_t)(uintptr_t)p_open;
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * Open a MIME part of a message.
+ *
+ * @param[in]     path The virtual path of the part.
+ * @param[in,out] fi   The FUSE file info, to fill with the open_t.
+ * @return 0 on success, 1 if 'path' is not a MIME part, or a negative errno
+ *         on error.
+ */
+static int open_mime_part (const char *path, struct fuse_file_info *fi)
+{
+ char        filename[PATH_MAX];
+ const char *part;
+
+ if (split_parts_path(path, filename, &part) != PARTS_PATH_PART)
+   return 1;
+ if ((fi->flags & 3) != O_RDONLY)
+   return -EACCES;
+
+ struct fuse_context *p_fuse_ctx = fuse_get_context();
+ notmuch_context_t   *p_ctx      =
+   (notmuch_context_t *)p_fuse_ctx->private_data;
+
+ mime_index_t *p_index;
+ int           res = mime_index_get(p_ctx, filename, &p_index);
+ if (res != 0)
+   return res;
+
+ const mime_part_t *p_part = mime_index_find(p_index, part);
+ if (p_part == NULL) {
+   mime_index_unref(p_ctx, p_index);
+   return -ENOENT;
+ }
+
+ int fd = open(filename, O_RDONLY);
+ if (fd == -1) {
+   res = -errno;
+   mime_index_unref(p_ctx, p_index);
+   return res;
+ }
+
+ mime_reader_t *p_reader = malloc(sizeof(mime_reader_t));
+ memset(p_reader, 0, sizeof(mime_reader_t));
+ pthread_mutex_init(&p_reader->mutex, NULL);
+ p_reader->fd        = fd;
+ p_reader->part      = *p_part;
+ p_reader->part.name = NULL;
+ p_reader->in_pos    = p_part->start;
+ p_reader->window    = malloc(MIME_WINDOW_SIZE);
+ p_reader->raw       = malloc(MIME_WINDOW_SIZE);
+ p_reader->raw_size  = MIME_WINDOW_SIZE;
+ mime_index_unref(p_ctx, p_index);
+
+ open_t *p_open = malloc(sizeof(open_t));
+ memset(p_open, 0, sizeof(open_t));
+ p_open->fh     = -1;
+ p_open->p_part = p_reader;
+
+ /* The message file never changes, nor does the part. */
+ fi->keep_cache = 1;
+ fi->fh         = (uint64_t)(uintptr_t)p_open;
+ return 0;
 }
 
 /*============================================================================*/
 
 /**
- * A notmuchfs open file handle type, created by notmuchfs_open().
+ * The arguments of xlabel_job().
  */
 typedef struct
 {
- /** The actual file handle. */
- int  fh;
- /** The X-Label header - filled by open(), used later. */
- char x_label[MAX_XLABEL_LENGTH];
-} open_t;
+ /** The real file name of the message. */
+ const char *filename;
+ /** The X-Label header buffer to fill, #MAX_XLABEL_LENGTH long. */
+ char       *x_label;
+} xlabel_job_t;
+
+/**
+ * A pool job to look up a message, and fill in its X-Label header.
+ *
+ * @param[in]     p_ctx The notmuch context.
+ * @param[in,out] arg   The xlabel_job_t.
+ * @return 0 on success (even if the message isn't in the database), or -EIO.
+ */
+static int xlabel_job (notmuch_context_t *p_ctx, void *arg)
+{
+ xlabel_job_t       *p_job = (xlabel_job_t *)arg;
+ notmuch_database_t *p_db  = database_open(p_ctx, FALSE);
+
+ LOG_TRACE("open notmuch lookup by name: %s\n", p_job->filename);
+ notmuch_message_t *p_message;
+ if (notmuch_database_find_message_by_filename(p_db, p_job->filename,
+                                               &p_message) !=
+     NOTMUCH_STATUS_SUCCESS) {
+   /* Notmuch somehow failed to do anything successfully, fail the open. */
+   database_close(p_ctx, p_db);
+   return -EIO;
+ }
+
+ if (p_message == NULL) {
+   LOG_TRACE("WARNING: Message not found in DB - ignoring.");
+ }
+ else {
+   char *buf = p_job->x_label;
+   /* Make sure the buffer is big enough to at least take the
+    * representation of overflow.
+    */
+   assert(MAX_XLABEL_LENGTH >
+          strlen(XLABEL) + strlen(TAG_ERROR_STRING) + 1);
+   memcpy(buf, XLABEL, strlen(XLABEL));
+   buf += strlen(XLABEL);
+   buf += fill_string_with_tags(buf,
+                                MAX_XLABEL_LENGTH - strlen(XLABEL) - 1,
+                                p_message);
+
+   /* Pad the header out. RFC5322 doesn't say anything about this that I
+    * can see. NULs don't work, nor \n's, so spaces are used.
+    */
+   while (buf - p_job->x_label < (MAX_XLABEL_LENGTH - 1)) {
+     assert(1 <= MAX_XLABEL_LENGTH - (buf - p_job->x_label));
+     buf[0] = ' ';
+     buf++;
+   }
+
+   assert(1 <= MAX_XLABEL_LENGTH - (buf - p_job->x_label));
+   buf[0] = '\n';
+   buf++;
+
+   notmuch_message_destroy(p_message);
+ }
+ database_close(p_ctx, p_db);
+ return 0;
+}
 
 
 static int notmuchfs_open (const char *path, struct fuse_file_info *fi)
 {
+ int res = open_delivery(path, fi, 0);
+ if (res <= 0)
+   return res;
+
+ res = open_query_file(path, fi);
+ if (res <= 0)
+   return res;
+
+ res = open_mime_part(path, fi);
+ if (res <= 0)
+   return res;
+
  if ((fi->flags & 3) != O_RDONLY)
    return -EACCES;
 
@@ -815,64 +8654,33 @@ static int notmuchfs_open (const char *path, struct fuse_file_info *fi)
    trans_name[PATH_MAX - 1] = '\0';
 
    char *first_pslash = strchr(trans_name, '#');
-   if (first_pslash != NULL) {
+   if (first_pslash != NULL && global_config.xattr_tags) {
+     /* No need to look the message up at all. Message files aren't
+      * modified in place, so the kernel can keep caching the content.
+      */
+     string_replace(trans_name, '#', '/');
+     p_open->raw    = TRUE;
+     fi->keep_cache = 1;
+   }
+   else if (first_pslash != NULL) {
      string_replace(trans_name, '#', '/');
 
      struct fuse_context *p_fuse_ctx = fuse_get_context();
      notmuch_context_t   *p_ctx      =
        (notmuch_context_t *)p_fuse_ctx->private_data;
 
-     /**
-      * @todo shouldn't need writeable database here, but otherwise get:
-      *   "Internal error: Failure to ensure database is writable"
-      * why?
-      */
-     database_open(p_ctx, TRUE);
-
-     LOG_TRACE("open notmuch lookup by name: %s\n", trans_name);
-     notmuch_message_t *p_message;
-     if (notmuch_database_find_message_by_filename(p_ctx->db, trans_name,
-                                                   &p_message) ==
-         NOTMUCH_STATUS_SUCCESS) {
-       if (p_message == NULL) {
-         LOG_TRACE("WARNING: Message not found in DB - ignoring.");
-       }
-       else {
-         char *buf = p_open->x_label;
-         /* Make sure the buffer is big enough to at least take the
-          * representation of overflow.
-          */
-         assert(MAX_XLABEL_LENGTH >
-                strlen(XLABEL) + strlen(TAG_ERROR_STRING) + 1);
-         memcpy(buf, XLABEL, strlen(XLABEL));
-         buf += strlen(XLABEL);
-         buf += fill_string_with_tags(buf,
-                                      MAX_XLABEL_LENGTH - strlen(XLABEL) - 1,
-                                      p_message);
-
-         /* Pad the header out. RFC5322 doesn't say anything about this that I
-          * can see. NULs don't work, nor \n's, so spaces are used.
-          */
-         while (buf - p_open->x_label < (MAX_XLABEL_LENGTH - 1)) {
-           assert(1 <= MAX_XLABEL_LENGTH - (buf - p_open->x_label));
-           buf[0] = ' ';
-           buf++;
-         }
-
-         assert(1 <= MAX_XLABEL_LENGTH - (buf - p_open->x_label));
-         buf[0] = '\n';
-         buf++;
-
-         notmuch_message_destroy(p_message);
-       }
-       database_close(p_ctx);
-     }
-     else {
-       /* Notmuch somehow failed to do anything successfully, fail the open. */
-       database_close(p_ctx);
+     xlabel_job_t job = { trans_name, p_open->x_label };
+     res = pool_run(p_ctx, POOL_CLASS_READ, FALSE, xlabel_job, &job);
+     if (res != 0) {
        free(p_open);
-       return -EIO;
+       return res;
      }
+
+     /* Otherwise, the content only changes with the tags. The
+      * headers-only view is small, and would need its own record of them.
+      */
+     if (header_view_name(path) == NULL)
+       fi->keep_cache = cache_xlabel_unchanged(p_ctx, path, p_open->x_label);
    }
 
    LOG_TRACE("open(%s)\n", trans_name);
@@ -882,6 +8690,26 @@ static int notmuchfs_open (const char *path, struct fuse_file_info *fi)
      free(p_open);
      return -err;
    }
+
+   if (first_pslash != NULL) {
+     struct fuse_context *p_fuse_ctx = fuse_get_context();
+     notmuch_context_t   *p_ctx      =
+       (notmuch_context_t *)p_fuse_ctx->private_data;
+
+     res = plain_get(p_ctx, trans_name, p_open->fh, &p_open->p_plain);
+     if (res == 0 && header_view_name(path) != NULL) {
+       res = cache_header_length(p_ctx, last_slash + 1, trans_name,
+                                 p_open->fh, &p_open->length);
+       if (!p_open->raw)
+         p_open->length += MAX_XLABEL_LENGTH;
+     }
+     if (res != 0) {
+       plain_unref(p_ctx, p_open->p_plain);
+       close(p_open->fh);
+       free(p_open);
+       return res;
+     }
+   }
  }
 
  fi->fh = (uint64_t)(uintptr_t)p_open;
@@ -898,9 +8726,21 @@ static int notmuchfs_release (const char *path, struct fuse_file_info *fi)
  assert(p_open != NULL);
 
  LOG_TRACE("close(%d)\n", p_open->fh);
- int res = close(p_open->fh);
- assert(res == 0);
+ if (p_open->fh != -1) {
+   int res = close(p_open->fh);
+   assert(res == 0);
+ }
 
+ free(p_open->content.data);
+ if (p_open->p_mbox != NULL)
+   mbox_free(p_open->p_mbox);
+ if (p_open->p_part != NULL)
+   mime_reader_free(p_open->p_part);
+ if (p_open->p_plain != NULL) {
+   struct fuse_context *p_fuse_ctx = fuse_get_context();
+   plain_unref((notmuch_context_t *)p_fuse_ctx->private_data,
+               p_open->p_plain);
+ }
  free(p_open);
  fi->fh = (uint64_t)(uintptr_t)NULL;
 
@@ -922,6 +8762,35 @@ static int notmuchfs_read (const char *path,
 
  assert(p_open != NULL);
 
+ if (p_open->p_mbox != NULL)
+   return mbox_read(p_open->p_mbox, buf, size, offset);
+ if (p_open->p_part != NULL)
+   return mime_reader_read(p_open->p_part, buf, size, offset);
+
+ if (p_open->length != 0) {
+   /* A message in the headers-only view. */
+   if (offset >= p_open->length)
+     return 0;
+   size = MIN(size, (size_t)(p_open->length - offset));
+ }
+
+ if (p_open->fh == -1) {
+   /* A generated file. */
+   if ((size_t)offset >= p_open->content.length)
+     return 0;
+   size_t bytes_to_copy = MIN(size, p_open->content.length - offset);
+   memcpy(buf, p_open->content.data + offset, bytes_to_copy);
+   return (int)bytes_to_copy;
+ }
+
+ if (p_open->raw) {
+   ssize_t bytes_read = message_pread(p_open->fh, p_open->p_plain, buf, size,
+                                      offset);
+   if (bytes_read == -1)
+     return -errno;
+   return (int)bytes_read;
+ }
+
  if (offset < MAX_XLABEL_LENGTH) {
    size_t bytes_to_copy = MIN((size_t)(MAX_XLABEL_LENGTH - offset), size);
    memcpy(buf, p_open->x_label + offset, bytes_to_copy);
@@ -934,8 +8803,8 @@ static int notmuchfs_read (const char *path,
  if (bytes_to_read > 0) {
    LOG_TRACE("read(%s, %ld, %ld)\n", path, offset - offset_adj,
              bytes_to_read);
-   ssize_t bytes_read = pread(p_open->fh, buf, bytes_to_read,
-                              offset - offset_adj);
+   ssize_t bytes_read = message_pread(p_open->fh, p_open->p_plain, buf,
+                                      bytes_to_read, offset - offset_adj);
    if (bytes_read == -1)
      return -errno;
    buf += bytes_read;
@@ -946,24 +8815,439 @@ static int notmuchfs_read (const char *path,
 
 /*============================================================================*/
 
-static int notmuchfs_mkdir (const char* path, mode_t mode)
-{
- assert(path[0] == '/');
+static int notmuchfs_read_buf (const char             *path,
+                               struct fuse_bufvec    **bufp,
+                               size_t                  size,
+                               off_t                   offset,
+                               struct fuse_file_info  *fi)
+{
+ open_t             *p_open = (open_t *)(uintptr_t)fi->fh;
+ struct fuse_bufvec *p_bufv = malloc(sizeof(struct fuse_bufvec));
+
+ assert(p_open != NULL);
+
+ *p_bufv = FUSE_BUFVEC_INIT(size);
+ if (p_open->raw && p_open->length != 0) {
+   /* A message in the headers-only view. */
+   p_bufv->buf[0].size =
+     (offset < p_open->length) ? MIN(size, (size_t)(p_open->length - offset))
+                               : 0;
+ }
+ if (p_open->raw && p_open->p_plain == NULL) {
+   /* Let FUSE read (or splice) straight from the real file. */
+   p_bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+   p_bufv->buf[0].fd    = p_open->fh;
+   p_bufv->buf[0].pos   = offset;
+ }
+ else {
+   p_bufv->buf[0].mem = malloc(MAX(size, 1));
+   int res = notmuchfs_read(path, p_bufv->buf[0].mem, size, offset, fi);
+   if (res < 0) {
+     free(p_bufv->buf[0].mem);
+     free(p_bufv);
+     return res;
+   }
+   p_bufv->buf[0].size = (size_t)res;
+ }
+
+ *bufp = p_bufv;
+ return 0;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_write (const char            *path,
+                            const char            *buf,
+                            size_t                 size,
+                            off_t                  offset,
+                            struct fuse_file_info *fi)
+{
+ (void)path;
+ open_t *p_open = (open_t *)(uintptr_t)fi->fh;
+
+ assert(p_open != NULL);
+
+ /* Only messages being delivered are writable. */
+ if (!p_open->raw)
+   return -EBADF;
+
+ ssize_t bytes_written = pwrite(p_open->fh, buf, size, offset);
+ if (bytes_written == -1)
+   return -errno;
+ return (int)bytes_written;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_create (const char            *path,
+                             mode_t                 mode,
+                             struct fuse_file_info *fi)
+{
+ char        query[PATH_MAX];
+ char        subdir[4];
+ const char *name;
+
+ /* New messages can only be created in tmp/, per the maildir spec. */
+ if (!split_message_path(path, query, subdir, &name) ||
+     strcmp(subdir, "tmp") != 0)
+   return -EACCES;
+
+ int res = open_delivery(path, fi, mode);
+ return res > 0 ? -EACCES : res;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_mknod (const char *path, mode_t mode, dev_t rdev)
+{
+ (void)rdev;
+
+ if (!S_ISREG(mode))
+   return -EACCES;
+
+ struct fuse_file_info fi;
+ memset(&fi, 0, sizeof(fi));
+ fi.flags = O_CREAT | O_EXCL | O_WRONLY;
+
+ int res = notmuchfs_create(path, mode, &fi);
+ if (res == 0)
+   res = notmuchfs_release(path, &fi);
+ return res;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_truncate (const char *path, off_t size)
+{
+ char        query[PATH_MAX];
+ char        subdir[4];
+ const char *name;
+
+ if (!split_message_path(path, query, subdir, &name) ||
+     strcmp(subdir, "tmp") != 0)
+   return -EACCES;
+
+ char real_name[PATH_MAX];
+ int  res = deliver_path(real_name, subdir, name);
+ if (res != 0)
+   return res == -EINVAL ? -EACCES : res;
+
+ if (truncate(real_name, size) != 0)
+   return -errno;
+ return 0;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_ftruncate (const char            *path,
+                                off_t                  size,
+                                struct fuse_file_info *fi)
+{
+ (void)path;
+ open_t *p_open = (open_t *)(uintptr_t)fi->fh;
+
+ assert(p_open != NULL);
+
+ if (!p_open->raw)
+   return -EACCES;
+
+ if (ftruncate(p_open->fh, size) != 0)
+   return -errno;
+ return 0;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_utimens (const char *path, const struct timespec tv[2])
+{
+ assert(path[0] == '/');
+
+ if (strcmp(path, "/") == 0) {
+   if (utimensat(AT_FDCWD, ".", tv, 0) != 0)
+     return -errno;
+   return 0;
+ }
+
+ char *last_slash = strrchr(path + 1, '/');
+ if (is_query_dir_path(path)) {
+   /* '/<query>' (or nested), pass to backing store. */
+   if (utimensat(AT_FDCWD, path + 1, tv, AT_SYMLINK_NOFOLLOW) != 0)
+     return -errno;
+   return 0;
+ }
+
+ if (strcmp(last_slash + 1, "cur") == 0 ||
+     strcmp(last_slash + 1, "new") == 0 ||
+     strcmp(last_slash + 1, "tmp") == 0) {
+   /* The times of virtual maildir directories are maintained by notmuchfs.
+    * This is how notify_dir_changed() generates inotify events.
+    */
+   return 0;
+ }
+
+ return -EACCES;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_mkdir (const char* path, mode_t mode)
+{
+ assert(path[0] == '/');
+
+ if (mkdir(path + 1, mode) == -1)
+   return -errno;
+ return 0;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_rmdir (const char* path)
+{
+ assert(path[0] == '/');
+
+ if (rmdir(path + 1) == -1)
+   return -errno;
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * If a message file being delivered starts with a synthetic X-Label header
+ * (e.g. mutt's break-thread reads a message through notmuchfs, and writes an
+ * altered copy back), remove it so it doesn't accumulate in the real file,
+ * and collect the tags it lists.
+ *
+ * @param[in]     filename The real file name of the message.
+ * @param[in,out] p_tags   Newline-delimited list of tags, to append the
+ *                         X-Label tags to. May point to NULL.
+ * @return 0 on success, or a negative errno.
+ */
+static int strip_xlabel (const char *filename, char **p_tags)
+{
+ int fd = open(filename, O_RDWR);
+ if (fd == -1)
+   return -errno;
+
+ char    header[MAX_XLABEL_LENGTH + 1];
+ ssize_t bytes_read = pread(fd, header, MAX_XLABEL_LENGTH, 0);
+ if (bytes_read != MAX_XLABEL_LENGTH ||
+     memcmp(header, XLABEL, strlen(XLABEL)) != 0 ||
+     header[MAX_XLABEL_LENGTH - 1] != '\n' ||
+     memchr(header, '\n', MAX_XLABEL_LENGTH - 1) != NULL) {
+   close(fd);
+   return 0;
+ }
+
+ LOG_TRACE("delivery stripping X-Label from %s\n", filename);
+
+ /* Collect the tags, which are comma separated and padded with spaces. */
+ header[MAX_XLABEL_LENGTH - 1] = '\0';
+ char *tags = header + strlen(XLABEL);
+ char *end  = tags + strlen(tags);
+ while (end > tags && end[-1] == ' ')
+   end--;
+ *end = '\0';
+ if (strcmp(tags, TAG_ERROR_STRING) != 0 && *tags != '\0') {
+   size_t length = (*p_tags != NULL) ? strlen(*p_tags) : 0;
+   *p_tags = realloc(*p_tags, length + (end - tags) + 2);
+   memcpy(*p_tags + length, tags, end - tags);
+   (*p_tags)[length + (end - tags)]     = '\n';
+   (*p_tags)[length + (end - tags) + 1] = '\0';
+   string_replace(*p_tags + length, ',', '\n');
+ }
+
+ /* Shift the rest of the file down over the header. */
+ char  buf[65536];
+ off_t in  = MAX_XLABEL_LENGTH;
+ off_t out = 0;
+ int   res = 0;
+ while ((bytes_read = pread(fd, buf, sizeof(buf), in)) > 0) {
+   if (pwrite(fd, buf, bytes_read, out) != bytes_read) {
+     res = -EIO;
+     break;
+   }
+   in  += bytes_read;
+   out += bytes_read;
+ }
+ if (bytes_read == -1)
+   res = -errno;
+ if (res == 0 && ftruncate(fd, out) != 0)
+   res = -errno;
+
+ close(fd);
+ return res;
+}
+
+/*============================================================================*/
+
+/**
+ * Complete the delivery of a message, by moving it from the delivery
+ * maildir's tmp/ to new/ or cur/, then queueing it for the writer thread to
+ * index, with the tags required to make it show up in the destination query.
+ *
+ * @param[in] query_to  The destination query directory name.
+ * @param[in] subdir_to The destination maildir directory.
+ * @param[in] name_from The message name in tmp/.
+ * @param[in] name_to   The destination message name.
+ * @return 0 on success, or a negative errno.
+ */
+static int deliver_message (const char *query_to,
+                            const char *subdir_to,
+                            const char *name_from,
+                            const char *name_to)
+{
+ char real_from[PATH_MAX];
+ char real_to[PATH_MAX];
+
+ int res = deliver_path(real_from, "tmp", name_from);
+ if (res == 0)
+   res = deliver_path(real_to, subdir_to, name_to);
+ if (res != 0)
+   return res == -EINVAL ? -ENOTSUP : res;
+
+ if (strcmp(subdir_to, "tmp") == 0) {
+   /* Just a rename within tmp/, not a delivery yet. */
+   return rename(real_from, real_to) == 0 ? 0 : -errno;
+ }
+
+ char *tags = NULL;
+ res = strip_xlabel(real_from, &tags);
+ if (res != 0) {
+   free(tags);
+   return res;
+ }
+
+ LOG_TRACE("deliver rename(%s, %s)\n", real_from, real_to);
+ if (rename(real_from, real_to) != 0) {
+   free(tags);
+   return -errno;
+ }
+
+ char query[PATH_MAX];
+ strncpy(query, query_to, PATH_MAX - 1);
+ query[PATH_MAX - 1] = '\0';
+ if (resolve_query(query) == 0) {
+   char *query_tags = query_required_tags(query);
+   if (query_tags != NULL) {
+     size_t length = (tags != NULL) ? strlen(tags) : 0;
+     tags = realloc(tags, length + strlen(query_tags) + 1);
+     strcpy(tags + length, query_tags);
+     free(query_tags);
+   }
+ }
+
+ /* Indexing is left to the writer thread, so this doesn't wait for it. */
+ struct fuse_context *p_fuse_ctx = fuse_get_context();
+ notmuch_context_t    *p_ctx     =
+   (notmuch_context_t *)p_fuse_ctx->private_data;
+ negcache_forget(p_ctx, real_to);
+ writer_queue(p_ctx, WRITER_OP_INDEX, real_to, tags);
+
+ return 0;
+}
+
+/*============================================================================*/
+
+/**
+ * The arguments of rename_job().
+ */
+typedef struct
+{
+ /** The old real file name of the message. */
+ const char *from;
+ /** The new real file name of the message. */
+ const char *to;
+ /** Which mutt bug 2476 workaround case applies, or 0. */
+ unsigned    mutt_2476_workaround;
+} rename_job_t;
+
+/**
+ * A pool job to rename a message file in the notmuch database, and sync its
+ * tags with its maildir flags.
+ *
+ * @param[in]     p_ctx The notmuch context.
+ * @param[in,out] arg   The rename_job_t.
+ * @return 0 on success, or -EIO.
+ */
+static int rename_job (notmuch_context_t *p_ctx, void *arg)
+{
+ rename_job_t       *p_job = (rename_job_t *)arg;
+ int                 res   = 0;
+ notmuch_database_t *p_db  = database_open(p_ctx, TRUE);
+
+ if (notmuch_database_begin_atomic(p_db) != NOTMUCH_STATUS_SUCCESS) {
+   res = -EIO;
+ }
+ else {
+   /* If renaming from/to the same name, skip this - it gets confused. The
+    * mutt bug 2476 workaround can cause this, but it's also legitimately
+    * possible.
+    */
+   if (strncmp(p_job->from, p_job->to, PATH_MAX) != 0) {
+     LOG_TRACE("notmuch_database_add_message(%s)\n", p_job->to);
+     if (notmuch_database_index_file(p_db, p_job->to, NULL, NULL) !=
+         NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
+       LOG_TRACE("WARNING: Did not find message in database: %s\n",
+                 p_job->to);
+     }
+     else {
+       LOG_TRACE("notmuch_database_remove_message(%s)\n", p_job->from);
+       notmuch_status_t status =
+         notmuch_database_remove_message(p_db, p_job->from);
+       if (status != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
+         LOG_TRACE("WARNING: Did not find old message in database: %s\n",
+                   p_job->from);
+         /* Continue, can't do anything about it anyway. */
+       }
+     }
+   }
+
+   /* Lookup the message again here to sync the maildir flags. Do *not* use
+    * the message returned by notmuch_database_add_message(), it seems to
+    * refer to the file name that is subsequently removed above.
+    */
+   notmuch_message_t *p_message;
+   LOG_TRACE("rename notmuch lookup by name: %s\n", p_job->to);
+   if (notmuch_database_find_message_by_filename(p_db, p_job->to,
+                                                 &p_message) ==
+       NOTMUCH_STATUS_SUCCESS) {
+     /* We just put it there, it should still be there. */
+     assert(p_message != NULL);
 
- if (mkdir(path + 1, mode) == -1)
-   return -errno;
- return 0;
-}
+     LOG_TRACE("notmuch_message_maildir_flags_to_tags(%s)\n", p_job->to);
+     notmuch_message_maildir_flags_to_tags(p_message);
 
-/*============================================================================*/
+     if (global_config.mutt_2476_workaround_allowed) {
+       /* If mutt just moved the file to 'new', add the 'unread' flag.
+        * notmuch_message_maildir_flags_to_tags() does not do this because it's
+        * somewhat against the interpretation of the maildir spec, but it is
+        * what mutt means.
+        */
+       if (p_job->mutt_2476_workaround == 1) {
+         LOG_TRACE("notmuch_message_add_tag(%s, unread)\n", p_job->to);
+         if (notmuch_message_add_tag(p_message, "unread") !=
+             NOTMUCH_STATUS_SUCCESS) {
+           /* Ignore all errors. Flags will go slightly out of sync now until
+            * 'notmuch new' fixes them.
+            */
+         }
+       }
+     }
+     notmuch_message_destroy(p_message);
+   }
+   else {
+     /* Ignore all errors. Flags will go slightly out of sync now until
+      * 'notmuch new' fixes them.
+      */
+   }
+   if (notmuch_database_end_atomic(p_db) != NOTMUCH_STATUS_SUCCESS)
+     res = -EIO;
+ }
 
-static int notmuchfs_rmdir (const char* path)
-{
- assert(path[0] == '/');
+ database_close(p_ctx, p_db);
 
- if (rmdir(path + 1) == -1)
-   return -errno;
- return 0;
+ return res;
 }
 
 /*============================================================================*/
@@ -973,6 +9257,22 @@ static int notmuchfs_rename (const char* from, const char* to)
  assert(from[0] == '/');
  assert(to[0] == '/');
 
+ char        query_from[PATH_MAX];
+ char        query_to[PATH_MAX];
+ char        subdir_from[4];
+ char        subdir_to[4];
+ const char *name_from;
+ const char *name_to;
+ if (split_message_path(from, query_from, subdir_from, &name_from) &&
+     split_message_path(to, query_to, subdir_to, &name_to) &&
+     strcmp(subdir_from, "tmp") == 0 &&
+     strchr(name_from, '#') == NULL) {
+   /* Delivering a message from '/<query>/tmp/name' to e.g.
+    * '/<query>/new/name'.
+    */
+   return deliver_message(query_to, subdir_to, name_from, name_to);
+ }
+
  char    *last_pslash_from     = strrchr(from + 1, '#');
  char    *last_pslash_to       = strrchr(to + 1, '#');
  char    *last_slash_from      = strrchr(from + 1, '/');
@@ -1062,89 +9362,27 @@ static int notmuchfs_rename (const char* from, const char* to)
  trans_name_to[PATH_MAX - 1] = '\0';
  string_replace(trans_name_to, '#', '/');
 
- LOG_TRACE("rename(%s, %s)\n", trans_name_from, trans_name_to);
- if (rename(trans_name_from, trans_name_to) == -1)
-   return -errno;
-
-
- /* Rename it in the notmuch database too. */
  int                  res        = 0;
  struct fuse_context *p_fuse_ctx = fuse_get_context();
  notmuch_context_t    *p_ctx     =
    (notmuch_context_t *)p_fuse_ctx->private_data;
 
- database_open(p_ctx, TRUE);
-
- if (notmuch_database_begin_atomic(p_ctx->db) != NOTMUCH_STATUS_SUCCESS) {
-   res = -EIO;
- }
- else {
-   /* If renaming from/to the same name, skip this - it gets confused. The
-    * mutt bug 2476 workaround can cause this, but it's also legitimately
-    * possible.
-    */
-   if (strncmp(trans_name_from, trans_name_to, PATH_MAX) != 0) {
-     LOG_TRACE("notmuch_database_add_message(%s)\n", trans_name_to);
-     if (notmuch_database_index_file(p_ctx->db, trans_name_to, NULL, NULL) !=
-         NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
-       LOG_TRACE("WARNING: Did not find message in database: %s\n",
-                 trans_name_to);
-     }
-     else {
-       LOG_TRACE("notmuch_database_remove_message(%s)\n", trans_name_from);
-       notmuch_status_t status =
-         notmuch_database_remove_message(p_ctx->db, trans_name_from);
-       if (status != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
-         LOG_TRACE("WARNING: Did not find old message in database: %s\n",
-                   trans_name_from);
-         /* Continue, can't do anything about it anyway. */
-       }
-     }
-   }
+ /* A message deleted with delete_tag is gone as far as the client knows. */
+ if (writer_is_pending_delete(p_ctx, trans_name_from))
+   return -ENOENT;
 
-   /* Lookup the message again here to sync the maildir flags. Do *not* use
-    * the message returned by notmuch_database_add_message(), it seems to
-    * refer to the file name that is subsequently removed above.
-    */
-   notmuch_message_t *p_message;
-   LOG_TRACE("rename notmuch lookup by name: %s\n", trans_name_to);
-   if (notmuch_database_find_message_by_filename(p_ctx->db, trans_name_to,
-                                                 &p_message) ==
-       NOTMUCH_STATUS_SUCCESS) {
-     /* We just put it there, it should still be there. */
-     assert(p_message != NULL);
+ LOG_TRACE("rename(%s, %s)\n", trans_name_from, trans_name_to);
+ if (rename(trans_name_from, trans_name_to) == -1)
+   return -errno;
 
-     LOG_TRACE("notmuch_message_maildir_flags_to_tags(%s)\n", trans_name_to);
-     notmuch_message_maildir_flags_to_tags(p_message);
+ /* Make the new name visible in cached listings straight away. */
+ cache_rename(p_ctx, last_slash_from + 1, last_slash_to + 1);
+ negcache_forget(p_ctx, trans_name_to);
 
-     if (global_config.mutt_2476_workaround_allowed) {
-       /* If mutt just moved the file to 'new', add the 'unread' flag.
-        * notmuch_message_maildir_flags_to_tags() does not do this because it's
-        * somewhat against the interpretation of the maildir spec, but it is
-        * what mutt means.
-        */
-       if (mutt_2476_workaround == 1) {
-         LOG_TRACE("notmuch_message_add_tag(%s, unread)\n", trans_name_to);
-         if (notmuch_message_add_tag(p_message, "unread") !=
-             NOTMUCH_STATUS_SUCCESS) {
-           /* Ignore all errors. Flags will go slightly out of sync now until
-            * 'notmuch new' fixes them.
-            */
-         }
-       }
-     }
-     notmuch_message_destroy(p_message);
-   }
-   else {
-     /* Ignore all errors. Flags will go slightly out of sync now until
-      * 'notmuch new' fixes them.
-      */
-   }
-   if (notmuch_database_end_atomic(p_ctx->db) != NOTMUCH_STATUS_SUCCESS)
-     res = -EIO;
- }
 
- database_close(p_ctx);
+ /* Rename it in the notmuch database too. */
+ rename_job_t job = { trans_name_from, trans_name_to, mutt_2476_workaround };
+ res = pool_run(p_ctx, POOL_CLASS_UPDATE, FALSE, rename_job, &job);
 
  return res;
 }
@@ -1153,57 +9391,61 @@ static int notmuchfs_rename (const char* from, const char* to)
 
 static int notmuchfs_unlink (const char* path)
 {
- char trans_name[PATH_MAX];
+ char        trans_name[PATH_MAX];
+ char        query[PATH_MAX];
+ char        subdir[4];
+ const char *name;
+
+ if (global_config.deliver_dir != NULL &&
+     split_message_path(path, query, subdir, &name) &&
+     strchr(name, '#') == NULL) {
+   /* Abandoning a message being delivered, or deleting one just
+    * delivered.
+    */
+   int res = deliver_path(trans_name, subdir, name);
+   if (res != 0)
+     return res;
+   LOG_TRACE("unlink delivery(%s)\n", trans_name);
+   if (unlink(trans_name) != 0)
+     return -errno;
+   return 0;
+ }
 
  /* Ignore the initial '/' */
  assert(path[0] == '/');
  path++;
 
- char *last_pslash = strrchr(path, '#');
+ char                *last_pslash = strrchr(path, '#');
+ const char          *vname       = NULL;
+ struct fuse_context *p_fuse_ctx  = fuse_get_context();
+ notmuch_context_t   *p_ctx       =
+   (notmuch_context_t *)p_fuse_ctx->private_data;
 
  if (last_pslash != NULL) {
    char *last_slash = strrchr(path, '/');
 
-   strncpy(trans_name, last_slash + 1, PATH_MAX - 1);
+   vname = last_slash + 1;
+   strncpy(trans_name, vname, PATH_MAX - 1);
    trans_name[PATH_MAX - 1] = '\0';
    string_replace(trans_name, '#', '/');
 
    path = trans_name;
  }
 
- if (global_config.delete_tag != NULL) {
-   struct fuse_context *p_fuse_ctx = fuse_get_context();
-   notmuch_context_t    *p_ctx     =
-     (notmuch_context_t *)p_fuse_ctx->private_data;
-
-   database_open(p_ctx, TRUE);
-
-   LOG_TRACE("notmuch_database_find_message_by_filename(%s)\n", path);
-   notmuch_message_t *message;
-   notmuch_status_t status =
-     notmuch_database_find_message_by_filename(p_ctx->db, path, &message);
-   switch (status) {
-     case NOTMUCH_STATUS_SUCCESS:
-       break;
-     case NOTMUCH_STATUS_OUT_OF_MEMORY:
-       database_close(p_ctx);
-       return -ENOMEM;
-     default:
-       database_close(p_ctx);
-       return -EIO;
-   }
+ if (global_config.delete_tag != NULL && last_pslash != NULL) {
+   if (writer_is_pending_delete(p_ctx, path))
+     return -ENOENT;
 
-   LOG_TRACE("notmuch_message_add_tag(%s, %s)\n", path,
-             global_config.delete_tag);
-   if (notmuch_message_add_tag(message, global_config.delete_tag) !=
-       NOTMUCH_STATUS_SUCCESS) {
-     /* Ignore all errors, there's nothing we can do about them anyway. This
-      * will mean a deleted message is 'resurrected', which the user can
-      * clearly see and retry.
-      */
-   }
+   struct stat stbuf;
+   if (stat(path, &stbuf) != 0)
+     return -errno;
 
-   database_close(p_ctx);
+   /* Tagging is done later by the writer thread, batched with any other
+    * deletions that arrive in the meantime. The message is hidden from
+    * listings until then.
+    */
+   LOG_TRACE("unlink queue delete tag(%s)\n", path);
+   writer_queue(p_ctx, WRITER_OP_DELETE_TAG, path, NULL);
  }
  else {
    LOG_TRACE("unlink(%s)\n", path);
@@ -1211,6 +9453,9 @@ static int notmuchfs_unlink (const char* path)
      return -errno;
  }
 
+ if (vname != NULL)
+   cache_mark_deleted(p_ctx, vname);
+
  return 0;
 }
 
@@ -1243,6 +9488,165 @@ static int notmuchfs_readlink (const char* path, char* buf, size_t size)
 
 /*============================================================================*/
 
+/**
+ * The arguments of tags_job().
+ */
+typedef struct
+{
+ /** The real file name of the message. */
+ const char *filename;
+ /** The buffer to fill with the tags. */
+ strbuf_t    tags;
+} tags_job_t;
+
+/**
+ * A pool job to look up the tags of a message.
+ *
+ * @param[in]     p_ctx The notmuch context.
+ * @param[in,out] arg   The tags_job_t.
+ * @return 0 on success, -ENODATA if the message isn't in the database, or
+ *         -EIO.
+ */
+static int tags_job (notmuch_context_t *p_ctx, void *arg)
+{
+ tags_job_t         *p_job = (tags_job_t *)arg;
+ notmuch_database_t *p_db  = database_open(p_ctx, FALSE);
+ notmuch_message_t  *p_message;
+ int                 res   = 0;
+
+ if (notmuch_database_find_message_by_filename(p_db, p_job->filename,
+                                               &p_message) !=
+     NOTMUCH_STATUS_SUCCESS) {
+   res = -EIO;
+ }
+ else if (p_message == NULL) {
+   res = -ENODATA;
+ }
+ else {
+   strbuf_append_tags(&p_job->tags, p_message);
+   notmuch_message_destroy(p_message);
+ }
+ database_close(p_ctx, p_db);
+ return res;
+}
+
+/**
+ * Find the real file name of a virtual message path.
+ *
+ * @param[in]  path     The virtual path.
+ * @param[out] filename The real file name. Must be PATH_MAX long.
+ * @return TRUE if 'path' is a virtual message '/<query>/<subdir>/<name>'.
+ */
+static bool message_filename (const char *path, char *filename)
+{
+ char        query[PATH_MAX];
+ char        subdir[4];
+ const char *name;
+
+ if (!split_message_path(path, query, subdir, &name) ||
+     strchr(name, '#') == NULL)
+   return FALSE;
+
+ strncpy(filename, name, PATH_MAX - 1);
+ filename[PATH_MAX - 1] = '\0';
+ string_replace(filename, '#', '/');
+ return TRUE;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_setxattr (const char *path,
+                               const char *name,
+                               const char *value,
+                               size_t      size,
+                               int         flags)
+{
+ if (!is_query_dir_path(path))
+   return -ENOTSUP;
+
+ if (setxattr(path + 1, name, value, size, flags) == -1)
+   return -errno;
+ return 0;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_getxattr (const char *path,
+                               const char *name,
+                               char       *value,
+                               size_t      size)
+{
+ char filename[PATH_MAX];
+ if (message_filename(path, filename)) {
+   if (strcmp(name, XATTR_TAGS) != 0)
+     return -ENODATA;
+
+   struct fuse_context *p_fuse_ctx = fuse_get_context();
+   notmuch_context_t   *p_ctx      =
+     (notmuch_context_t *)p_fuse_ctx->private_data;
+
+   tags_job_t job = { filename, { NULL, 0, 0 } };
+   int        res = pool_run(p_ctx, POOL_CLASS_READ, FALSE, tags_job, &job);
+   if (res == 0) {
+     if (size == 0)
+       res = (int)job.tags.length;
+     else if (size < job.tags.length)
+       res = -ERANGE;
+     else {
+       memcpy(value, job.tags.data, job.tags.length);
+       res = (int)job.tags.length;
+     }
+   }
+   free(job.tags.data);
+   return res;
+ }
+
+ if (!is_query_dir_path(path))
+   return -ENOTSUP;
+
+ ssize_t res = getxattr(path + 1, name, value, size);
+ if (res == -1)
+   return -errno;
+ return (int)res;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_listxattr (const char *path, char *list, size_t size)
+{
+ char filename[PATH_MAX];
+ if (message_filename(path, filename)) {
+   if (size == 0)
+     return sizeof(XATTR_TAGS);
+   if (size < sizeof(XATTR_TAGS))
+     return -ERANGE;
+   memcpy(list, XATTR_TAGS, sizeof(XATTR_TAGS));
+   return sizeof(XATTR_TAGS);
+ }
+
+ if (!is_query_dir_path(path))
+   return -ENOTSUP;
+
+ ssize_t res = listxattr(path + 1, list, size);
+ if (res == -1)
+   return -errno;
+ return (int)res;
+}
+
+/*============================================================================*/
+
+static int notmuchfs_removexattr (const char *path, const char *name)
+{
+ if (!is_query_dir_path(path))
+   return -ENOTSUP;
+
+ if (removexattr(path + 1, name) == -1)
+   return -errno;
+ return 0;
+}
+
+/*============================================================================*/
+
 static struct fuse_operations notmuchfs_oper = {
     .init       = notmuchfs_init,
     .destroy    = notmuchfs_destroy,
@@ -1253,12 +9657,23 @@ static struct fuse_operations notmuchfs_oper = {
     .open       = notmuchfs_open,
     .release    = notmuchfs_release,
     .read       = notmuchfs_read,
+    .read_buf   = notmuchfs_read_buf,
+    .write      = notmuchfs_write,
+    .create     = notmuchfs_create,
+    .mknod      = notmuchfs_mknod,
+    .truncate   = notmuchfs_truncate,
+    .ftruncate  = notmuchfs_ftruncate,
+    .utimens    = notmuchfs_utimens,
     .mkdir      = notmuchfs_mkdir,
     .rmdir      = notmuchfs_rmdir,
     .rename     = notmuchfs_rename,
     .unlink     = notmuchfs_unlink,
     .symlink    = notmuchfs_symlink,
-    .readlink   = notmuchfs_readlink
+    .readlink   = notmuchfs_readlink,
+    .setxattr   = notmuchfs_setxattr,
+    .getxattr   = notmuchfs_getxattr,
+    .listxattr  = notmuchfs_listxattr,
+    .removexattr = notmuchfs_removexattr
 };
 
 /*============================================================================*/
@@ -1270,6 +9685,7 @@ static struct fuse_operations notmuchfs_oper = {
 enum {
   KEY_HELP,
   KEY_VERSION,
+  KEY_NEGATIVE_TIMEOUT,
 };
 
 #define NOTMUCHFS_OPT(t, p, v) { t, offsetof(struct notmuchfs_config, p), v }
@@ -1278,6 +9694,24 @@ static struct fuse_opt notmuchfs_opts[] = {
   NOTMUCHFS_OPT("backing_dir=%s",               backing_dir, 0),
   NOTMUCHFS_OPT("mail_dir=%s",                  mail_dir, 0),
   NOTMUCHFS_OPT("delete_tag=%s",                delete_tag, 0),
+  NOTMUCHFS_OPT("deliver_dir=%s",               deliver_dir, 0),
+  NOTMUCHFS_OPT("cache_ttl=%u",                 cache_ttl, 0),
+  NOTMUCHFS_OPT("writer_delay=%u",              writer_delay_ms, 0),
+  NOTMUCHFS_OPT("writer_batch=%u",              writer_batch_size, 0),
+  NOTMUCHFS_OPT("threads=%u",                   threads, 0),
+  NOTMUCHFS_OPT("max_idle_threads=%u",          max_idle_threads, 0),
+  NOTMUCHFS_OPT("cpu_affinity=%s",              cpu_affinity, 0),
+  NOTMUCHFS_OPT("bulk_threshold=%u",            bulk_threshold, 0),
+  NOTMUCHFS_OPT("negative_cache=%u",            negative_cache, 0),
+  NOTMUCHFS_OPT("sort_by_inode",                sort_by_inode, 1),
+  NOTMUCHFS_OPT("xattr_tags",                   xattr_tags, 1),
+  NOTMUCHFS_OPT("mime_parts",                   mime_parts, 1),
+  NOTMUCHFS_OPT("compressed",                   compressed, 1),
+  NOTMUCHFS_OPT("compressed_cache=%u",          compressed_cache, 0),
+  NOTMUCHFS_OPT("file_tiers=%s",                file_tiers, 0),
+  NOTMUCHFS_OPT("prefer_cached",                prefer_cached, 1),
+  NOTMUCHFS_OPT("tag_index",                    tag_index, 1),
+  NOTMUCHFS_OPT("stream_listings",              stream_listings, 1),
   NOTMUCHFS_OPT("mutt_2476_workaround",         mutt_2476_workaround_allowed, 1),
   NOTMUCHFS_OPT("nomutt_2476_workaround",       mutt_2476_workaround_allowed, 0),
   NOTMUCHFS_OPT("--mutt_2476_workaround=true",  mutt_2476_workaround_allowed, 1),
@@ -1287,6 +9721,7 @@ static struct fuse_opt notmuchfs_opts[] = {
   FUSE_OPT_KEY("--version", KEY_VERSION),
   FUSE_OPT_KEY("-h",        KEY_HELP),
   FUSE_OPT_KEY("--help",    KEY_HELP),
+  FUSE_OPT_KEY("negative_timeout=", KEY_NEGATIVE_TIMEOUT),
   FUSE_OPT_END
 };
 
@@ -1303,6 +9738,42 @@ static void print_notmuchfs_usage (char *arg0) {
           "    -o backing_dir=PATH  Path to backing directory (required)\n"
           "    -o mail_dir=PATH     Path to parent directory of notmuch database (required)\n"
           "    -o delete_tag=TAG    Tag to apply when a mail is deleted\n"
+          "    -o deliver_dir=PATH  Maildir (inside mail_dir) to store messages\n"
+          "                         delivered into virtual maildirs\n"
+          "    -o cache_ttl=SECS    Time to trust cached query results, if the\n"
+          "                         database can't be watched (default: 0)\n"
+          "    -o writer_delay=MS   Time to collect database updates into one\n"
+          "                         transaction (default: 100)\n"
+          "    -o writer_batch=N    Maximum database updates per transaction\n"
+          "                         (default: 1000)\n"
+          "    -o threads=N         Maximum worker threads for each class of\n"
+          "                         database operation (default: 4, at\n"
+          "                         least 2)\n"
+          "    -o max_idle_threads=N\n"
+          "                         Maximum idle worker threads kept for each\n"
+          "                         class (default: 1)\n"
+          "    -o cpu_affinity=CPUS CPUs to run worker threads on, e.g. 0-3,6\n"
+          "    -o bulk_threshold=N  Database operations per second above which\n"
+          "                         a process gets lower priority (default: 50)\n"
+          "    -o negative_cache=N  Message names remembered not to exist\n"
+          "                         (default: 4096)\n"
+          "    -o sort_by_inode     List messages in order of real inode number\n"
+          "    -o xattr_tags        Give tags only as extended attributes, not in\n"
+          "                         an X-Label header\n"
+          "    -o mime_parts        Give each message a .parts/ directory of\n"
+          "                         its MIME parts\n"
+          "    -o compressed        Read gzip (or zstd) compressed message files\n"
+          "                         decompressed\n"
+          "    -o compressed_cache=MB\n"
+          "                         Decompressed messages kept in memory\n"
+          "                         (default: 64)\n"
+          "    -o file_tiers=DIRS   Directories of message files, fastest first,\n"
+          "                         e.g. local:/nfs/mail, to choose between\n"
+          "                         duplicate copies of a message\n"
+          "    -o prefer_cached     Prefer duplicate copies in the page cache\n"
+          "    -o tag_index         Keep every message's tags in memory, to\n"
+          "                         answer tag-only queries without searching\n"
+          "    -o stream_listings   List query results while the query runs\n"
           "    -o mutt_2476_workaround\n"
           "    -o nomutt_2476_workaround (default)\n"
           , arg0);
@@ -1315,8 +9786,14 @@ static int notmuchfs_opt_proc (void             *data,
                                struct fuse_args *outargs)
 {
  (void)data;
- (void)arg;
  switch (key) {
+   case FUSE_OPT_KEY_NONOPT:
+     if (global_config.mountpoint == NULL) {
+       /* Resolve it now, since FUSE changes directory when daemonizing. */
+       global_config.mountpoint = realpath(arg, NULL);
+     }
+     return 1;
+
    case KEY_HELP:
      print_notmuchfs_usage(outargs->argv[0]);
      fuse_opt_add_arg(outargs, "-ho");
@@ -1328,18 +9805,131 @@ static int notmuchfs_opt_proc (void             *data,
      fuse_opt_add_arg(outargs, "--version");
      fuse_main(outargs->argc, outargs->argv, &notmuchfs_oper, NULL);
      exit(0);
+
+   case KEY_NEGATIVE_TIMEOUT:
+     /* Note it, and leave it for FUSE. */
+     global_config.negative_timeout_given = TRUE;
+     return 1;
  }
  return 1;
 }
 
 /*============================================================================*/
 
+/**
+ * Parse a list of CPUs, such as "0-3,6".
+ *
+ * @param[in]  list   The list.
+ * @param[out] p_cpus The set of CPUs in 'list'.
+ * @return TRUE on success, FALSE if 'list' is malformed or empty.
+ */
+static bool parse_cpu_list (const char *list, cpu_set_t *p_cpus)
+{
+ const char *p = list;
+
+ CPU_ZERO(p_cpus);
+ while (*p != '\0') {
+   char         *end;
+   unsigned long first = strtoul(p, &end, 10);
+   unsigned long last  = first;
+   if (end == p)
+     return FALSE;
+   if (*end == '-') {
+     p    = end + 1;
+     last = strtoul(p, &end, 10);
+     if (end == p || last < first)
+       return FALSE;
+   }
+   if (last >= CPU_SETSIZE)
+     return FALSE;
+   for (unsigned long cpu = first; cpu <= last; cpu++)
+     CPU_SET(cpu, p_cpus);
+
+   p = end;
+   if (*p == ',')
+     p++;
+   else if (*p != '\0')
+     return FALSE;
+ }
+ return CPU_COUNT(p_cpus) > 0;
+}
+
+/**
+ * Parse a list of directories, such as "local:/nfs/mail".
+ *
+ * @param[in]  list      The list.
+ * @param[in]  base      The directory that relative paths are relative to.
+ * @param[out] p_dirs    The absolute directory paths, without trailing
+ *                       slashes.
+ * @param[out] p_n_dirs  The number of 'p_dirs'.
+ * @return TRUE on success, FALSE if 'list' has an empty entry.
+ */
+static bool parse_dir_list (const char  *list,
+                            const char  *base,
+                            char      ***p_dirs,
+                            unsigned    *p_n_dirs)
+{
+ const char *p           = list;
+ /* notmuch gives file names under mail_dir without its trailing slashes. */
+ size_t      base_length = strlen(base);
+ while (base_length > 1 && base[base_length - 1] == '/')
+   base_length--;
+
+ *p_dirs   = NULL;
+ *p_n_dirs = 0;
+ for (;;) {
+   const char *end    = strchrnul(p, ':');
+   size_t      length = end - p;
+   while (length > 1 && p[length - 1] == '/')
+     length--;
+   if (length == 0)
+     return FALSE;
+
+   char *dir;
+   if (p[0] == '/') {
+     dir = strndup(p, length);
+   }
+   else if (asprintf(&dir, "%.*s/%.*s", (int)base_length, base, (int)length,
+                     p) < 0) {
+     return FALSE;
+   }
+   *p_dirs = realloc(*p_dirs, (*p_n_dirs + 1) * sizeof(char *));
+   (*p_dirs)[(*p_n_dirs)++] = dir;
+
+   if (*end == '\0')
+     return TRUE;
+   p = end + 1;
+ }
+}
+
+/*============================================================================*/
+
 int main(int argc, char *argv[])
 {
  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+ global_config.writer_delay_ms   = 100;
+ global_config.writer_batch_size = 1000;
+ global_config.threads           = 4;
+ global_config.max_idle_threads  = 1;
+ global_config.bulk_threshold    = 50;
+ global_config.negative_cache    = 4096;
+ global_config.compressed_cache  = 64;
+
  fuse_opt_parse(&args, &global_config, notmuchfs_opts, notmuchfs_opt_proc);
 
+ /* Let the kernel remember missing names briefly too, unless told
+  * otherwise. Message names mostly come into existence through notmuchfs
+  * itself, which the kernel notices.
+  */
+ if (!global_config.negative_timeout_given)
+   fuse_opt_add_arg(&args, "-onegative_timeout=" DEFAULT_NEGATIVE_TIMEOUT);
+
+ /* Report real inode numbers (e.g. mutt sorts messages by them, to read
+  * them in disk order), rather than ones made up by FUSE.
+  */
+ fuse_opt_add_arg(&args, "-ouse_ino");
+
  if (global_config.backing_dir == NULL ||
      global_config.mail_dir == NULL) {
    fprintf(stderr, "Required option(s) missing. See \"%s --help\".\n",
@@ -1362,6 +9952,57 @@ int main(int argc, char *argv[])
    exit(1);
  }
 
+ if (global_config.deliver_dir != NULL) {
+   /* notmuch needs the absolute path of each message to index it. */
+   char *deliver_dir = realpath(global_config.deliver_dir, NULL);
+   char *mail_dir    = realpath(global_config.mail_dir, NULL);
+   if (deliver_dir == NULL || mail_dir == NULL ||
+       strncmp(deliver_dir, mail_dir, strlen(mail_dir)) != 0 ||
+       deliver_dir[strlen(mail_dir)] != '/') {
+     fprintf(stderr, "Deliver dir \"%s\" must be inside mail dir \"%s\".\n",
+             global_config.deliver_dir, global_config.mail_dir);
+     exit(1);
+   }
+   free(mail_dir);
+   global_config.deliver_dir = deliver_dir;
+
+   const char *subdirs[] = { "cur", "new", "tmp" };
+   for (size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+     char subdir[PATH_MAX];
+     snprintf(subdir, PATH_MAX, "%s/%s", deliver_dir, subdirs[i]);
+     if (stat(subdir, &stbuf) != 0 || !S_ISDIR(stbuf.st_mode)) {
+       fprintf(stderr, "Deliver dir \"%s\" is not a maildir.\n",
+               deliver_dir);
+       exit(1);
+     }
+   }
+ }
+
+ if (global_config.writer_batch_size == 0) {
+   fprintf(stderr, "Invalid writer_batch \"0\".\n");
+   exit(1);
+ }
+
+ if (global_config.threads == 0) {
+   fprintf(stderr, "Invalid threads \"0\".\n");
+   exit(1);
+ }
+
+ if (global_config.cpu_affinity != NULL &&
+     !parse_cpu_list(global_config.cpu_affinity, &global_config.cpus)) {
+   fprintf(stderr, "Invalid cpu_affinity \"%s\".\n",
+           global_config.cpu_affinity);
+   exit(1);
+ }
+
+ if (global_config.file_tiers != NULL &&
+     !parse_dir_list(global_config.file_tiers, global_config.mail_dir,
+                     &global_config.tiers, &global_config.n_tiers)) {
+   fprintf(stderr, "Invalid file_tiers \"%s\".\n",
+           global_config.file_tiers);
+   exit(1);
+ }
+
 
  int ret = fuse_main(args.argc, args.argv, &notmuchfs_oper,
                      NULL /* userdata */);
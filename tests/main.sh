@@ -16,11 +16,76 @@ set -x
 
 trap "cleanup" SIGINT SIGTERM EXIT
 
+# The tests that change the mail directory or database use a scratch one,
+# with its own notmuch configuration, leaving the real ones alone.
+SCRATCH="$TEST_ROOT/scratch"
+SCRATCH_MAIL="$SCRATCH/mail"
+SCRATCH_MOUNT="$SCRATCH/mount"
+
 function cleanup {
+  fusermount -u "$SCRATCH_MOUNT"
   fusermount -u "$TEST_ROOT/mount"
   rm -Rf "$TEST_ROOT"
 }
 
+# Run notmuch on the scratch database.
+function scratch_notmuch {
+  NOTMUCH_CONFIG="$SCRATCH/notmuch-config" notmuch "$@"
+}
+
+# (Re)mount notmuchfs on the scratch mail directory, with an empty backing
+# store, passing on any other arguments as options.
+function scratch_mount {
+  fusermount -u "$SCRATCH_MOUNT" 2>/dev/null
+  rm -Rf "$SCRATCH/backing"
+  mkdir -p "$SCRATCH/backing" "$SCRATCH_MOUNT"
+  NOTMUCH_CONFIG="$SCRATCH/notmuch-config" "$NOTMUCHFS" "$SCRATCH_MOUNT" \
+    -o backing_dir="$SCRATCH/backing" \
+    -o mail_dir="$SCRATCH_MAIL" "$@" || die "mount scratch notmuchfs $*"
+}
+
+# Write a test message into the scratch mail directory: file name, message
+# ID (before the '@') and date (in seconds). The body has a line starting
+# with 'From ', as real mail does.
+function scratch_message {
+  cat > "$SCRATCH_MAIL/cur/$1" <<EOM
+From: Sender <sender@example.com>
+To: Recipient <recipient@example.com>
+Subject: Test message $2
+Message-ID: <$2@example.com>
+Date: `date -R -d @$3`
+
+This is test message $2.
+From here on, it's just padding.
+EOM
+}
+
+# Retry a test for up to 30 seconds, for changes made in the background.
+function wait_for {
+  for i in `seq 1 30`; do
+    eval "$1" && return 0
+    sleep 1
+  done
+  return 1
+}
+
+# Print the message IDs in an mboxcl2 file, skipping each body by its
+# Content-Length rather than looking for the next 'From ' line.
+function mbox_ids {
+  LC_ALL=C awk '
+    skip > 0 { skip -= length($0) + 1; next }
+    !header && /^From / { header = 1; id = ""; next }
+    header && tolower($1) == "message-id:" { id = $2 }
+    header && tolower($1) == "content-length:" { skip = $2 }
+    header && $0 == "" { header = 0; gsub(/[<>]/, "", id); print id }
+  ' "$1"
+}
+
+# Print the value of a line of the scratch mount's stats file.
+function stat_value {
+  grep "^$1 " "$SCRATCH_MOUNT/.notmuchfs_stats" | cut -d" " -f2
+}
+
 mkdir -p "$TEST_ROOT"
 mkdir -p "$TEST_ROOT/backing"
 mkdir -p "$TEST_ROOT/mount"
@@ -75,5 +140,382 @@ IFS=$SAVEIFS
 
 rmdir "$TEST_ROOT/mount/$QUERY" || die "rmdir"
 
+
+# Set up the scratch mail directory: eight messages, tagged
+#   msg1: inbox unread work    msg5: inbox unread
+#   msg2: inbox work           msg6: inbox
+#   msg3: work                 msg7: (none)
+#   msg4: inbox unread flagged msg8: inbox unread spam (excluded)
+mkdir -p "$SCRATCH_MAIL/cur" "$SCRATCH_MAIL/new" "$SCRATCH_MAIL/tmp"
+cat > "$SCRATCH/notmuch-config" <<EOM
+[database]
+path=$SCRATCH_MAIL
+[new]
+tags=inbox;unread;
+[search]
+exclude_tags=spam;
+[maildir]
+synchronize_flags=true
+EOM
+for i in `seq 1 8`; do
+  scratch_message "msg$i:2," "msg$i" $((1700000000 + i * 3600))
+done
+scratch_notmuch new --quiet || die "scratch notmuch new"
+scratch_notmuch tag +work -- id:msg1@example.com or id:msg2@example.com \
+  or id:msg3@example.com
+scratch_notmuch tag -inbox -unread -- id:msg3@example.com or id:msg7@example.com
+scratch_notmuch tag -unread -- id:msg2@example.com or id:msg6@example.com
+scratch_notmuch tag +flagged -- id:msg4@example.com
+scratch_notmuch tag +spam -- id:msg8@example.com
+
+
+# Unlinking messages with '-o delete_tag' tags them instead. They disappear
+# from listings straight away, and a burst of deletions is tagged in fewer
+# database transactions than there are deletions.
+scratch_mount -o delete_tag=deleted -o writer_delay=1000
+DQUERY="tag:work and not tag:deleted"
+mkdir "$SCRATCH_MOUNT/$DQUERY" || die "mkdir $DQUERY"
+[ `ls -1 "$SCRATCH_MOUNT/$DQUERY/cur" | wc -l` == 3 ] || die "delete_tag list"
+REVISION=`scratch_notmuch count --lastmod "*" | cut -f3`
+rm "$SCRATCH_MOUNT/$DQUERY/cur/"* || die "delete_tag rm"
+[ -z "`ls -A "$SCRATCH_MOUNT/$DQUERY/cur"`" ] || die "delete_tag not hidden"
+wait_for '[ "`scratch_notmuch count tag:deleted`" == 3 ]' ||
+  die "delete_tag not tagged"
+[ `scratch_notmuch count --lastmod "*" | cut -f3` -lt $((REVISION + 3)) ] ||
+  die "delete_tag not batched"
+[ -z "`ls -A "$SCRATCH_MOUNT/$DQUERY/cur"`" ] || die "delete_tag listed again"
+test -e "$SCRATCH_MAIL/cur/msg1:2," || die "delete_tag unlinked"
+scratch_notmuch tag -deleted -- tag:deleted
+
+
+# Deliver a message into a query: through tmp/, then renamed into cur/. It's
+# stored in the deliver_dir, and indexed with the tags the query requires,
+# even where its maildir flags say otherwise ('S' is not unread).
+mkdir -p "$SCRATCH_MAIL/delivered/cur" "$SCRATCH_MAIL/delivered/new" \
+  "$SCRATCH_MAIL/delivered/tmp"
+scratch_mount -o deliver_dir="$SCRATCH_MAIL/delivered"
+DQUERY="tag:delivered and tag:unread and tag:flagged"
+mkdir "$SCRATCH_MOUNT/$DQUERY" || die "mkdir $DQUERY"
+cat > "$SCRATCH_MOUNT/$DQUERY/tmp/delivery" <<EOM || die "deliver write"
+From: Sender <sender@example.com>
+To: Recipient <recipient@example.com>
+Subject: Delivered message
+Message-ID: <delivered@example.com>
+Date: `date -R`
+
+Delivered through notmuchfs.
+EOM
+mv "$SCRATCH_MOUNT/$DQUERY/tmp/delivery" \
+  "$SCRATCH_MOUNT/$DQUERY/cur/delivery:2,S" || die "deliver rename"
+test -e "$SCRATCH_MAIL/delivered/cur/delivery:2,S" || die "delivered file"
+wait_for '[ "`scratch_notmuch count "id:delivered@example.com and ($DQUERY)"`" == 1 ]' ||
+  die "delivered tags"
+wait_for 'ls -1 "$SCRATCH_MOUNT/$DQUERY/cur" | grep -q "#delivery:2,S$"' ||
+  die "delivered message not listed"
+
+
+# Listings are cached, and refreshed when the database changes.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+COUNT=`scratch_notmuch count tag:inbox`
+[ `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" | wc -l` == $COUNT ] ||
+  die "cached listing"
+scratch_notmuch tag +inbox -- id:msg7@example.com
+wait_for '[ `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" | wc -l` == $((COUNT + 1)) ]' ||
+  die "cached listing not refreshed"
+scratch_notmuch tag -inbox -- id:msg7@example.com
+wait_for '[ `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" | wc -l` == $COUNT ]' ||
+  die "cached listing not refreshed back"
+
+
+# A change to the results of a cached query by someone else touches its cur/
+# directory, which watchers are told about.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" > /dev/null || die "list tag:inbox"
+MTIME=`stat -c %Y "$SCRATCH_MOUNT/tag:inbox/cur"`
+sleep 1
+WATCHER=""
+if command -v inotifywait > /dev/null; then
+  inotifywait -q -t 30 -e attrib "$SCRATCH_MOUNT/tag:inbox/cur" > /dev/null &
+  WATCHER=$!
+  sleep 1
+fi
+scratch_notmuch tag +inbox -- id:msg7@example.com
+wait_for '[ `stat -c %Y "$SCRATCH_MOUNT/tag:inbox/cur"` != $MTIME ]' ||
+  die "cur/ mtime not updated"
+if [ -n "$WATCHER" ]; then
+  wait $WATCHER || die "no inotify event for cur/"
+fi
+ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" | grep -q "#msg7:2,$" ||
+  die "refreshed listing"
+scratch_notmuch tag -inbox -- id:msg7@example.com
+
+
+# The .changes file lists the messages matching its query, then just those
+# changed since the revision it gave.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+CHANGES="$SCRATCH_MOUNT/tag:inbox/.changes"
+REVISION=`head -n 1 "$CHANGES" | cut -d" " -f2`
+[ "`sed -n 2p "$CHANGES"`" == "count `scratch_notmuch count tag:inbox`" ] ||
+  die ".changes count"
+grep "^+ " "$CHANGES" | cut -f1 | cut -c3- | sort > out1
+scratch_notmuch search --output=messages tag:inbox | sed s/id:// | sort > out2
+diff out1 out2 || die ".changes messages"
+rm -f out1 out2
+grep -q "^- " "$CHANGES" && die ".changes removals from revision 0"
+grep -q "^[+-] " "$CHANGES?since=$REVISION" && die ".changes since now"
+
+scratch_notmuch tag -inbox -- id:msg6@example.com
+scratch_notmuch tag +inbox -- id:msg7@example.com
+SINCE="$CHANGES?since=$REVISION"
+grep -q "^+ msg7@example.com	" "$SINCE" || die ".changes of an addition"
+grep -q "^- msg6@example.com$" "$SINCE" || die ".changes of a removal"
+[ `grep -c "^[+-] " "$SINCE"` == 2 ] || die ".changes since $REVISION"
+scratch_notmuch tag +inbox -- id:msg6@example.com
+scratch_notmuch tag -inbox -- id:msg7@example.com
+
+
+# The .mbox file holds the messages matching its query, found by their
+# Content-Length, each passed through unmodified.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+mbox_ids "$SCRATCH_MOUNT/tag:inbox/.mbox" | sort > out1
+scratch_notmuch search --output=messages tag:inbox | sed s/id:// | sort > out2
+diff out1 out2 || die ".mbox messages"
+rm -f out1 out2
+grep -c "^From here on" "$SCRATCH_MOUNT/tag:inbox/.mbox" > out1
+scratch_notmuch count tag:inbox > out2
+diff out1 out2 || die ".mbox content"
+rm -f out1 out2
+
+
+# Listings are run by the worker pool.
+scratch_mount -o threads=2
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" > /dev/null || die "list tag:inbox"
+[ "`stat_value pool.list.completed`" -ge 1 ] || die "pool list jobs"
+[ "`stat_value pool.list.threads`" -le 2 ] || die "pool list threads"
+
+
+# A query's refresh policy is an extended attribute of its directory: with a
+# long enough TTL, its cached results aren't refreshed.
+if command -v setfattr > /dev/null; then
+  scratch_mount
+  mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+  setfattr -n user.notmuchfs.ttl -v 3600 "$SCRATCH_MOUNT/tag:inbox" ||
+    die "setfattr ttl"
+  [ "`getfattr --only-values -n user.notmuchfs.ttl \
+      "$SCRATCH_MOUNT/tag:inbox"`" == 3600 ] || die "getfattr ttl"
+  COUNT=`ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" | wc -l`
+  scratch_notmuch tag +inbox -- id:msg7@example.com
+  sleep 3
+  [ `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" | wc -l` == $COUNT ] ||
+    die "ttl not honored"
+  scratch_notmuch tag -inbox -- id:msg7@example.com
+fi
+
+
+# Lookups of missing message names are remembered.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+MISSING="$SCRATCH_MOUNT/tag:inbox/cur/#no#such#message:2,"
+HITS=`stat_value negcache.hits`
+test -e "$MISSING" && die "missing message exists"
+# Past the kernel's own memory of the missing name.
+sleep 2
+test -e "$MISSING" && die "missing message exists"
+[ "`stat_value negcache.hits`" -gt $HITS ] || die "missing name not cached"
+
+
+# Looking up messages just listed is answered from the cached listing.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+HITS=`stat_value cache.stat_hits`
+ls -l "$SCRATCH_MOUNT/tag:inbox/cur" > /dev/null || die "list tag:inbox"
+[ "`stat_value cache.stat_hits`" -gt $HITS ] || die "getattr not cached"
+
+
+# Messages have the inode numbers of their real files.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+for NAME in `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur"`; do
+  REAL=`echo "$NAME" | tr "#" "/"`
+  [ `stat -c %i "$SCRATCH_MOUNT/tag:inbox/cur/$NAME"` == `stat -c %i "$REAL"` ] ||
+    die "inode of $NAME"
+done
+
+
+# With '-o xattr_tags', messages read exactly like their real files, and
+# their tags are an extended attribute.
+scratch_mount -o xattr_tags
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+for NAME in `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur"`; do
+  FILE="$SCRATCH_MOUNT/tag:inbox/cur/$NAME"
+  REAL=`echo "$NAME" | tr "#" "/"`
+  cmp "$FILE" "$REAL" || die "xattr_tags content of $NAME"
+  [ `stat -c %s "$FILE"` == `stat -c %s "$REAL"` ] ||
+    die "xattr_tags size of $NAME"
+  if command -v getfattr > /dev/null; then
+    ID=`formail -xMessage-id: < "$REAL" | tr -d "<> "`
+    TAGS=`scratch_notmuch search --output=tags "id:$ID" | tr "\\n" "," |
+          sed s/,\$//`
+    [ "`getfattr --only-values -n user.notmuch.tags "$FILE"`" == "$TAGS" ] ||
+      die "xattr_tags tags of $NAME"
+  fi
+done
+
+
+# The hdr/ view of a message is its X-Label and header block, up to and
+# including the first blank line.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+for NAME in `ls -1 "$SCRATCH_MOUNT/tag:inbox/cur"`; do
+  FILE="$SCRATCH_MOUNT/tag:inbox/hdr/$NAME"
+  head -n 1 "$FILE" | grep -q "^X-Label: " || die "hdr X-Label of $NAME"
+  tail -n +2 "$FILE" > out1
+  sed "/^\$/q" "`echo "$NAME" | tr "#" "/"`" > out2
+  diff out1 out2 || die "hdr content of $NAME"
+  rm -f out1 out2
+done
+
+
+# With '-o mime_parts', the parts of a message are decoded from base64 and
+# quoted-printable.
+head -c 3000 /dev/urandom > "$SCRATCH/data.bin"
+cat > "$SCRATCH_MAIL/cur/msg9:2," <<EOM
+From: Sender <sender@example.com>
+To: Recipient <recipient@example.com>
+Subject: Test message msg9
+Message-ID: <msg9@example.com>
+Date: `date -R -d @1700040000`
+MIME-Version: 1.0
+Content-Type: multipart/mixed; boundary="notmuchfs-test"
+
+--notmuchfs-test
+Content-Type: text/plain; charset=utf-8
+Content-Transfer-Encoding: quoted-printable
+
+Caf=C3=A9 =3D coffee, with a soft=
+ line break.
+--notmuchfs-test
+Content-Type: application/octet-stream
+Content-Disposition: attachment; filename="data.bin"
+Content-Transfer-Encoding: base64
+
+`base64 "$SCRATCH/data.bin"`
+--notmuchfs-test--
+EOM
+scratch_notmuch new --quiet || die "scratch notmuch new"
+scratch_mount -o mime_parts
+mkdir "$SCRATCH_MOUNT/id:msg9@example.com" || die "mkdir id:msg9"
+NAME=`ls -1 "$SCRATCH_MOUNT/id:msg9@example.com/cur"`
+PARTS="$SCRATCH_MOUNT/id:msg9@example.com/cur/$NAME.parts"
+printf "Caf\xc3\xa9 = coffee, with a soft line break." | cmp - "$PARTS/1" ||
+  die "quoted-printable part"
+cmp "$SCRATCH/data.bin" "$PARTS/2-data.bin" || die "base64 part"
+
+
+# With '-o compressed', a gzip compressed message reads (and has the size
+# of) its decompressed content.
+scratch_message "msg10" "msg10" 1700050000
+gzip "$SCRATCH_MAIL/cur/msg10"
+mv "$SCRATCH_MAIL/cur/msg10.gz" "$SCRATCH_MAIL/cur/msg10:2,"
+scratch_notmuch new --quiet || die "scratch notmuch new"
+scratch_mount -o compressed -o xattr_tags
+mkdir "$SCRATCH_MOUNT/id:msg10@example.com" || die "mkdir id:msg10"
+FILE="$SCRATCH_MOUNT/id:msg10@example.com/cur/`ls -1 \
+  "$SCRATCH_MOUNT/id:msg10@example.com/cur"`"
+zcat "$SCRATCH_MAIL/cur/msg10:2," > out2
+cmp "$FILE" out2 || die "compressed content"
+[ `stat -c %s "$FILE"` == `stat -c %s out2` ] || die "compressed size"
+rm -f out2
+
+
+# A message with several files is listed once, as the same one each time.
+mkdir -p "$SCRATCH_MAIL/copy/cur" "$SCRATCH_MAIL/copy/new" \
+  "$SCRATCH_MAIL/copy/tmp"
+cp "$SCRATCH_MAIL/cur/msg5:2," "$SCRATCH_MAIL/copy/cur/msg5:2,"
+scratch_notmuch new --quiet || die "scratch notmuch new"
+scratch_mount
+mkdir "$SCRATCH_MOUNT/id:msg5@example.com" || die "mkdir id:msg5"
+NAME=`ls -1 "$SCRATCH_MOUNT/id:msg5@example.com/cur"`
+[ `echo "$NAME" | wc -l` == 1 ] || die "duplicate listed twice"
+scratch_notmuch tag +duplicate -- id:msg5@example.com
+REVISION=`scratch_notmuch count --lastmod "*" | cut -f3`
+wait_for '[ "`stat_value cache.revision`" -ge $REVISION ]' ||
+  die "duplicate not refreshed"
+[ "`ls -1 "$SCRATCH_MOUNT/id:msg5@example.com/cur"`" == "$NAME" ] ||
+  die "duplicate changed file"
+scratch_notmuch tag -duplicate -- id:msg5@example.com
+
+
+# Queries made only of tags are answered from the tag index, once it's
+# built, and must give the same results as notmuch, including its handling of
+# excluded tags.
+scratch_mount -o tag_index
+wait_for '[ "`stat_value tagindex.revision`" != 0 ]' || die "tag index not built"
+
+TAG_QUERIES=("tag:inbox" "tag:unread and not tag:work" \
+             "tag:work or tag:flagged" "tag:inbox and tag:unread" \
+             "(tag:work or tag:unread) and not tag:flagged" \
+             "not (tag:inbox and tag:unread)" "tag:inbox not tag:work" "*" \
+             "tag:spam" "tag:work or tag:spam" "tag:inbox and not tag:spam")
+# Side by side tags are ORed by Xapian, and so left to notmuch.
+OTHER_QUERIES=("tag:work tag:flagged")
+
+HITS=`stat_value tagindex.hits`
+for TAG_QUERY in "${TAG_QUERIES[@]}" "${OTHER_QUERIES[@]}"; do
+  mkdir "$SCRATCH_MOUNT/$TAG_QUERY" || die "mkdir $TAG_QUERY"
+
+  # Each message is listed as one of its files.
+  ls -1 "$SCRATCH_MOUNT/$TAG_QUERY/cur" | tr "#" "/" | sort > out1
+  scratch_notmuch search --output=files "$TAG_QUERY" | sort > out2
+  [ `wc -l < out1` == "`scratch_notmuch count "$TAG_QUERY"`" ] ||
+    die "tag index count \"$TAG_QUERY\""
+  [ -z "`comm -23 out1 out2`" ] || die "tag index files \"$TAG_QUERY\""
+  rm -f out1 out2
+
+  rmdir "$SCRATCH_MOUNT/$TAG_QUERY" || die "rmdir $TAG_QUERY"
+done
+[ "`stat_value tagindex.hits`" == $((HITS + ${#TAG_QUERIES[@]})) ] ||
+  die "tag index not used"
+
+
+# A nested query directory lists the messages matching both queries, picked
+# out of its parent's cached results.
+scratch_mount -o tag_index
+wait_for '[ "`stat_value tagindex.revision`" != 0 ]' || die "tag index not built"
+mkdir "$SCRATCH_MOUNT/tag:inbox" || die "mkdir tag:inbox"
+ls -1 "$SCRATCH_MOUNT/tag:inbox/cur" > /dev/null || die "list tag:inbox"
+REFINED=`stat_value cache.refined`
+mkdir "$SCRATCH_MOUNT/tag:inbox/tag:unread" || die "mkdir tag:inbox/tag:unread"
+mkdir "$SCRATCH_MOUNT/tag:inbox/tag:unread/tag:flagged" ||
+  die "mkdir tag:inbox/tag:unread/tag:flagged"
+[ `ls -1 "$SCRATCH_MOUNT/tag:inbox/tag:unread/cur" | wc -l` == \
+  `scratch_notmuch count "(tag:inbox) and (tag:unread)"` ] ||
+  die "nested query count"
+[ `ls -1 "$SCRATCH_MOUNT/tag:inbox/tag:unread/tag:flagged/cur" | wc -l` == \
+  `scratch_notmuch count "(tag:inbox) and (tag:unread) and (tag:flagged)"` ] ||
+  die "doubly nested query count"
+[ "`stat_value cache.refined`" -gt $REFINED ] || die "nested query not refined"
+ls -1 "$SCRATCH_MOUNT/tag:inbox" | grep -q "^tag:unread$" ||
+  die "nested query not listed"
+
+
+# With '-o stream_listings', a query lists the same as without.
+scratch_mount
+mkdir "$SCRATCH_MOUNT/*" || die "mkdir *"
+ls -1 "$SCRATCH_MOUNT/*/cur" > out1 || die "list *"
+scratch_mount -o stream_listings
+mkdir "$SCRATCH_MOUNT/*" || die "mkdir *"
+ls -1 "$SCRATCH_MOUNT/*/cur" > out2 || die "stream *"
+diff out1 out2 || die "streamed listing"
+ls -1 "$SCRATCH_MOUNT/*/cur" > out2 || die "list streamed *"
+diff out1 out2 || die "listing after streaming"
+rm -f out1 out2
+
+
 echo "Success!"
 exit 0